@@ -0,0 +1,783 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <hexcell_utils.h>
+#include <hexcell_block.h>
+#include <hexcell_codec.h>
+
+/* Which block types carry a property */
+#define HC_T_REG        0x01
+#define HC_T_HARDLINK   0x02
+#define HC_T_SYMLINK    0x04
+#define HC_T_CHARDEV    0x08
+#define HC_T_BLOCKDEV   0x10
+#define HC_T_DIR        0x20
+#define HC_T_FIFO       0x40
+#define HC_T_ALL        0x7F
+
+/* How a property value is laid out in HCBlockProperty */
+enum { HC_PROP_SCALAR = 0, HC_PROP_STRING, HC_PROP_FRAMES, HC_PROP_OPTIONAL, HC_PROP_HOLES,
+    HC_PROP_SUMS, HC_PROP_SUM };
+
+typedef struct _HCPropertyDesc {
+    short           bid;
+    int             kind;
+    size_t          offset;     // offsetof(HCBlockProperty, ...)
+    int             size;       // Scalars only, in HCBlockProperty
+    int             wire;       // Scalars only, in the cell
+    int             types;
+} HCPropertyDesc;
+
+/* Properties in the order they are written */
+static const HCPropertyDesc __HCPropertyTable[] = {
+    { BID_PROP_TYPE,          HC_PROP_SCALAR, offsetof(HCBlockProperty, fType),      sizeof(short),              2, HC_T_ALL },
+    { BID_PROP_SIZE_INCELL,   HC_PROP_SCALAR, offsetof(HCBlockProperty, fSize1),     sizeof(unsigned long long), 8, HC_T_REG },
+    { BID_PROP_SIZE_ORIGINAL, HC_PROP_SCALAR, offsetof(HCBlockProperty, fSize2),     sizeof(unsigned long long), 8, HC_T_REG | HC_T_DIR },
+    { BID_PROP_FRAME_SIZE,    HC_PROP_SCALAR, offsetof(HCBlockProperty, frameSize),  sizeof(unsigned int),       4, HC_T_REG },
+    { BID_PROP_FRAME_TABLE,   HC_PROP_FRAMES, offsetof(HCBlockProperty, frameTable), 0,                          0, HC_T_REG },
+    { BID_PROP_CODEC,         HC_PROP_SCALAR, offsetof(HCBlockProperty, codec),      sizeof(short),              2, HC_T_REG },
+    { BID_PROP_DATA_REF,      HC_PROP_OPTIONAL, offsetof(HCBlockProperty, dataRef),  sizeof(unsigned long long), 8, HC_T_REG },
+    { BID_PROP_HOLE_MAP,      HC_PROP_HOLES,  offsetof(HCBlockProperty, holeTable),  0,                          0, HC_T_REG },
+    { BID_PROP_FRAME_SUMS,    HC_PROP_SUMS,   offsetof(HCBlockProperty, frameSums),  0,                          0, HC_T_REG },
+    { BID_PROP_PATHNAME,      HC_PROP_STRING, offsetof(HCBlockProperty, pathName),   0,                          0, HC_T_ALL },
+    { BID_PROP_LINKNAME,      HC_PROP_STRING, offsetof(HCBlockProperty, linkName),   0,                          0, HC_T_HARDLINK | HC_T_SYMLINK },
+    { BID_PROP_MODE,          HC_PROP_SCALAR, offsetof(HCBlockProperty, fMode),      sizeof(mode_t),             4, HC_T_ALL },
+    { BID_PROP_UID,           HC_PROP_SCALAR, offsetof(HCBlockProperty, fUID),       sizeof(uid_t),              4, HC_T_ALL },
+    { BID_PROP_GID,           HC_PROP_SCALAR, offsetof(HCBlockProperty, fGID),       sizeof(gid_t),              4, HC_T_ALL },
+    { BID_PROP_DEV1,          HC_PROP_SCALAR, offsetof(HCBlockProperty, dev1),       sizeof(unsigned int),       4, HC_T_CHARDEV | HC_T_BLOCKDEV },
+    { BID_PROP_DEV2,          HC_PROP_SCALAR, offsetof(HCBlockProperty, dev2),       sizeof(unsigned int),       4, HC_T_CHARDEV | HC_T_BLOCKDEV },
+    /* Covers everything before it, so it stays last */
+    { BID_PROP_BLOCK_SUM,     HC_PROP_SUM,    offsetof(HCBlockProperty, blockSum),   sizeof(unsigned int),       4, HC_T_ALL }
+};
+#define HC_PROPERTY_COUNT (sizeof(__HCPropertyTable) / sizeof(HCPropertyDesc))
+
+static int __HCTypeMask(short fType)
+{
+    switch(fType) {
+        case BLK_REG:      return HC_T_REG;
+        case BLK_HARDLINK: return HC_T_HARDLINK;
+        case BLK_SYMLINK:  return HC_T_SYMLINK;
+        case BLK_CHARDEV:  return HC_T_CHARDEV;
+        case BLK_BLOCKDEV: return HC_T_BLOCKDEV;
+        case BLK_DIR:      return HC_T_DIR;
+        case BLK_FIFO:     return HC_T_FIFO;
+        default:           return 0;
+    }
+}
+
+/* Whether a block carries a property, optional scalars are left out while
+   zero, the hole map while there are no holes and checksums unless the cell
+   has them */
+static int __HCPropertyPresent(const HCBlockProperty *property, const HCPropertyDesc *desc, int mask,
+    unsigned int flags)
+{
+    const unsigned char *field = (const unsigned char *)property + desc->offset;
+    int i;
+
+    if(!(desc->types & mask))
+        return 0;
+    if(desc->kind == HC_PROP_SUMS || desc->kind == HC_PROP_SUM)
+        return (flags & HC_CELL_CHECKSUMS) != 0;
+    if(desc->kind == HC_PROP_HOLES)
+        return property->holes != 0;
+    if(desc->kind != HC_PROP_OPTIONAL)
+        return 1;
+    for(i = 0; i < desc->size; i++)
+        if(field[i]) return 1;
+
+    return 0;
+}
+
+/* Length of the value of one property as written */
+static int __HCPropertyValueLength(const HCBlockProperty *property, const HCPropertyDesc *desc)
+{
+    const unsigned char *field = (const unsigned char *)property + desc->offset;
+
+    switch(desc->kind) {
+        case HC_PROP_STRING: return strlen((const char *)field);
+        case HC_PROP_FRAMES:
+        case HC_PROP_SUMS:   return 4 * property->frames;
+        case HC_PROP_HOLES:  return 16 * property->holes;
+        default:             return desc->wire;
+    }
+}
+
+/* A scalar field of HCBlockProperty, whatever its width */
+static unsigned long long __HCFieldGet(const unsigned char *field, int size)
+{
+    unsigned short v16 = 0;
+    unsigned int v32 = 0;
+    unsigned long long v64 = 0;
+
+    switch(size) {
+        case 2: memcpy(&v16, field, 2); return v16;
+        case 4: memcpy(&v32, field, 4); return v32;
+        default: memcpy(&v64, field, 8); return v64;
+    }
+}
+
+static void __HCFieldSet(unsigned char *field, int size, unsigned long long value)
+{
+    unsigned short v16 = (unsigned short)value;
+    unsigned int v32 = (unsigned int)value;
+
+    switch(size) {
+        case 2: memcpy(field, &v16, 2); break;
+        case 4: memcpy(field, &v32, 4); break;
+        default: memcpy(field, &value, 8);
+    }
+}
+
+/* Bit order of every byte of 'x' reversed, HCCharSwap() eight bytes at once */
+static unsigned long long __HCCharSwap8(unsigned long long x)
+{
+    x = (x >> 1 & 0x5555555555555555ULL) | (x & 0x5555555555555555ULL) << 1;
+    x = (x >> 2 & 0x3333333333333333ULL) | (x & 0x3333333333333333ULL) << 2;
+    x = (x >> 4 & 0x0F0F0F0F0F0F0F0FULL) | (x & 0x0F0F0F0F0F0F0F0FULL) << 4;
+
+    return x;
+}
+
+/**
+ * @brief store a pathname the way the cell says, whole string tables go
+ *        through in one call
+ * @param dst receives 'len' bytes, may be 'src'
+ * @param src the pathname, not NUL terminated
+ * @param len bytes in 'src'
+ * @param flags InfoBlock FLAGS of the cell, HC_CELL_PLAIN_NAMES copies
+ */
+void HCNameEncode(unsigned char *dst, const unsigned char *src, size_t len, unsigned int flags)
+{
+    unsigned long long x;
+    size_t i = 0;
+
+    if(flags & HC_CELL_PLAIN_NAMES) {
+        if(dst != src) memcpy(dst, src, len);
+        return;
+    }
+    /* Each byte is transformed on its own, so words of them can be too */
+    for(; i + 8 <= len; i += 8) {
+        memcpy(&x, src + i, 8);
+        x = __HCCharSwap8(x) ^ 0x1F1F1F1F1F1F1F1FULL;
+        memcpy(dst + i, &x, 8);
+    }
+    for(; i < len; i++)
+        dst[i] = HCCharSwap(src[i]) ^ 0x1F;
+}
+
+/**
+ * @brief undo HCNameEncode()
+ * @param dst receives 'len' bytes, may be 'src'
+ * @param src the stored pathname
+ * @param len bytes in 'src'
+ * @param flags InfoBlock FLAGS of the cell
+ */
+void HCNameDecode(unsigned char *dst, const unsigned char *src, size_t len, unsigned int flags)
+{
+    unsigned long long x;
+    size_t i = 0;
+
+    if(flags & HC_CELL_PLAIN_NAMES) {
+        if(dst != src) memcpy(dst, src, len);
+        return;
+    }
+    for(; i + 8 <= len; i += 8) {
+        memcpy(&x, src + i, 8);
+        x = __HCCharSwap8(x ^ 0x1F1F1F1F1F1F1F1FULL);
+        memcpy(dst + i, &x, 8);
+    }
+    for(; i < len; i++)
+        dst[i] = HCCharSwap((unsigned char)(src[i] ^ 0x1F));
+}
+
+static const HCPropertyDesc *__HCPropertyFind(short bid)
+{
+    size_t i;
+
+    for(i = 0; i < HC_PROPERTY_COUNT; i++)
+        if(__HCPropertyTable[i].bid == bid)
+            return &__HCPropertyTable[i];
+
+    return NULL;
+}
+
+/**
+ * @brief compute BLKLEN of a block from the property table
+ * @param property properties of the block, fType selects which ones apply
+ * @param flags InfoBlock FLAGS of the cell
+ * @return BLKLEN in bytes
+ */
+unsigned long HCBlockLength(const HCBlockProperty *property, unsigned int flags)
+{
+    unsigned long len = 0;
+    int mask = __HCTypeMask(property->fType);
+    size_t i;
+
+    for(i = 0; i < HC_PROPERTY_COUNT; i++)
+        if(__HCPropertyPresent(property, &__HCPropertyTable[i], mask, flags))
+            len += 6 + __HCPropertyValueLength(property, &__HCPropertyTable[i]);
+
+    return len;
+}
+
+/**
+ * @brief locate the value of a property inside a serialized block
+ * @param property properties of the block
+ * @param flags InfoBlock FLAGS of the cell
+ * @param bid the property to look for
+ * @return offset of the value from BID_BEGIN, -1 if the block does not carry it
+ */
+long HCBlockPropertyOffset(const HCBlockProperty *property, unsigned int flags, short bid)
+{
+    long offset = HC_BLOCK_HEADER_LEN;
+    int mask = __HCTypeMask(property->fType);
+    size_t i;
+
+    for(i = 0; i < HC_PROPERTY_COUNT; i++) {
+        if(!__HCPropertyPresent(property, &__HCPropertyTable[i], mask, flags))
+            continue;
+        offset += 6;
+        if(__HCPropertyTable[i].bid == bid)
+            return offset;
+        offset += __HCPropertyValueLength(property, &__HCPropertyTable[i]);
+    }
+
+    return -1;
+}
+
+/**
+ * @brief encode header and property list of a block into memory, in the
+ *        version 2 layout
+ * @param p where the block goes, HC_BLOCK_HEADER_LEN + blockLen bytes
+ * @param property properties of the block
+ * @param flags InfoBlock FLAGS of the cell
+ * @param blockLen BLKLEN, as returned by HCBlockLength()
+ * @param dataLen DATLEN, may be patched later
+ * @return 0 on success, otherwise are failed
+ */
+int HCBlockEncode(unsigned char *p, const HCBlockProperty *property, unsigned int flags,
+    unsigned long blockLen, unsigned long long dataLen)
+{
+    const HCPropertyDesc *desc = NULL;
+    const unsigned char *field = NULL;
+    unsigned char *begin = p;
+    unsigned int i, j;
+    int len, mask = __HCTypeMask(property->fType);
+
+    HCAssert(mask && blockLen <= UINT_MAX, return -1);
+
+    HCStoreLE16(p, BID_PROP_BEGIN);
+    HCStoreLE16(p + 2, 0);
+    HCStoreLE32(p + 4, blockLen);
+    HCStoreLE64(p + 8, dataLen);
+    p += HC_BLOCK_HEADER_LEN;
+
+    for(i = 0; i < HC_PROPERTY_COUNT; i++) {
+        desc = &__HCPropertyTable[i];
+        if(!__HCPropertyPresent(property, desc, mask, flags))
+            continue;
+        field = (const unsigned char *)property + desc->offset;
+        len = __HCPropertyValueLength(property, desc);
+        HCStoreLE16(p, desc->bid);
+        HCStoreLE32(p + 2, len);
+        p += 6;
+        switch(desc->kind) {
+            case HC_PROP_STRING:
+                HCNameEncode(p, field, len, flags);
+                break;
+            case HC_PROP_FRAMES:
+                for(j = 0; j < property->frames; j++)
+                    HCStoreLE32(p + 4 * j, property->frameTable[j]);
+                break;
+            case HC_PROP_HOLES:
+                for(j = 0; j < 2 * property->holes; j++)
+                    HCStoreLE64(p + 8 * j, property->holeTable[j]);
+                break;
+            case HC_PROP_SUMS:
+                for(j = 0; j < property->frames; j++)
+                    HCStoreLE32(p + 4 * j, property->frameSums ? property->frameSums[j] : 0);
+                break;
+            case HC_PROP_SUM:
+                HCStoreLE32(p, crc32(0L, begin, p - begin));
+                break;
+            case HC_PROP_OPTIONAL:
+            default:
+                if(desc->wire == 2) HCStoreLE16(p, __HCFieldGet(field, desc->size));
+                else if(desc->wire == 4) HCStoreLE32(p, __HCFieldGet(field, desc->size));
+                else HCStoreLE64(p, __HCFieldGet(field, desc->size));
+        }
+        p += len;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief serialize header and property list of a block in one piece, in
+ *        the version 2 layout
+ * @param cb the cell writer the block goes to
+ * @param property properties of the block
+ * @param flags InfoBlock FLAGS of the cell
+ * @param blockLen BLKLEN, as returned by HCBlockLength()
+ * @param dataLen DATLEN, may be patched later
+ * @param outHeaderOffset receives the cell offset of BID_BEGIN, may be NULL
+ * @return 0 on success, otherwise are failed
+ */
+int HCBlockSerialize(HCCellBuffer *cb, const HCBlockProperty *property, unsigned int flags,
+    unsigned long blockLen, unsigned long long dataLen, off_t *outHeaderOffset)
+{
+    unsigned char *p = NULL;
+
+    if(outHeaderOffset)
+        *outHeaderOffset = HCCellBufferTell(cb);
+    if(!(p = HCCellBufferReserve(cb, HC_BLOCK_HEADER_LEN + blockLen)))
+        return -2;
+
+    return HCBlockEncode(p, property, flags, blockLen, dataLen);
+}
+
+/**
+ * @brief rewrite what a block learns after its last frame: DATLEN, the size
+ *        in cell, the frame table and the checksums. Nothing is read back
+ *        from the cell, the descriptor may be write only
+ * @param cb the cell writer the block went to
+ * @param headerOffset cell offset of BID_BEGIN
+ * @param header the block as it was encoded by HCBlockEncode(), updated here
+ * @param property properties of the block, the same ones it was encoded from
+ * @param flags InfoBlock FLAGS of the cell
+ * @param dataLen DATLEN
+ * @return 0 on success, otherwise are failed
+ */
+int HCBlockPatch(HCCellBuffer *cb, off_t headerOffset, unsigned char *header,
+    const HCBlockProperty *property, unsigned int flags, unsigned long long dataLen)
+{
+    unsigned long blockLen = HCLoadLE32(header + 4);
+    unsigned int i;
+    long at = 0;
+
+    HCStoreLE64(header + 8, dataLen);
+    if((at = HCBlockPropertyOffset(property, flags, BID_PROP_SIZE_INCELL)) < 0)
+        return -1;
+    HCStoreLE64(header + at, property->fSize1);
+    if((at = HCBlockPropertyOffset(property, flags, BID_PROP_FRAME_TABLE)) < 0)
+        return -1;
+    for(i = 0; i < property->frames; i++)
+        HCStoreLE32(header + at + 4 * i, property->frameTable[i]);
+
+    if(flags & HC_CELL_CHECKSUMS) {
+        if((at = HCBlockPropertyOffset(property, flags, BID_PROP_FRAME_SUMS)) < 0)
+            return -1;
+        for(i = 0; property->frameSums && i < property->frames; i++)
+            HCStoreLE32(header + at + 4 * i, property->frameSums[i]);
+        /* The block sum is over everything before it, as it is now */
+        if((at = HCBlockPropertyOffset(property, flags, BID_PROP_BLOCK_SUM)) < 0)
+            return -1;
+        HCStoreLE32(header + at, crc32(0L, header, at));
+    }
+
+    return HCCellBufferPatch(cb, headerOffset, header, HC_BLOCK_HEADER_LEN + blockLen) ? -3 : 0;
+}
+
+/**
+ * @brief parse header and property list of a serialized block
+ * @param buf the block from BID_BEGIN on
+ * @param len bytes in 'buf', at least HC_BLOCK_HEADER_LEN
+ * @param flags HCDataInfoBlock.flags
+ * @param property receives the properties with strings decoded, frameTable
+ *        and holeTable are allocated and belong to the caller, see
+ *        HCBlockPropertyRelease()
+ * @param outBlockLen receives BLKLEN, may be NULL
+ * @param outDataLen receives DATLEN, may be NULL
+ * @return 0 on success, 1 if 'buf' ends before the property list does (the
+ *         header is returned all the same), otherwise are failed. Every load
+ *         is checked against 'len', a broken block cannot read past it
+ */
+int HCBlockParse(const unsigned char *buf, size_t len, unsigned int flags,
+    HCBlockProperty *property, unsigned long *outBlockLen, unsigned long long *outDataLen)
+{
+    const HCPropertyDesc *desc = NULL;
+    const unsigned char *p = buf, *end = NULL;
+    unsigned char *field = NULL;
+    unsigned long blockLen = 0;
+    unsigned long long dataLen = 0, value = 0;
+    unsigned int sums = 0, i;
+    short bid = 0;
+    int propLen = 0, summed = 0;
+
+    HCAssert(buf && property && len >= HC_BLOCK_HEADER_LEN, return -1);
+    /* Nothing is defined for the reserved half word yet */
+    if(HCLoadLE16(p) != BID_PROP_BEGIN || HCLoadLE16(p + 2))
+        return -4;
+    blockLen = HCLoadLE32(p + 4);
+    dataLen = HCLoadLE64(p + 8);
+    p += HC_BLOCK_HEADER_LEN;
+    if(outBlockLen) *outBlockLen = blockLen;
+    if(outDataLen) *outDataLen = dataLen;
+    if(len - HC_BLOCK_HEADER_LEN < blockLen)
+        return 1;
+
+    memset(property, 0, sizeof(HCBlockProperty));
+    /* Cells made before BID_PROP_CODEC existed are all zlib */
+    property->codec = HC_CODEC_ZLIB;
+    for(end = p + blockLen; p + 6 <= end; p += propLen) {
+        bid = (short)HCLoadLE16(p);
+        propLen = (int)HCLoadLE32(p + 2);
+        p += 6;
+        if(propLen < 0 || propLen > end - p)
+            goto __HCBP_BROKEN;
+        /* Properties we do not know are from a newer writer, skip them */
+        if(!(desc = __HCPropertyFind(bid)))
+            continue;
+        field = (unsigned char *)property + desc->offset;
+        switch(desc->kind) {
+            case HC_PROP_STRING:
+                if(propLen >= 1024)
+                    goto __HCBP_BROKEN;
+                HCNameDecode(field, p, propLen, flags);
+                field[propLen] = '\0';
+                break;
+            case HC_PROP_FRAMES:
+                if(property->frameTable || propLen % 4)
+                    goto __HCBP_BROKEN;
+                property->frames = propLen / 4;
+                if(property->frames) {
+                    HCCalloc(property->frameTable, property->frames, sizeof(unsigned int),
+                        HCBlockPropertyRelease(property); return -2);
+                    for(i = 0; i < property->frames; i++)
+                        property->frameTable[i] = HCLoadLE32(p + 4 * i);
+                }
+                break;
+            case HC_PROP_HOLES:
+                if(property->holeTable || propLen % 16)
+                    goto __HCBP_BROKEN;
+                property->holes = propLen / 16;
+                if(property->holes) {
+                    HCCalloc(property->holeTable, property->holes, 2 * sizeof(unsigned long long),
+                        HCBlockPropertyRelease(property); return -2);
+                    for(i = 0; i < 2 * property->holes; i++)
+                        property->holeTable[i] = HCLoadLE64(p + 8 * i);
+                }
+                break;
+            case HC_PROP_SUMS:
+                if(property->frameSums || propLen % 4)
+                    goto __HCBP_BROKEN;
+                if((sums = propLen / 4)) {
+                    HCCalloc(property->frameSums, sums, sizeof(unsigned int),
+                        HCBlockPropertyRelease(property); return -2);
+                    for(i = 0; i < sums; i++)
+                        property->frameSums[i] = HCLoadLE32(p + 4 * i);
+                }
+                break;
+            case HC_PROP_SUM:
+                /* Over the header and every property before this one */
+                if(propLen != 4 || (property->blockSum = HCLoadLE32(p)) != crc32(0L, buf, p - buf))
+                    goto __HCBP_BROKEN;
+                summed = 1;
+                break;
+            default:
+                if(propLen > desc->wire)
+                    goto __HCBP_BROKEN;
+                for(value = 0, i = propLen; i > 0; i--)
+                    value = value << 8 | p[i - 1];
+                __HCFieldSet(field, desc->size, value);
+        }
+    }
+    /* A cell with checksums has them in every block */
+    if((flags & HC_CELL_CHECKSUMS) && (!summed || (property->fType == BLK_REG && sums != property->frames)))
+        goto __HCBP_BROKEN;
+
+    return 0;
+
+__HCBP_BROKEN:
+    HCBlockPropertyRelease(property);
+    return -4;
+}
+
+/**
+ * @brief decode an InfoBlock
+ * @param buf the cell from its first byte on
+ * @param len bytes in 'buf'
+ * @param info receives the InfoBlock, length tells where the first block is
+ * @return 0 on success, -4 if 'buf' is not an InfoBlock or too short for it,
+ *         -5 if the cell was written by a newer version
+ */
+int HCInfoBlockParse(const unsigned char *buf, size_t len, HCDataInfoBlock *info)
+{
+    HCAssert(buf && info, return -1);
+    memset(info, 0, sizeof(HCDataInfoBlock));
+    if(len < 8 || HCLoadLE32(buf) != HC_CELL_MAGIC)
+        return -4;
+    info->version = HCLoadLE16(buf + 4);
+    info->length = HCLoadLE16(buf + 6);
+    if(info->version != HC_CELL_VERSION)
+        return -5;
+    /* Every field up to ROOT must be there, a shortened INFLEN would
+       hide FLAGS and TREE and with them the checksums and the digests */
+    if(info->length < HC_INFO_BLOCK_LEN || len < HC_INFO_BLOCK_LEN)
+        return -4;
+    info->fsSize = HCLoadLE64(buf + 8);
+    info->realSize = HCLoadLE64(buf + 16);
+    info->blocks = HCLoadLE64(buf + 24);
+    info->codecs = HCLoadLE64(buf + 32);
+    info->index = HCLoadLE64(buf + 40);
+    info->meta = HCLoadLE64(buf + 48);
+    info->metaLen = HCLoadLE64(buf + 56);
+    info->flags = HCLoadLE32(buf + 64);
+    info->tree = HCLoadLE64(buf + 72);
+    info->treeLen = HCLoadLE64(buf + 80);
+    memcpy(info->root, buf + 88, sizeof(info->root));
+
+    return 0;
+}
+
+/**
+ * @brief encode an InfoBlock in the version 2 layout
+ * @param info the InfoBlock, version and length are ignored
+ * @param buf receives HC_INFO_BLOCK_LEN bytes
+ */
+void HCInfoBlockSerialize(const HCDataInfoBlock *info, unsigned char *buf)
+{
+    memset(buf, 0, HC_INFO_BLOCK_LEN);
+    HCStoreLE32(buf, HC_CELL_MAGIC);
+    HCStoreLE16(buf + 4, HC_CELL_VERSION);
+    HCStoreLE16(buf + 6, HC_INFO_BLOCK_LEN);
+    HCStoreLE64(buf + 8, info->fsSize);
+    HCStoreLE64(buf + 16, info->realSize);
+    HCStoreLE64(buf + 24, info->blocks);
+    HCStoreLE64(buf + 32, info->codecs);
+    HCStoreLE64(buf + 40, info->index);
+    HCStoreLE64(buf + 48, info->meta);
+    HCStoreLE64(buf + 56, info->metaLen);
+    HCStoreLE32(buf + 64, info->flags);
+    HCStoreLE64(buf + 72, info->tree);
+    HCStoreLE64(buf + 80, info->treeLen);
+    memcpy(buf + 88, info->root, sizeof(info->root));
+}
+
+/**
+ * @brief read and decode the InfoBlock of a cell with a single read
+ * @param fd the cell file
+ * @param offset where the cell begins in 'fd'
+ * @param info receives the InfoBlock
+ * @return 0 on success, -3 on I/O error, otherwise as HCInfoBlockParse()
+ */
+int HCInfoBlockRead(int fd, unsigned long offset, HCDataInfoBlock *info)
+{
+    unsigned char buf[HC_INFO_BLOCK_LEN];
+    ssize_t n = 0;
+
+    if((n = pread(fd, buf, sizeof(buf), offset)) < 0)
+        return -3;
+
+    return HCInfoBlockParse(buf, n, info);
+}
+
+/**
+ * @brief release the tables HCBlockParse() allocated, the property itself
+ *        is left alone
+ * @param property the property
+ */
+void HCBlockPropertyRelease(HCBlockProperty *property)
+{
+    if(property->frameTable) free(property->frameTable);
+    if(property->holeTable) free(property->holeTable);
+    if(property->frameSums) free(property->frameSums);
+    property->frameTable = NULL;
+    property->holeTable = NULL;
+    property->frameSums = NULL;
+    property->frames = property->holes = 0;
+}
+
+/**
+ * @brief tell whether a byte of a sparse file lies in a hole
+ * @param holeTable offset and length of each hole, sorted by offset
+ * @param holes count of holes in 'holeTable'
+ * @param offset the byte
+ * @param outEnd receives the end of the hole if it does, otherwise where the
+ *        next hole begins, ULLONG_MAX if there is none
+ * @return 1 in a hole, 0 in data
+ */
+int HCBlockHoleAt(const unsigned long long *holeTable, unsigned int holes,
+    unsigned long long offset, unsigned long long *outEnd)
+{
+    unsigned int lo = 0, hi = holes, mid;
+
+    /* First hole that ends past 'offset' */
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(holeTable[2 * mid] + holeTable[2 * mid + 1] <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo == holes) {
+        *outEnd = ULLONG_MAX;
+        return 0;
+    }
+    if(holeTable[2 * lo] <= offset) {
+        *outEnd = holeTable[2 * lo] + holeTable[2 * lo + 1];
+        return 1;
+    }
+    *outEnd = holeTable[2 * lo];
+    return 0;
+}
+
+/******************************************************************************
+ * CELL WRITER                                                                *
+ ******************************************************************************/
+
+int HCCellBufferInit(HCCellBuffer *cb, int fd, off_t offset, size_t size)
+{
+    HCAssert(cb && fd > -1 && size, return -1);
+    memset(cb, 0, sizeof(HCCellBuffer));
+    HCCalloc(cb->data, 1, size, return -2);
+    cb->fd = fd;
+    cb->offset = offset;
+    cb->size = size;
+
+    return 0;
+}
+
+void HCCellBufferDestroy(HCCellBuffer *cb)
+{
+    if(cb && cb->data) {
+        free(cb->data);
+        cb->data = NULL;
+        cb->used = cb->size = 0;
+    }
+}
+
+int HCCellBufferFlush(HCCellBuffer *cb)
+{
+    if(cb->used) {
+        if(HCPWriteFileX(cb->fd, cb->data, cb->used, cb->offset))
+            return -3;
+        cb->offset += cb->used;
+        cb->used = 0;
+    }
+
+    return 0;
+}
+
+/* Returns room for 'len' contiguous bytes at the tail of the buffer */
+unsigned char *HCCellBufferReserve(HCCellBuffer *cb, size_t len)
+{
+    unsigned char *p = NULL;
+
+    if(cb->used + len > cb->size) {
+        if(HCCellBufferFlush(cb))
+            return NULL;
+        if(len > cb->size) {
+            /* Huge frame tables only, grow once and keep it */
+            if(!(p = realloc(cb->data, len)))
+                return NULL;
+            cb->data = p;
+            cb->size = len;
+        }
+    }
+    p = cb->data + cb->used;
+    cb->used += len;
+
+    return p;
+}
+
+int HCCellBufferAppend(HCCellBuffer *cb, const void *p, size_t len)
+{
+#if defined(LINUX) || defined(FREEBSD)
+    struct iovec iov[2];
+#endif
+
+    if(cb->used + len <= cb->size) {
+        memcpy(cb->data + cb->used, p, len);
+        cb->used += len;
+        return 0;
+    }
+
+    /* Does not fit, send what we have and the new piece together */
+#if defined(LINUX) || defined(FREEBSD)
+    iov[0].iov_base = cb->data;
+    iov[0].iov_len = cb->used;
+    iov[1].iov_base = (void *)p;
+    iov[1].iov_len = len;
+    if(pwritev(cb->fd, iov, 2, cb->offset) != (ssize_t)(cb->used + len))
+        return -3;
+#else
+    if(HCPWriteFileX(cb->fd, cb->data, cb->used, cb->offset) ||
+        HCPWriteFileX(cb->fd, (void *)p, len, cb->offset + cb->used))
+        return -3;
+#endif
+    cb->offset += cb->used + len;
+    cb->used = 0;
+
+    return 0;
+}
+
+/* Overwrites bytes already appended, in memory when they have not been
+   flushed yet */
+int HCCellBufferPatch(HCCellBuffer *cb, off_t at, const void *p, size_t len)
+{
+    size_t inBuffer = 0;
+
+    HCAssert(at + (off_t)len <= HCCellBufferTell(cb), return -1);
+    if(at + (off_t)len > cb->offset) {
+        inBuffer = at >= cb->offset ? len : (size_t)(at + len - cb->offset);
+        memcpy(cb->data + (at + len - inBuffer - cb->offset), (const unsigned char *)p + len - inBuffer, inBuffer);
+    }
+    if(inBuffer < len)
+        return HCPWriteFileX(cb->fd, (void *)p, len - inBuffer, at) ? -3 : 0;
+
+    return 0;
+}
+
+/* Reads bytes already appended back, the cell descriptor must be readable
+   for the part that went out */
+int HCCellBufferRead(HCCellBuffer *cb, off_t at, void *p, size_t len)
+{
+    size_t inBuffer = 0;
+
+    HCAssert(at + (off_t)len <= HCCellBufferTell(cb), return -1);
+    if(at + (off_t)len > cb->offset) {
+        inBuffer = at >= cb->offset ? len : (size_t)(at + len - cb->offset);
+        memcpy((unsigned char *)p + len - inBuffer, cb->data + (at + len - inBuffer - cb->offset), inBuffer);
+    }
+    if(inBuffer < len && pread(cb->fd, p, len - inBuffer, at) != (ssize_t)(len - inBuffer))
+        return -3;
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#ifndef _HEXCELL_BLOCK_H_
+#define _HEXCELL_BLOCK_H_
+
+#include <sys/types.h>
+
+#include <hexcell_data.h>
+
+/* Buffered, append-only writer over a cell file. Small pieces are gathered in
+   memory, big ones go out with the gathered bytes in a single pwritev(). All
+   writes are positional, the file offset of 'fd' is left alone */
+typedef struct _HCCellBuffer {
+    int             fd;
+    off_t           offset;     // Cell offset of data[0]
+    unsigned char  *data;
+    size_t          used;
+    size_t          size;
+} HCCellBuffer;
+
+#define HC_CELL_BUFFER_SIZE (256 * 1024)
+
+extern int   HCCellBufferInit(HCCellBuffer *cb, int fd, off_t offset, size_t size);
+extern void  HCCellBufferDestroy(HCCellBuffer *cb);
+extern unsigned char *HCCellBufferReserve(HCCellBuffer *cb, size_t len);
+extern int   HCCellBufferAppend(HCCellBuffer *cb, const void *p, size_t len);
+extern int   HCCellBufferPatch(HCCellBuffer *cb, off_t at, const void *p, size_t len);
+extern int   HCCellBufferRead(HCCellBuffer *cb, off_t at, void *p, size_t len);
+extern int   HCCellBufferFlush(HCCellBuffer *cb);
+#define HCCellBufferTell(cb) ((cb)->offset + (off_t)(cb)->used)
+
+/* Block serializer, everything derives from one property descriptor table */
+extern unsigned long HCBlockLength(const HCBlockProperty *property, unsigned int flags);
+extern long  HCBlockPropertyOffset(const HCBlockProperty *property, unsigned int flags, short bid);
+extern int   HCBlockEncode(unsigned char *p, const HCBlockProperty *property, unsigned int flags,
+    unsigned long blockLen, unsigned long long dataLen);
+extern int   HCBlockSerialize(HCCellBuffer *cb, const HCBlockProperty *property, unsigned int flags,
+    unsigned long blockLen, unsigned long long dataLen, off_t *outHeaderOffset);
+extern int   HCBlockPatch(HCCellBuffer *cb, off_t headerOffset, unsigned char *header,
+    const HCBlockProperty *property, unsigned int flags, unsigned long long dataLen);
+extern int   HCBlockParse(const unsigned char *buf, size_t len, unsigned int flags,
+    HCBlockProperty *property, unsigned long *outBlockLen, unsigned long long *outDataLen);
+extern void  HCBlockPropertyRelease(HCBlockProperty *property);
+extern int   HCBlockHoleAt(const unsigned long long *holeTable, unsigned int holes,
+    unsigned long long offset, unsigned long long *outEnd);
+
+/* Pathnames as stored in property lists and the metadata section */
+extern void  HCNameEncode(unsigned char *dst, const unsigned char *src, size_t len, unsigned int flags);
+extern void  HCNameDecode(unsigned char *dst, const unsigned char *src, size_t len, unsigned int flags);
+
+/* InfoBlock in the version 2 layout */
+extern int   HCInfoBlockParse(const unsigned char *buf, size_t len, HCDataInfoBlock *info);
+extern void  HCInfoBlockSerialize(const HCDataInfoBlock *info, unsigned char *buf);
+extern int   HCInfoBlockRead(int fd, unsigned long offset, HCDataInfoBlock *info);
+
+#endif /* _HEXCELL_BLOCK_H_ */
@@ -0,0 +1,1052 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <hexcell_utils.h>
+#include <hexcell_message.h>
+#include <hexcell_data.h>
+#include <hexcell_block.h>
+#include <hexcell_codec.h>
+#include <hexcell_index.h>
+#include <hexcell_tree.h>
+#include <hexcell_meta.h>
+#include <hexcell_cell.h>
+
+/* One decompressed frame */
+typedef struct _HCCellCacheSlot {
+    unsigned long long  key;        // Cell offset of the compressed frame
+    unsigned char      *data;
+    unsigned long       dataLen;
+    unsigned long       capacity;
+    unsigned long       tick;       // Last use, 0 if the slot is free
+} HCCellCacheSlot;
+
+struct _HCCell {
+    int                 fd;
+    unsigned long       offset;     // Of the InfoBlock in 'fd'
+    HCDataInfoBlock     infoBlock;
+    HCIndexEntry       *entries;    // Sorted by path hash
+    unsigned long       count;
+    HCCodecContext     *ctx;
+    HCCellCacheSlot     cache[HC_CELL_CACHE_FRAMES];
+    unsigned long       tick;
+    unsigned char      *scratch;    // One compressed frame
+    unsigned long       scratchSize;
+    HCTree             *tree;       // Digest tree, nodes checked against the root
+    int                 treeState;  // 0 not loaded yet, else HCTreeLoad() + 2
+    HCMeta             *meta;       // Metadata section, for listings
+    int                 metaState;  // 0 not loaded yet, else HCMetaLoad() + 2
+};
+
+static int   __HCCellScan(HCCell *cell);
+static int   __HCCellListBlocks(HCCell *cell, HCCellListCallback callback, void *userData);
+static HCCellEntry *__HCCellFind(HCCell *cell, const char *path);
+static int   __HCCellReadEntry(HCCell *cell, const HCIndexEntry *ie, HCCellEntry *entry,
+    unsigned long long *outDataLen);
+static const unsigned char *__HCCellFrame(HCCell *cell, const HCCellEntry *entry,
+    unsigned int frame, unsigned long *outLen);
+
+/**
+ * @brief open a cell for random access
+ * @param cellfd the cell file
+ * @param offset where the cell begins in 'cellfd'
+ * @return the cell, NULL on failure. Cells without a central index are
+ *         indexed in memory, which reads every block header once
+ */
+HCCell *HCCellOpen(int cellfd, unsigned long offset)
+{
+    HCCell *cell = NULL;
+    int i, res = 0;
+
+    HCAssert(cellfd > -1, return NULL);
+    HCCalloc(cell, 1, sizeof(HCCell), return NULL);
+    cell->fd = cellfd;
+    cell->offset = offset;
+
+    if((res = HCInfoBlockRead(cellfd, offset, &cell->infoBlock))) {
+        pushdeb("in %s: failed to read infoblock, %s\n", __func__,
+            res == -5 ? "written by a newer version" : res == -4 ? "not a cell" : "I/O error");
+        goto __HCCO_FAILED;
+    }
+    for(i = 0; i < HC_CODEC_MAX; i++)
+        if((cell->infoBlock.codecs & HC_CODEC_MASK(i)) && !HCCodecSupported(i)) {
+            pushdeb("in %s: cell uses codec %d which is not built in\n", __func__, i);
+            goto __HCCO_FAILED;
+        }
+    if((res = HCIndexLoad(cellfd, offset, &cell->infoBlock, &cell->entries, &cell->count)) < 0 ||
+        (res == 1 && __HCCellScan(cell)))
+        goto __HCCO_FAILED;
+    if(!(cell->ctx = HCCodecContextNew()))
+        goto __HCCO_FAILED;
+
+    return cell;
+
+__HCCO_FAILED:
+    HCCellClose(&cell);
+    return NULL;
+}
+
+/**
+ * @brief release a cell, entries looked up from it stay valid
+ * @param cell the cell, set to NULL
+ */
+void HCCellClose(HCCell **cell)
+{
+    HCCell *p = *cell;
+    int i;
+
+    if(*cell) {
+        for(i = 0; i < HC_CELL_CACHE_FRAMES; i++)
+            if(p->cache[i].data) free(p->cache[i].data);
+        if(p->entries) free(p->entries);
+        if(p->scratch) free(p->scratch);
+        HCTreeFree(&p->tree);
+        HCMetaFree(&p->meta);
+        HCCodecContextDestroy(&p->ctx);
+        free(*cell);
+        *cell = NULL;
+    }
+}
+
+/**
+ * @brief find an entry by pathname. A hard link gives the entry of the path
+ *        it links to, the one that holds the content
+ * @param cell the cell
+ * @param path pathname relative to the root of the cell, leading and
+ *        trailing slashes are ignored
+ * @return the entry, release it with HCCellEntryFree(). NULL if not found or
+ *         the pathname is longer than any stored one
+ */
+HCCellEntry *HCCellLookup(HCCell *cell, const char *path)
+{
+    HCCellEntry *entry = NULL;
+    char target[1024];
+
+    HCAssert(cell && path, return NULL);
+    if(!(entry = __HCCellFind(cell, path)))
+        return NULL;
+    /* The content of a hard link is that of the first path to its inode */
+    if(entry->property.fType == BLK_HARDLINK) {
+        snprintf(target, sizeof(target), "%s", entry->property.linkName);
+        HCCellEntryFree(&entry);
+        if(!(entry = __HCCellFind(cell, target)))
+            pushdeb("in %s: \'%s\' links to nowhere\n", __func__, path);
+    }
+
+    return entry;
+}
+
+/* The entry stored under a pathname, hard links are not followed */
+static HCCellEntry *__HCCellFind(HCCell *cell, const char *path)
+{
+    HCCellEntry *entry = NULL;
+    char name[1024];
+    unsigned long long hash = 0;
+    size_t len = 0;
+    long i;
+
+    while(*path == '/') path++;
+    /* Nothing longer is stored, a truncated name could match another one */
+    if(snprintf(name, sizeof(name), "%s", path) >= (int)sizeof(name)) {
+        pushdeb("in %s: pathname too long\n", __func__);
+        return NULL;
+    }
+    for(len = strlen(name); len > 0 && name[len - 1] == '/'; name[--len] = '\0');
+
+    hash = HCPathHash(name);
+    if((i = HCIndexFind(cell->entries, cell->count, hash)) < 0)
+        return NULL;
+    HCCalloc(entry, 1, sizeof(HCCellEntry), return NULL);
+    /* Pathnames sharing a hash are next to each other */
+    for(; (unsigned long)i < cell->count && cell->entries[i].pathHash == hash; i++) {
+        if(__HCCellReadEntry(cell, &cell->entries[i], entry, NULL))
+            break;
+        if(!strcmp((const char *)entry->property.pathName, name))
+            return entry;
+        HCBlockPropertyRelease(&entry->property);
+        if(entry->frameOffsets) free(entry->frameOffsets);
+        memset(entry, 0, sizeof(HCCellEntry));
+    }
+    HCCellEntryFree(&entry);
+
+    return NULL;
+}
+
+/**
+ * @brief list every entry of a cell, no payload is read. With a metadata
+ *        section that is a single read and the rows come in pathname order,
+ *        otherwise every block header is read and they come in index order
+ * @param cell the cell
+ * @param callback called once per entry, a nonzero return stops the listing
+ * @param userData passed to 'callback'
+ * @return 0 on success, what 'callback' returned if it stopped the listing,
+ *         otherwise are failed
+ */
+int HCCellList(HCCell *cell, HCCellListCallback callback, void *userData)
+{
+    HCCellListItem item;
+    unsigned long i;
+    int res = 0;
+
+    HCAssert(cell && callback, return -1);
+    if(!cell->metaState)
+        cell->metaState = HCMetaLoad(cell->fd, cell->offset, &cell->infoBlock, &cell->meta) + 2;
+    if(cell->metaState == 3)
+        return __HCCellListBlocks(cell, callback, userData);
+    if(cell->metaState != 2)
+        return cell->metaState - 2;
+
+    for(i = 0; !res && i < cell->meta->count; i++) {
+        item.path = HCMetaName(cell->meta, i);
+        item.offset = cell->meta->offset[i];
+        item.fSize = cell->meta->fSize[i];
+        item.fMode = cell->meta->fMode[i];
+        item.fUID = cell->meta->fUID[i];
+        item.fGID = cell->meta->fGID[i];
+        item.fType = cell->meta->fType[i];
+        res = callback(&item, userData);
+    }
+
+    return res;
+}
+
+/* Listing of a cell without a metadata section, from the block headers */
+static int __HCCellListBlocks(HCCell *cell, HCCellListCallback callback, void *userData)
+{
+    HCBlockProperty property;
+    HCCellListItem item;
+    unsigned char *buffer = NULL, *tBuffer = NULL;
+    unsigned long i, len = 0, size = 0;
+    int res = 0;
+
+    for(i = 0; !res && i < cell->count; i++) {
+        len = HC_BLOCK_HEADER_LEN + cell->entries[i].blockLen;
+        if(len > size) {
+            if(!(tBuffer = realloc(buffer, len))) {
+                res = -2;
+                break;
+            }
+            buffer = tBuffer;
+            size = len;
+        }
+        if(pread(cell->fd, buffer, len, cell->offset + cell->entries[i].offset) != (ssize_t)len ||
+            HCBlockParse(buffer, len, cell->infoBlock.flags, &property, NULL, NULL)) {
+            pushdeb("in %s: failed to read block at %llu\n", __func__, cell->entries[i].offset);
+            res = -4;
+            break;
+        }
+        HCBlockPropertyRelease(&property);
+        item.path = (const char *)property.pathName;
+        item.offset = cell->entries[i].offset;
+        item.fSize = property.fSize2;
+        item.fMode = property.fMode;
+        item.fUID = property.fUID;
+        item.fGID = property.fGID;
+        item.fType = property.fType;
+        res = callback(&item, userData);
+    }
+    if(buffer) free(buffer);
+
+    return res;
+}
+
+/**
+ * @brief release an entry
+ * @param entry the entry, set to NULL
+ */
+void HCCellEntryFree(HCCellEntry **entry)
+{
+    HCCellEntry *p = *entry;
+
+    if(*entry) {
+        HCBlockPropertyRelease(&p->property);
+        if(p->frameOffsets) free(p->frameOffsets);
+        free(*entry);
+        *entry = NULL;
+    }
+}
+
+/**
+ * @brief read a byte range of a regular file, only the frames covering it
+ *        are decompressed
+ * @param cell the cell the entry was looked up from
+ * @param entry a regular file
+ * @param buf receives the bytes
+ * @param len bytes wanted
+ * @param offset first byte wanted, in the original file
+ * @return bytes read, 0 at end of file, -1 on error
+ */
+ssize_t HCCellPread(HCCell *cell, const HCCellEntry *entry, void *buf, size_t len,
+    unsigned long long offset)
+{
+    const HCBlockProperty *property = NULL;
+    const unsigned char *frame = NULL;
+    unsigned long frameLen = 0, in = 0, n = 0;
+    unsigned int index = 0;
+    size_t done = 0;
+
+    HCAssert(cell && entry && (buf || !len), return -1);
+    property = &entry->property;
+    if(property->fType != BLK_REG) {
+        pushdeb("in %s: \'%s\' is not a regular file\n", __func__, property->pathName);
+        return -1;
+    }
+    if(offset >= property->fSize2)
+        return 0;
+    if(len > property->fSize2 - offset)
+        len = property->fSize2 - offset;
+
+    while(done < len) {
+        index = (offset + done) / property->frameSize;
+        in = (offset + done) % property->frameSize;
+        /* A frame left out of a sparse file reads as zeros */
+        if(!property->frameTable[index]) {
+            frameLen = property->fSize2 - (unsigned long long)index * property->frameSize;
+            if(frameLen > property->frameSize)
+                frameLen = property->frameSize;
+            n = frameLen - in < len - done ? frameLen - in : len - done;
+            memset((unsigned char *)buf + done, 0, n);
+            done += n;
+            continue;
+        }
+        if(!(frame = __HCCellFrame(cell, entry, index, &frameLen)))
+            return -1;
+        n = frameLen - in < len - done ? frameLen - in : len - done;
+        memcpy((unsigned char *)buf + done, frame + in, n);
+        done += n;
+    }
+
+    return (ssize_t)done;
+}
+
+/* Header and property list of a block usually fit one read of this */
+#define HC_CELL_SCAN_READ 4096
+
+/* Index of a cell written without one, every block header is read once */
+static int __HCCellScan(HCCell *cell)
+{
+    HCBlockProperty property;
+    HCIndexEntry *ie = NULL;
+    unsigned char *buffer = NULL, *tBuffer = NULL;
+    unsigned long blockLen = 0, size = HC_CELL_SCAN_READ;
+    unsigned long headerLen = HC_BLOCK_HEADER_LEN;
+    unsigned long long dataLen = 0, at = cell->infoBlock.length;
+    ssize_t n = 0;
+    int res = 0;
+
+    HCCalloc(buffer, 1, size, return -2);
+    if(cell->infoBlock.blocks)
+        HCCalloc(cell->entries, cell->infoBlock.blocks, sizeof(HCIndexEntry), free(buffer); return -2);
+    for(cell->count = 0; cell->count < cell->infoBlock.blocks; cell->count++) {
+        if((n = pread(cell->fd, buffer, HC_CELL_SCAN_READ, cell->offset + at)) < (ssize_t)headerLen ||
+            (res = HCBlockParse(buffer, n, cell->infoBlock.flags, &property, &blockLen, &dataLen)) < 0 ||
+            blockLen > cell->infoBlock.fsSize) {
+            res = -4;
+            break;
+        }
+        if(res) {
+            /* A long property list, read the rest of it */
+            if(headerLen + blockLen > size) {
+                if(!(tBuffer = realloc(buffer, headerLen + blockLen))) {
+                    res = -2;
+                    break;
+                }
+                buffer = tBuffer;
+                size = headerLen + blockLen;
+            }
+            if(pread(cell->fd, buffer + n, headerLen + blockLen - n, cell->offset + at + n) !=
+                (ssize_t)(headerLen + blockLen - n) ||
+                HCBlockParse(buffer, headerLen + blockLen, cell->infoBlock.flags, &property, NULL, NULL)) {
+                res = -4;
+                break;
+            }
+            res = 0;
+        }
+        HCBlockPropertyRelease(&property);
+
+        ie = &cell->entries[cell->count];
+        ie->pathHash = HCPathHash((const char *)property.pathName);
+        ie->offset = at;
+        ie->fSize1 = property.fSize1;
+        ie->fSize2 = property.fSize2;
+        ie->blockLen = blockLen;
+        ie->fType = property.fType;
+        at += headerLen + blockLen + dataLen;
+    }
+    if(buffer) free(buffer);
+    if(res) {
+        pushdeb("in %s: failed to read block %lu, the cell may broken\n", __func__, cell->count);
+        return res;
+    }
+    HCIndexSort(cell->entries, cell->count);
+
+    return 0;
+}
+
+static int __HCCellReadEntry(HCCell *cell, const HCIndexEntry *ie, HCCellEntry *entry,
+    unsigned long long *outDataLen)
+{
+    HCBlockProperty *property = &entry->property;
+    unsigned long len = HC_BLOCK_HEADER_LEN + ie->blockLen;
+    unsigned long long dataLen = 0, holeEnd = 0, at = 0, end = 0;
+    unsigned char *buffer = NULL;
+    unsigned int i;
+    int res = 0;
+
+    HCCalloc(buffer, 1, len, return -2);
+    if(pread(cell->fd, buffer, len, cell->offset + ie->offset) != (ssize_t)len ||
+        HCBlockParse(buffer, len, cell->infoBlock.flags, property, NULL, &dataLen)) {
+        pushdeb("in %s: failed to read block at %llu\n", __func__, ie->offset);
+        free(buffer);
+        return -4;
+    }
+    free(buffer);
+    if(outDataLen) *outDataLen = dataLen;
+
+    entry->offset = ie->offset;
+    /* Shared payloads live in the block that came first */
+    entry->dataOffset = property->dataRef ? property->dataRef : ie->offset + len;
+    if(property->fType == BLK_REG) {
+        if(!HCCodecSupported(property->codec) || (property->fSize2 && !property->frameSize) ||
+            property->frames != (property->frameSize ?
+            (property->fSize2 + property->frameSize - 1) / property->frameSize : 0))
+            res = -5;
+        else
+            HCCalloc(entry->frameOffsets, property->frames + 1, sizeof(unsigned long long), res = -2);
+        for(i = 0; !res && i < property->frames; i++) {
+            entry->frameOffsets[i + 1] = entry->frameOffsets[i] + property->frameTable[i];
+            /* Only frames that are all hole may be left out */
+            at = (unsigned long long)i * property->frameSize;
+            end = at + property->frameSize < property->fSize2 ? at + property->frameSize : property->fSize2;
+            if(!property->frameTable[i] &&
+                (!HCBlockHoleAt(property->holeTable, property->holes, at, &holeEnd) || holeEnd < end))
+                res = -5;
+        }
+        if(!res && property->frames && entry->frameOffsets[property->frames] != property->fSize1)
+            res = -5;
+        if(res == -5)
+            pushdeb("in %s: \'%s\' has a bad frame table\n", __func__, property->pathName);
+    }
+
+    return res;
+}
+
+/* Returns a decompressed frame, from the cache when possible */
+static const unsigned char *__HCCellFrame(HCCell *cell, const HCCellEntry *entry,
+    unsigned int frame, unsigned long *outLen)
+{
+    const HCBlockProperty *property = &entry->property;
+    HCCellCacheSlot *slot = NULL;
+    unsigned long long key = entry->dataOffset + entry->frameOffsets[frame];
+    unsigned long srcLen = property->frameTable[frame];
+    unsigned long dstLen = property->fSize2 - (unsigned long long)frame * property->frameSize;
+    unsigned char *p = NULL;
+    int i, res = 0;
+
+    if(dstLen > property->frameSize)
+        dstLen = property->frameSize;
+    /* Hit, or the least recently used slot */
+    for(i = 0; i < HC_CELL_CACHE_FRAMES; i++) {
+        if(cell->cache[i].tick && cell->cache[i].key == key && cell->cache[i].dataLen == dstLen) {
+            cell->cache[i].tick = ++cell->tick;
+            *outLen = cell->cache[i].dataLen;
+            return cell->cache[i].data;
+        }
+        if(!slot || cell->cache[i].tick < slot->tick)
+            slot = &cell->cache[i];
+    }
+
+    slot->tick = 0;
+    if(slot->capacity < dstLen) {
+        if(!(p = realloc(slot->data, dstLen)))
+            return NULL;
+        slot->data = p;
+        slot->capacity = dstLen;
+    }
+    if(cell->scratchSize < srcLen) {
+        if(!(p = realloc(cell->scratch, srcLen)))
+            return NULL;
+        cell->scratch = p;
+        cell->scratchSize = srcLen;
+    }
+    if(pread(cell->fd, cell->scratch, srcLen, cell->offset + key) != (ssize_t)srcLen) {
+        pushdeb("in %s: failed to read frame, I/O error\n", __func__);
+        return NULL;
+    }
+    if(property->frameSums && crc32(0L, cell->scratch, srcLen) != property->frameSums[frame]) {
+        pushdeb("in %s: frame %u of \'%s\' fails its checksum\n", __func__, frame, property->pathName);
+        return NULL;
+    }
+    slot->dataLen = dstLen;
+    if((res = HCCodecDecompress(cell->ctx, property->codec, slot->data, &slot->dataLen,
+        cell->scratch, srcLen)) || slot->dataLen != dstLen) {
+        pushdeb("in %s: failed to decompress frame %u of \'%s\' (%d)\n", __func__, frame,
+            property->pathName, res);
+        return NULL;
+    }
+    slot->key = key;
+    slot->tick = ++cell->tick;
+    *outLen = slot->dataLen;
+
+    return slot->data;
+}
+
+/* Large files are authenticated this many bytes at a time, so that a single
+   file of several GB still keeps every thread busy */
+#define HC_VERIFY_STRIPE (64ULL * 1024 * 1024)
+
+/* Part of a regular file to authenticate */
+typedef struct _HCVerifyTask {
+    unsigned long       item;
+    unsigned long       stripe;     // Frames starting in this HC_VERIFY_STRIPE
+} HCVerifyTask;
+
+/* Shared by the threads of one HCCellVerify() or HCCellAuthenticate() */
+typedef struct _HCVerifyJob {
+    HCCell             *cell;
+    const HCTree       *tree;       // Authenticate against it, NULL to verify
+    const HCIndexEntry *items;      // Sorted by offset
+    unsigned long       count;
+    unsigned long long *ends;       // Verify, where each block ends, 0 if it is bad
+    HCVerifyTask       *tasks;      // Authenticate, what the threads take
+    unsigned long       taskCount;
+    atomic_uchar       *failed;     // Authenticate, per item
+    atomic_ulong        next;
+    atomic_ulong        bad;
+    atomic_ulong        files;      // Regular files authenticated
+} HCVerifyJob;
+
+/* Buffers owned by one verify thread */
+typedef struct _HCVerifyWorker {
+    HCCodecContext     *codec;
+    unsigned char      *in;
+    unsigned long       inSize;
+    unsigned char      *out;
+    unsigned long       outSize;
+} HCVerifyWorker;
+
+/* Reads frame 'i' as stored into worker->in, returns its length, 0 for a
+   frame left out and -1 on failure */
+static long __HCVerifyReadFrame(HCCell *cell, const HCCellEntry *entry, unsigned int i,
+    HCVerifyWorker *worker)
+{
+    unsigned long srcLen = entry->property.frameTable[i];
+    unsigned char *tBuffer = NULL;
+
+    if(srcLen > worker->inSize) {
+        if(!(tBuffer = realloc(worker->in, srcLen)))
+            return -1;
+        worker->in = tBuffer;
+        worker->inSize = srcLen;
+    }
+    if(srcLen && pread(cell->fd, worker->in, srcLen, cell->offset + entry->dataOffset +
+        entry->frameOffsets[i]) != (ssize_t)srcLen)
+        return -1;
+
+    return (long)srcLen;
+}
+
+/* Frame 'i' as extracted, in one of the buffers of 'worker'. NULL if it
+   cannot be read or inflated to its size */
+static const unsigned char *__HCVerifyRawFrame(HCCell *cell, const HCCellEntry *entry,
+    unsigned int i, HCVerifyWorker *worker, unsigned long *outLen)
+{
+    const HCBlockProperty *property = &entry->property;
+    unsigned char *tBuffer = NULL;
+    unsigned long rawLen = 0, dstLen = 0;
+    long srcLen = 0;
+
+    rawLen = property->fSize2 - (unsigned long long)i * property->frameSize;
+    if(rawLen > property->frameSize)
+        rawLen = property->frameSize;
+    *outLen = rawLen;
+    if((srcLen = __HCVerifyReadFrame(cell, entry, i, worker)) < 0)
+        return NULL;
+    /* Frames that did not shrink are stored as they are */
+    if((unsigned long)srcLen == rawLen)
+        return worker->in;
+    if(rawLen > worker->outSize) {
+        if(!(tBuffer = realloc(worker->out, rawLen)))
+            return NULL;
+        worker->out = tBuffer;
+        worker->outSize = rawLen;
+    }
+    if(!srcLen) {
+        memset(worker->out, 0, rawLen);
+        return worker->out;
+    }
+    dstLen = rawLen;
+    if(HCCodecDecompress(worker->codec, property->codec, worker->out, &dstLen, worker->in, srcLen) ||
+        dstLen != rawLen)
+        return NULL;
+
+    return worker->out;
+}
+
+/* Checks the payload of a regular file frame by frame, against its checksums
+   if the cell has them and by inflating it otherwise */
+static int __HCCellVerifyFrames(HCCell *cell, const HCCellEntry *entry, HCVerifyWorker *worker)
+{
+    const HCBlockProperty *property = &entry->property;
+    unsigned long rawLen = 0;
+    unsigned int i;
+    long srcLen = 0;
+
+    for(i = 0; i < property->frames; i++) {
+        if(!property->frameTable[i])
+            continue;
+        if(!property->frameSums) {
+            if(!__HCVerifyRawFrame(cell, entry, i, worker, &rawLen))
+                return -4;
+            continue;
+        }
+        if((srcLen = __HCVerifyReadFrame(cell, entry, i, worker)) < 0 ||
+            crc32(0L, worker->in, srcLen) != property->frameSums[i])
+            return -4;
+    }
+
+    return 0;
+}
+
+/* Checks one block, returns where it ends or 0 if it is bad */
+static unsigned long long __HCCellVerifyBlock(HCCell *cell, const HCIndexEntry *ie, HCVerifyWorker *worker)
+{
+    HCCellEntry entry;
+    const HCBlockProperty *property = &entry.property;
+    unsigned long long dataLen = 0, end = 0;
+    unsigned long long cellLen = cell->infoBlock.length + cell->infoBlock.fsSize;
+
+    memset(&entry, 0, sizeof(HCCellEntry));
+    if(__HCCellReadEntry(cell, ie, &entry, &dataLen)) {
+        HCBlockPropertyRelease(&entry.property);
+        if(entry.frameOffsets) free(entry.frameOffsets);
+        return 0;
+    }
+    /* The index has to agree with the block it points at */
+    if(HCPathHash((const char *)property->pathName) == ie->pathHash && property->fType == ie->fType &&
+        property->fSize2 == ie->fSize2 && dataLen <= cellLen - ie->offset)
+        end = ie->offset + HC_BLOCK_HEADER_LEN + ie->blockLen + dataLen;
+    if(end && property->fType == BLK_REG) {
+        /* A payload is either right behind the header or shared */
+        if(dataLen != (property->dataRef ? 0 : property->fSize1) ||
+            entry.dataOffset > cellLen || property->fSize1 > cellLen - entry.dataOffset ||
+            __HCCellVerifyFrames(cell, &entry, worker))
+            end = 0;
+    }
+    if(!end)
+        pushdeb("in %s: block at %llu (\'%s\') is bad\n", __func__, ie->offset, property->pathName);
+    HCBlockPropertyRelease(&entry.property);
+    if(entry.frameOffsets) free(entry.frameOffsets);
+
+    return end;
+}
+
+/* Checks one stripe of a regular file against the digest tree, returns 0
+   if it is authentic */
+static int __HCCellAuthenticateBlock(HCCell *cell, const HCTree *tree, const HCIndexEntry *ie,
+    unsigned long stripe, HCVerifyWorker *worker)
+{
+    HCCellEntry entry;
+    const HCBlockProperty *property = &entry.property;
+    const unsigned char *raw = NULL;
+    unsigned char digest[HC_SHA256_LEN];
+    unsigned long long begin = stripe * HC_VERIFY_STRIPE, end = begin + HC_VERIFY_STRIPE;
+    unsigned long rawLen = 0;
+    unsigned int i, last = 0;
+    long row = -1;
+    int res = 1;
+
+    memset(&entry, 0, sizeof(HCCellEntry));
+    /* The stripes were cut by the size in the index, it must not lie */
+    if(__HCCellReadEntry(cell, ie, &entry, NULL) || property->fType != BLK_REG ||
+        property->fSize2 != ie->fSize2 ||
+        (row = HCTreeFind(tree, ie->offset)) < 0 || HCTreeFrames(tree, row) != property->frames)
+        goto __HCCAB_DONE;
+    /* The leaves are trusted once they lead to the node of this very file.
+       Every stripe checks that, it is little next to hashing the frames */
+    HCTreeFileNode((const char *)property->pathName, property->fSize2,
+        tree->leaf + tree->first[row] * HC_SHA256_LEN, property->frames, digest);
+    if(memcmp(digest, tree->node + row * HC_SHA256_LEN, HC_SHA256_LEN))
+        goto __HCCAB_DONE;
+    i = property->frameSize ? (begin + property->frameSize - 1) / property->frameSize : 0;
+    last = property->frameSize ? (end + property->frameSize - 1) / property->frameSize : 0;
+    if(last > property->frames)
+        last = property->frames;
+    for(; i < last; i++) {
+        if(!(raw = __HCVerifyRawFrame(cell, &entry, i, worker, &rawLen)))
+            goto __HCCAB_DONE;
+        HCTreeLeaf(raw, rawLen, digest);
+        if(memcmp(digest, tree->leaf + (tree->first[row] + i) * HC_SHA256_LEN, HC_SHA256_LEN))
+            goto __HCCAB_DONE;
+    }
+    res = 0;
+
+__HCCAB_DONE:
+    if(res)
+        pushdeb("in %s: \'%s\' at %llu is not authentic\n", __func__, property->pathName, ie->offset);
+    HCBlockPropertyRelease(&entry.property);
+    if(entry.frameOffsets) free(entry.frameOffsets);
+    return res;
+}
+
+static void *__HCVerifyThreadImpl(void *param)
+{
+    HCVerifyJob *job = (HCVerifyJob *)param;
+    const HCVerifyTask *task = NULL;
+    HCVerifyWorker worker;
+    unsigned long i;
+
+    memset(&worker, 0, sizeof(HCVerifyWorker));
+    if(!(worker.codec = HCCodecContextNew())) {
+        /* What this thread would have taken is left to the others */
+        pushdeb("in %s: failed to allocate memory\n", __func__);
+        return NULL;
+    }
+    while(!job->tree && (i = atomic_fetch_add(&job->next, 1)) < job->count)
+        if(!(job->ends[i] = __HCCellVerifyBlock(job->cell, &job->items[i], &worker)))
+            atomic_fetch_add(&job->bad, 1);
+    while(job->tree && (i = atomic_fetch_add(&job->next, 1)) < job->taskCount) {
+        task = &job->tasks[i];
+        if(!task->stripe)
+            atomic_fetch_add(&job->files, 1);
+        if(__HCCellAuthenticateBlock(job->cell, job->tree, &job->items[task->item], task->stripe, &worker))
+            atomic_store(&job->failed[task->item], 1);
+    }
+    HCCodecContextDestroy(&worker.codec);
+    if(worker.in) free(worker.in);
+    if(worker.out) free(worker.out);
+
+    return NULL;
+}
+
+static int __HCVerifyCompare(const void *a, const void *b)
+{
+    const HCIndexEntry *x = (const HCIndexEntry *)a, *y = (const HCIndexEntry *)b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Hands every block of the cell to 'workers' threads, 'job' is set up but
+   for its items. Returns 0 once every block was looked at */
+static int __HCVerifyJobRun(HCCell *cell, HCVerifyJob *job, int workers)
+{
+    HCIndexEntry *items = NULL;
+    unsigned long i, k, stripes, total = 0;
+    int started = 0;
+
+#if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
+    if(workers <= 0)
+        workers = (int)sysconf(_SC_NPROCESSORS_CONF);
+#endif
+    if(workers <= 0)
+        workers = 1;
+    pthread_t threads[workers];
+
+    if(cell->count) {
+        HCCalloc(items, cell->count, sizeof(HCIndexEntry), return -2);
+        memcpy(items, cell->entries, cell->count * sizeof(HCIndexEntry));
+        qsort(items, cell->count, sizeof(HCIndexEntry), __HCVerifyCompare);
+    }
+    job->cell = cell;
+    job->items = items;
+    job->count = cell->count;
+    if(!job->tree && cell->count)
+        HCCalloc(job->ends, cell->count, sizeof(unsigned long long), return -2);
+    if(job->tree && cell->count) {
+        /* Hard links have their content at their target */
+        for(i = 0; i < cell->count; i++)
+            if(items[i].fType == BLK_REG)
+                total += items[i].fSize2 > HC_VERIFY_STRIPE ?
+                    (items[i].fSize2 + HC_VERIFY_STRIPE - 1) / HC_VERIFY_STRIPE : 1;
+        HCCalloc(job->failed, cell->count, sizeof(atomic_uchar), return -2);
+        if(total)
+            HCCalloc(job->tasks, total, sizeof(HCVerifyTask), return -2);
+        for(i = 0; i < cell->count; i++) {
+            if(items[i].fType != BLK_REG)
+                continue;
+            stripes = items[i].fSize2 > HC_VERIFY_STRIPE ?
+                (items[i].fSize2 + HC_VERIFY_STRIPE - 1) / HC_VERIFY_STRIPE : 1;
+            for(k = 0; k < stripes; k++, job->taskCount++) {
+                job->tasks[job->taskCount].item = i;
+                job->tasks[job->taskCount].stripe = k;
+            }
+        }
+    }
+    atomic_init(&job->next, 0);
+    atomic_init(&job->bad, 0);
+    atomic_init(&job->files, 0);
+
+    for(started = 0; started < workers; started++)
+        if(pthread_create(&threads[started], NULL, __HCVerifyThreadImpl, job))
+            break;
+    if(!started)
+        /* Nobody to hand it to, so do it here */
+        __HCVerifyThreadImpl(job);
+    for(i = 0; i < (unsigned long)started; i++)
+        pthread_join(threads[i], NULL);
+    if(atomic_load(&job->next) < (job->tree ? job->taskCount : job->count)) {
+        pushdeb("in %s: no thread could check the cell\n", __func__);
+        return -2;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief check every block of a cell without extracting anything
+ * @param cell the cell, not used by anyone else meanwhile
+ * @param workers threads to check with, 0 for one per core
+ * @param outBad receives the number of bad blocks, may be NULL
+ * @return 0 if the cell is intact, 1 if it is not, otherwise are failed.
+ *         Blocks are checked against their checksums when the cell has them,
+ *         payloads of older cells are inflated instead. The blocks must also
+ *         follow each other from the InfoBlock to the sections at the end
+ */
+int HCCellVerify(HCCell *cell, int workers, unsigned long *outBad)
+{
+    HCVerifyJob job;
+    const HCIndexEntry *items = NULL;
+    unsigned long long expected = 0, blocksEnd = 0;
+    unsigned long i, bad = 0;
+    int res = 0;
+
+    HCAssert(cell, return -1);
+    memset(&job, 0, sizeof(HCVerifyJob));
+    if((res = __HCVerifyJobRun(cell, &job, workers)))
+        goto __HCCV_CLEANUP;
+    items = job.items;
+    bad = atomic_load(&job.bad);
+
+    /* Nothing missing, nothing overlapping and nothing in between */
+    blocksEnd = cell->infoBlock.index ? cell->infoBlock.index : cell->infoBlock.meta ?
+        cell->infoBlock.meta : cell->infoBlock.tree ? cell->infoBlock.tree :
+        cell->infoBlock.length + cell->infoBlock.fsSize;
+    for(expected = cell->infoBlock.length, i = 0; i < job.count; i++) {
+        if(!job.ends[i]) {
+            expected = i + 1 < job.count ? items[i + 1].offset : blocksEnd;
+            continue;
+        }
+        if(items[i].offset != expected) {
+            pushdeb("in %s: block at %llu should be at %llu\n", __func__, items[i].offset, expected);
+            bad++;
+        }
+        expected = job.ends[i];
+    }
+    if(expected != blocksEnd) {
+        pushdeb("in %s: blocks end at %llu, not at %llu\n", __func__, expected, blocksEnd);
+        bad++;
+    }
+    if(outBad) *outBad = bad;
+    res = bad ? 1 : 0;
+
+__HCCV_CLEANUP:
+    if(job.items) free((void *)job.items);
+    if(job.ends) free(job.ends);
+    return res;
+}
+
+/**
+ * @brief open a cell, check it with HCCellVerify() and close it again
+ * @param cellfd the cell file
+ * @param offset where the cell begins in 'cellfd'
+ * @param workers threads to check with, 0 for one per core
+ * @param outBad receives the number of bad blocks, may be NULL
+ * @return as HCCellVerify(), -4 if the cell cannot even be opened
+ */
+int HCVerifyCell(int cellfd, unsigned long offset, int workers, unsigned long *outBad)
+{
+    HCCell *cell = NULL;
+    int res = 0;
+
+    if(!(cell = HCCellOpen(cellfd, offset)))
+        return -4;
+    res = HCCellVerify(cell, workers, outBad);
+    HCCellClose(&cell);
+
+    return res;
+}
+
+/* Loads the digest tree once, returns as HCTreeLoad() */
+static int __HCCellTree(HCCell *cell)
+{
+    if(!cell->treeState)
+        cell->treeState = HCTreeLoad(cell->fd, cell->offset, &cell->infoBlock, &cell->tree) + 2;
+
+    return cell->treeState - 2;
+}
+
+/**
+ * @brief check the content of every regular file against ROOT of the
+ *        InfoBlock, the frames are inflated and hashed on several threads
+ * @param cell the cell, not used by anyone else meanwhile
+ * @param workers threads to check with, 0 for one per core
+ * @param outBad receives the number of files that are not authentic, may be NULL
+ * @return 0 if the content is authentic, 1 if it is not, 2 if the cell has
+ *         no digest tree, otherwise are failed. ROOT itself is what the
+ *         caller has to trust, e.g. through a signature of the InfoBlock
+ */
+int HCCellAuthenticate(HCCell *cell, int workers, unsigned long *outBad)
+{
+    HCVerifyJob job;
+    unsigned long i, bad = 0;
+    int res = 0;
+
+    HCAssert(cell, return -1);
+    if((res = __HCCellTree(cell)) == 1)
+        return 2;
+    if(res == -5) {
+        /* Nothing in the cell can be trusted */
+        if(outBad) *outBad = cell->infoBlock.blocks;
+        return 1;
+    }
+    if(res)
+        return res;
+
+    memset(&job, 0, sizeof(HCVerifyJob));
+    job.tree = cell->tree;
+    if((res = __HCVerifyJobRun(cell, &job, workers)))
+        goto __HCCA_CLEANUP;
+    for(i = 0; i < job.count; i++)
+        if(atomic_load(&job.failed[i]))
+            bad++;
+    /* Every row went to a different file, so no row is left over */
+    if(atomic_load(&job.files) != cell->tree->count) {
+        pushdeb("in %s: %lu regular files for %lu digest tree rows\n", __func__,
+            (unsigned long)atomic_load(&job.files), cell->tree->count);
+        bad++;
+    }
+    if(outBad) *outBad = bad;
+    res = bad ? 1 : 0;
+
+__HCCA_CLEANUP:
+    if(job.items) free((void *)job.items);
+    if(job.tasks) free(job.tasks);
+    if(job.failed) free(job.failed);
+    return res;
+}
+
+/**
+ * @brief open a cell, check it with HCCellAuthenticate() and close it again
+ * @return as HCCellAuthenticate(), -4 if the cell cannot even be opened
+ */
+int HCAuthenticateCell(int cellfd, unsigned long offset, int workers, unsigned long *outBad)
+{
+    HCCell *cell = NULL;
+    int res = 0;
+
+    if(!(cell = HCCellOpen(cellfd, offset)))
+        return -4;
+    res = HCCellAuthenticate(cell, workers, outBad);
+    HCCellClose(&cell);
+
+    return res;
+}
+
+/**
+ * @brief check one file extracted from the cell, or what an interrupted
+ *        extraction left of it, against ROOT of the InfoBlock. Only the
+ *        frames of that file are hashed, the cell is not inflated
+ * @param cell the cell the file came from
+ * @param path pathname of the file in the cell, a hard link stands for its target
+ * @param fd the file as extracted
+ * @param outGood receives how many bytes from the start of 'fd' are
+ *        authentic, a whole number of frames unless the file is, may be NULL
+ * @return 0 if 'fd' is authentic as a whole, 1 if it is not, 2 if the cell
+ *         has no digest tree, -4 if the cell is broken, otherwise are failed
+ */
+int HCCellAuthenticateFile(HCCell *cell, const char *path, int fd, unsigned long long *outGood)
+{
+    HCCellEntry *entry = NULL;
+    const HCBlockProperty *property = NULL;
+    unsigned char *buffer = NULL, digest[HC_SHA256_LEN];
+    unsigned long long good = 0, at = 0;
+    unsigned long want = 0;
+    unsigned int i = 0;
+    long row = -1;
+    int res = 0;
+
+    HCAssert(cell && path && fd > -1, return -1);
+    if(outGood) *outGood = 0;
+    if((res = __HCCellTree(cell)) == 1)
+        return 2;
+    if(res)
+        return res == -5 ? -4 : res;
+    if(!(entry = HCCellLookup(cell, path))) {
+        pushdeb("in %s: \'%s\' is not in the cell\n", __func__, path);
+        return -4;
+    }
+    /* A hard link was followed by the lookup already */
+    property = &entry->property;
+    if(property->fType != BLK_REG) {
+        pushdeb("in %s: \'%s\' is not a regular file\n", __func__, path);
+        HCCellEntryFree(&entry);
+        return -1;
+    }
+    res = -4;
+    if((row = HCTreeFind(cell->tree, entry->offset)) < 0 ||
+        HCTreeFrames(cell->tree, row) != property->frames)
+        goto __HCCAF_CLEANUP;
+    HCTreeFileNode((const char *)property->pathName, property->fSize2,
+        cell->tree->leaf + cell->tree->first[row] * HC_SHA256_LEN, property->frames, digest);
+    if(memcmp(digest, cell->tree->node + row * HC_SHA256_LEN, HC_SHA256_LEN))
+        goto __HCCAF_CLEANUP;
+
+    res = -2;
+    if(property->frames)
+        HCCalloc(buffer, 1, property->frameSize, goto __HCCAF_CLEANUP);
+    /* Stops at the first frame that is missing or differs, the rest would
+       have to be extracted again anyway */
+    for(i = 0; i < property->frames; i++, good += want) {
+        at = (unsigned long long)i * property->frameSize;
+        want = property->fSize2 - at < property->frameSize ? property->fSize2 - at : property->frameSize;
+        if(pread(fd, buffer, want, at) != (ssize_t)want)
+            break;
+        HCTreeLeaf(buffer, want, digest);
+        if(memcmp(digest, cell->tree->leaf + (cell->tree->first[row] + i) * HC_SHA256_LEN, HC_SHA256_LEN))
+            break;
+    }
+    /* Nothing may follow the content either */
+    res = i < property->frames || pread(fd, digest, 1, property->fSize2) != 0 ? 1 : 0;
+    if(outGood) *outGood = good;
+
+__HCCAF_CLEANUP:
+    if(res == -4)
+        pushdeb("in %s: digest tree has no valid row for \'%s\'\n", __func__, path);
+    if(buffer) free(buffer);
+    HCCellEntryFree(&entry);
+    return res;
+}
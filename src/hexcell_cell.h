@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#ifndef _HEXCELL_CELL_H_
+#define _HEXCELL_CELL_H_
+
+#include <sys/types.h>
+
+#include <hexcell_data.h>
+
+/* Read-only view of a cell, entries are looked up through the central index.
+   A cell must not be used by two threads at once */
+typedef struct _HCCell HCCell;
+
+/* One body unit as found by HCCellLookup() */
+typedef struct _HCCellEntry {
+    HCBlockProperty     property;       // Strings decoded, fSize2 is the file size
+    unsigned long long  offset;         // BID_BEGIN, from the InfoBlock
+    unsigned long long  dataOffset;     // First frame, from the InfoBlock
+    unsigned long long *frameOffsets;   // frames + 1 offsets, from dataOffset
+} HCCellEntry;
+
+/* One row of HCCellList(), valid during the callback only */
+typedef struct _HCCellListItem {
+    const char         *path;           // Decoded
+    unsigned long long  offset;         // BID_BEGIN, from the InfoBlock
+    unsigned long long  fSize;          // Original
+    unsigned int        fMode;
+    unsigned int        fUID;
+    unsigned int        fGID;
+    short               fType;
+} HCCellListItem;
+
+/* Returns nonzero to stop the listing */
+typedef int (*HCCellListCallback)(const HCCellListItem *item, void *userData);
+
+/* Decompressed frames kept by a cell for repeated reads */
+#define HC_CELL_CACHE_FRAMES 4
+
+extern HCCell      *HCCellOpen(int cellfd, unsigned long offset);
+extern void         HCCellClose(HCCell **cell);
+extern HCCellEntry *HCCellLookup(HCCell *cell, const char *path);
+extern void         HCCellEntryFree(HCCellEntry **entry);
+extern int          HCCellList(HCCell *cell, HCCellListCallback callback, void *userData);
+extern ssize_t      HCCellPread(HCCell *cell, const HCCellEntry *entry, void *buf, size_t len,
+    unsigned long long offset);
+
+/* Checks all blocks with several threads, nothing is written anywhere */
+extern int          HCCellVerify(HCCell *cell, int workers, unsigned long *outBad);
+extern int          HCVerifyCell(int cellfd, unsigned long offset, int workers, unsigned long *outBad);
+
+/* Checks content against the digest tree, all of it or one extracted file */
+extern int          HCCellAuthenticate(HCCell *cell, int workers, unsigned long *outBad);
+extern int          HCAuthenticateCell(int cellfd, unsigned long offset, int workers,
+    unsigned long *outBad);
+extern int          HCCellAuthenticateFile(HCCell *cell, const char *path, int fd,
+    unsigned long long *outGood);
+
+#endif /* _HEXCELL_CELL_H_ */
@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <hexcell_utils.h>
+#include <hexcell_codec.h>
+
+/* Bytes compressed to probe a frame, and the ratio (in 1/1000) above which the
+   frame is stored as is */
+#define HC_CODEC_SAMPLE_SIZE    (16 * 1024)
+#define HC_CODEC_SAMPLE_RATIO   970
+
+/* Leading bytes of formats that are compressed already */
+static const struct {
+    size_t          len;
+    unsigned char   magic[6];
+} __HCCompressedMagics[] = {
+    { 2, { 0x1F, 0x8B } },                          // gzip
+    { 3, { 'B', 'Z', 'h' } },                       // bzip2
+    { 6, { 0xFD, '7', 'z', 'X', 'Z', 0x00 } },      // xz
+    { 4, { 0x28, 0xB5, 0x2F, 0xFD } },              // zstd
+    { 4, { 0x04, 0x22, 0x4D, 0x18 } },              // lz4
+    { 6, { '7', 'z', 0xBC, 0xAF, 0x27, 0x1C } },    // 7z
+    { 4, { 'P', 'K', 0x03, 0x04 } },                // zip, jar, apk
+    { 4, { 0x89, 'P', 'N', 'G' } },                 // png
+    { 3, { 0xFF, 0xD8, 0xFF } },                    // jpeg
+    { 4, { 'O', 'g', 'g', 'S' } },                  // ogg
+    { 4, { 'w', 'O', 'F', '2' } }                   // woff2
+};
+
+HCCodecContext *HCCodecContextNew(void)
+{
+    HCCodecContext *ctx = NULL;
+
+    HCCalloc(ctx, 1, sizeof(HCCodecContext), return NULL);
+
+    return ctx;
+}
+
+void HCCodecContextDestroy(HCCodecContext **ctx)
+{
+    HCCodecContext *p = *ctx;
+
+    if(*ctx) {
+        if(p->deflaterReady) deflateEnd(&p->deflater);
+        if(p->proberReady) deflateEnd(&p->prober);
+        if(p->inflaterReady) inflateEnd(&p->inflater);
+#ifdef HAVE_ZSTD
+        if(p->zstdCompressor) ZSTD_freeCCtx(p->zstdCompressor);
+        if(p->zstdDecompressor) ZSTD_freeDCtx(p->zstdDecompressor);
+#endif
+        free(*ctx);
+        *ctx = NULL;
+    }
+}
+
+int HCCodecSupported(int codec)
+{
+    switch(codec) {
+        case HC_CODEC_STORE:
+        case HC_CODEC_ZLIB:
+            return 1;
+#ifdef HAVE_ZSTD
+        case HC_CODEC_ZSTD:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+unsigned long HCCodecBound(int codec, unsigned long len)
+{
+    switch(codec) {
+        case HC_CODEC_ZLIB: return compressBound(len);
+#ifdef HAVE_ZSTD
+        case HC_CODEC_ZSTD: return ZSTD_compressBound(len);
+#endif
+        default:            return len;
+    }
+}
+
+/* One whole buffer through a deflater that is set up already */
+static int __HCZlibDeflate(z_stream *strm, unsigned char *dst, unsigned long *dstLen,
+    const unsigned char *src, unsigned long srcLen)
+{
+    int zRes = Z_OK;
+
+    deflateReset(strm);
+    strm->next_in = (unsigned char *)src;
+    strm->avail_in = srcLen;
+    strm->next_out = dst;
+    strm->avail_out = *dstLen;
+    if((zRes = deflate(strm, Z_FINISH)) != Z_STREAM_END)
+        return zRes == Z_OK ? Z_BUF_ERROR : zRes;
+    *dstLen = strm->total_out;
+
+    return 0;
+}
+
+static int __HCZlibCompress(HCCodecContext *ctx, int level, unsigned char *dst,
+    unsigned long *dstLen, const unsigned char *src, unsigned long srcLen)
+{
+    if(!ctx->deflaterReady) {
+        if(deflateInit(&ctx->deflater, level) != Z_OK)
+            return -2;
+        ctx->deflaterReady = 1;
+        ctx->deflaterLevel = level;
+    } else if(ctx->deflaterLevel != level) {
+        deflateReset(&ctx->deflater);
+        if(deflateParams(&ctx->deflater, level, Z_DEFAULT_STRATEGY) != Z_OK)
+            return -3;
+        ctx->deflaterLevel = level;
+    }
+
+    return __HCZlibDeflate(&ctx->deflater, dst, dstLen, src, srcLen);
+}
+
+static int __HCZlibDecompress(HCCodecContext *ctx, unsigned char *dst,
+    unsigned long *dstLen, const unsigned char *src, unsigned long srcLen)
+{
+    int zRes = Z_OK;
+
+    if(!ctx->inflaterReady) {
+        if(inflateInit(&ctx->inflater) != Z_OK)
+            return -2;
+        ctx->inflaterReady = 1;
+    } else
+        inflateReset(&ctx->inflater);
+
+    ctx->inflater.next_in = (unsigned char *)src;
+    ctx->inflater.avail_in = srcLen;
+    ctx->inflater.next_out = dst;
+    ctx->inflater.avail_out = *dstLen;
+    if((zRes = inflate(&ctx->inflater, Z_FINISH)) != Z_STREAM_END)
+        return zRes == Z_OK ? Z_DATA_ERROR : zRes;
+    *dstLen = ctx->inflater.total_out;
+
+    return 0;
+}
+
+/**
+ * @brief compress one frame
+ * @param ctx per-thread codec context
+ * @param codec HC_CODEC_*
+ * @param level codec specific level
+ * @param dst output, at least HCCodecBound() bytes
+ * @param dstLen in: size of dst, out: compressed length
+ * @return 0 on success, otherwise are failed
+ */
+int HCCodecCompress(HCCodecContext *ctx, int codec, int level, unsigned char *dst,
+    unsigned long *dstLen, const unsigned char *src, unsigned long srcLen)
+{
+    HCAssert(ctx && dst && dstLen, return -1);
+
+    switch(codec) {
+        case HC_CODEC_STORE:
+            HCAssert(*dstLen >= srcLen, return -1);
+            memcpy(dst, src, srcLen);
+            *dstLen = srcLen;
+            return 0;
+        case HC_CODEC_ZLIB:
+            return __HCZlibCompress(ctx, level, dst, dstLen, src, srcLen);
+#ifdef HAVE_ZSTD
+        case HC_CODEC_ZSTD: {
+            size_t zRes;
+            if(!ctx->zstdCompressor && !(ctx->zstdCompressor = ZSTD_createCCtx()))
+                return -2;
+            zRes = ZSTD_compressCCtx(ctx->zstdCompressor, dst, *dstLen, src, srcLen, level);
+            if(ZSTD_isError(zRes))
+                return -3;
+            *dstLen = zRes;
+            return 0;
+        }
+#endif
+        default:
+            return -1;
+    }
+}
+
+/**
+ * @brief decompress one frame
+ * @param dstLen in: expected length, out: decompressed length
+ * @note frames the compressor could not shrink are stored as is, a frame as
+ *       long as its expected output is copied whatever the codec
+ * @return 0 on success, otherwise are failed
+ */
+int HCCodecDecompress(HCCodecContext *ctx, int codec, unsigned char *dst,
+    unsigned long *dstLen, const unsigned char *src, unsigned long srcLen)
+{
+    HCAssert(ctx && dst && dstLen, return -1);
+
+    if(codec == HC_CODEC_STORE || srcLen == *dstLen) {
+        HCAssert(srcLen <= *dstLen, return -1);
+        memcpy(dst, src, srcLen);
+        *dstLen = srcLen;
+        return 0;
+    }
+
+    switch(codec) {
+        case HC_CODEC_ZLIB:
+            return __HCZlibDecompress(ctx, dst, dstLen, src, srcLen);
+#ifdef HAVE_ZSTD
+        case HC_CODEC_ZSTD: {
+            size_t zRes;
+            if(!ctx->zstdDecompressor && !(ctx->zstdDecompressor = ZSTD_createDCtx()))
+                return -2;
+            zRes = ZSTD_decompressDCtx(ctx->zstdDecompressor, dst, *dstLen, src, srcLen);
+            if(ZSTD_isError(zRes))
+                return -3;
+            *dstLen = zRes;
+            return 0;
+        }
+#endif
+        default:
+            return -1;
+    }
+}
+
+/**
+ * @brief check the leading bytes of a file against known compressed formats
+ * @return 1 when the payload is compressed already
+ */
+int HCCodecLooksCompressed(const unsigned char *head, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i < sizeof(__HCCompressedMagics) / sizeof(__HCCompressedMagics[0]); i++)
+        if(len >= __HCCompressedMagics[i].len &&
+            !memcmp(head, __HCCompressedMagics[i].magic, __HCCompressedMagics[i].len))
+            return 1;
+
+    return 0;
+}
+
+/**
+ * @brief probe a frame by compressing a sample of it at the fastest level
+ * @return 1 when compressing the frame is likely to pay off
+ */
+int HCCodecWorthCompressing(HCCodecContext *ctx, const unsigned char *src, unsigned long len)
+{
+    unsigned char sample[HC_CODEC_SAMPLE_SIZE + 64];   // Past compressBound() of a sample
+    unsigned long sampleLen = len < HC_CODEC_SAMPLE_SIZE ? len : HC_CODEC_SAMPLE_SIZE;
+    unsigned long outLen = sizeof(sample);
+
+    /* Not worth probing tiny frames */
+    if(len < 4 * 1024)
+        return 1;
+    /* A stream of its own, the frame deflater keeps its level */
+    if(!ctx->proberReady) {
+        if(deflateInit(&ctx->prober, 1) != Z_OK)
+            return 1;
+        ctx->proberReady = 1;
+    }
+    /* Probe from the middle, headers often compress better than the rest */
+    src += (len - sampleLen) / 2;
+    if(__HCZlibDeflate(&ctx->prober, sample, &outLen, src, sampleLen))
+        return 1; /* Cannot tell, let the real compressor decide */
+
+    return outLen * 1000 < sampleLen * HC_CODEC_SAMPLE_RATIO;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#ifndef _HEXCELL_CODEC_H_
+#define _HEXCELL_CODEC_H_
+
+#include <stddef.h>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Codec IDs, stored per entry in BID_PROP_CODEC */
+enum {
+    HC_CODEC_STORE = 0,
+    HC_CODEC_ZLIB,
+    HC_CODEC_ZSTD,          // Only with HAVE_ZSTD, link with -lzstd
+    HC_CODEC_MAX
+};
+#define HC_CODEC_MASK(c) (1UL << (c))
+
+/* Compressor/decompressor state, one per thread, reused for every frame */
+typedef struct _HCCodecContext {
+    z_stream        deflater;
+    int             deflaterReady;
+    int             deflaterLevel;
+    z_stream        prober;         // Level 1, HCCodecWorthCompressing() only
+    int             proberReady;
+    z_stream        inflater;
+    int             inflaterReady;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx      *zstdCompressor;
+    ZSTD_DCtx      *zstdDecompressor;
+#endif
+} HCCodecContext;
+
+extern HCCodecContext *HCCodecContextNew(void);
+extern void HCCodecContextDestroy(HCCodecContext **ctx);
+
+extern int  HCCodecSupported(int codec);
+extern unsigned long HCCodecBound(int codec, unsigned long len);
+extern int  HCCodecCompress(HCCodecContext *ctx, int codec, int level, unsigned char *dst,
+    unsigned long *dstLen, const unsigned char *src, unsigned long srcLen);
+extern int  HCCodecDecompress(HCCodecContext *ctx, int codec, unsigned char *dst,
+    unsigned long *dstLen, const unsigned char *src, unsigned long srcLen);
+
+/* Incompressible payload detection */
+extern int  HCCodecLooksCompressed(const unsigned char *head, size_t len);
+extern int  HCCodecWorthCompressing(HCCodecContext *ctx, const unsigned char *src, unsigned long len);
+
+#endif /* _HEXCELL_CODEC_H_ */
@@ -32,48 +32,184 @@
 #ifndef _HEXCELL_DATA_H_
 #define _HEXCELL_DATA_H_
 
+/* InfoBlock as held in memory, HCInfoBlockParse() fills it */
 typedef struct __HCDataInfoBlock {
-    unsigned long long fsSize;    // 8
-    unsigned long long realSize;  // 8
-    unsigned long      blocks;    // 4
+    unsigned long long fsSize;    // Bytes behind the InfoBlock
+    unsigned long long realSize;
+    unsigned long      blocks;
+    unsigned long      codecs;    // HC_CODEC_MASK() of every codec in use
+    unsigned long long index;     // Central index from the InfoBlock, 0 if none
+    unsigned long long meta;      // Metadata section from the InfoBlock, 0 if none
+    unsigned long long metaLen;
+    unsigned long long tree;      // Digest tree from the InfoBlock, 0 if none
+    unsigned long long treeLen;
+    unsigned char      root[32];  // Of the digest tree
+    unsigned int       flags;     // HC_CELL_* format flags
+    unsigned int       version;   // HC_CELL_VERSION of the writer
+    unsigned int       length;    // Of the InfoBlock in the cell
 } HCDataInfoBlock;
 
-/* Cell Data Storage Unit:
-   +--------------------------------------------+------------+----+------------+----+
+/* Cell Data Storage Unit, version 2. Every integer is little-endian and
+   has the width given below, whatever the host:
+   +-----------+--------------------------------+------------+----+------------+----+
    | InfoBlock |           Body Unit0           |    BU1     |....|   BU(N)    |....|
-   |  20 Bytes |  (14 + BLKLEN + DATLEN) bytes  |     ~      |....|     ~      |....|
+   | 120 Bytes |  (16 + BLKLEN + DATLEN) bytes  |     ~      |....|     ~      |....|
    +-----------+--------------------------------+------------+----+------------+----+
-   (*) 'N' must less than 2 ^ 32 - 1 (4,294,967,295)
+   InfoBlock Structure:
+   +-------+---------+--------+--------+----------+--------+--------+-------+------+---------+-------+----------+------+---------+------+
+   | MAGIC | VERSION | INFLEN | FSSIZE | REALSIZE | BLOCKS | CODECS | INDEX | META | METALEN | FLAGS | RESERVED | TREE | TREELEN | ROOT |
+   +-------+---------+--------+--------+----------+--------+--------+-------+------+---------+-------+----------+------+---------+------+
+   |   4   |    2    |   2    |   8    |    8     |   8    |   8    |   8   |  8   |    8    |   4   |    4     |  8   |    8    |  32  |
+   +-------+---------+--------+--------+----------+--------+--------+-------+------+---------+-------+----------+------+---------+------+
+   INFLEN is at least 120 and may grow, readers skip what they do not know.
    Body Unit Structure:
-   +---------+------+------+----+------+--------+----+------+--------+----+---------+
-   |BID_BEGIN|BLKLEN|DATLEN|BID0|B0_LEN|PROPDATA|BID1|B1_LEN|PROPDATA|....|CELL_DATA|
-   |---------+------+------+----+------+--------+----+------+--------+----+---------+
-   |    2    |   4  |   8  |  2 |   4  | B0_LEN |  2 |  4   | B1_LEN |....|  DATLEN | 
-   +---------+------+------+----+------+--------+----+------+--------+----+---------+
-    BLKLEN equals to   =   |<------------------BLKLEN-------------------->|         */
-
-const short BID_PROP_BEGIN            =   0x1DF0
-const short BID_PROP_TYPE             =   0x1D0A
-const short BID_PROP_SIZE_INCELL      =   0x1D1C
-const short BID_PROP_SIZE_ORIGINAL    =   0x1D1D
-const short BID_PROP_PATHNAME         =   0x1D2A
-const short BID_PROP_LINKNAME         =   0x1D2B
-const short BID_PROP_MODE             =   0x1D30
-const short BID_PROP_UID              =   0x1D41
-const short BID_PROP_GID              =   0x1D52
-const short BID_PROP_DEV1             =   0x1D6A
-const short BID_PROP_DEV2             =   0x1D6B
-//const short BID_PROP_DATA_NULL        =   0x30FF
+   +---------+----------+------+------+----+------+--------+----+------+--------+----+---------+
+   |BID_BEGIN| RESERVED |BLKLEN|DATLEN|BID0|B0_LEN|PROPDATA|BID1|B1_LEN|PROPDATA|....|CELL_DATA|
+   |---------+----------+------+------+----+------+--------+----+------+--------+----+---------+
+   |    2    |    2     |   4  |   8  |  2 |   4  | B0_LEN |  2 |  4   | B1_LEN |....|  DATLEN |
+   +---------+----------+------+------+----+------+--------+----+------+--------+----+---------+
+    BLKLEN equals to              =   |<------------------BLKLEN-------------------->|
+   Scalar properties are 2, 4 or 8 bytes wide, see the serializer table.
+   Pathnames and link names are obfuscated by HCNameEncode() unless FLAGS
+   has HC_CELL_PLAIN_NAMES.
+   Regular file CELL_DATA is a sequence of frames, each one holds up to
+   BID_PROP_FRAME_SIZE bytes of the file compressed on its own. The compressed
+   length of every frame is listed in BID_PROP_FRAME_TABLE (4 bytes each).
+   A regular file whose payload equals the one of an earlier block has DATLEN 0
+   and a BID_PROP_DATA_REF, the offset of that payload from the InfoBlock.
+   A sparse file lists its holes in BID_PROP_HOLE_MAP as (offset, length)
+   pairs of 8 bytes each. A frame that lies in a hole as a whole is not stored
+   and has length 0 in the frame table.
+   In a cell with HC_CELL_CHECKSUMS in FLAGS a regular file lists the CRC-32
+   of each frame as stored in BID_PROP_FRAME_SUMS (4 bytes each), and every
+   body unit ends its property list with BID_PROP_BLOCK_SUM, the CRC-32 of
+   the unit from BID_BEGIN up to the value of that property.                 */
+
+#define HC_FRAME_SIZE (1024 * 1024)
+
+#define HC_CELL_MAGIC       0x4C454348 /* "HCEL" */
+#define HC_CELL_VERSION     2
+#define HC_INFO_BLOCK_LEN   120
+
+/* InfoBlock FLAGS */
+#define HC_CELL_PLAIN_NAMES 0x1    /* Names are stored as they are */
+#define HC_CELL_CHECKSUMS   0x2    /* Every block carries CRC-32 sums */
+
+/* Property IDs, kept as enumerators so they can label switch cases and
+   initialise the serializer tables */
+enum {
+    BID_PROP_BEGIN            =   0x1DF0,
+    BID_PROP_TYPE             =   0x1D0A,
+    BID_PROP_SIZE_INCELL      =   0x1D1C,
+    BID_PROP_SIZE_ORIGINAL    =   0x1D1D,
+    BID_PROP_PATHNAME         =   0x1D2A,
+    BID_PROP_LINKNAME         =   0x1D2B,
+    BID_PROP_MODE             =   0x1D30,
+    BID_PROP_UID              =   0x1D41,
+    BID_PROP_GID              =   0x1D52,
+    BID_PROP_DEV1             =   0x1D6A,
+    BID_PROP_DEV2             =   0x1D6B,
+    BID_PROP_FRAME_SIZE       =   0x1D7A,
+    BID_PROP_FRAME_TABLE      =   0x1D7B,
+    BID_PROP_CODEC            =   0x1D7C,
+    BID_PROP_DATA_REF         =   0x1D7D,
+    BID_PROP_HOLE_MAP         =   0x1D7E,
+    BID_PROP_FRAME_SUMS       =   0x1D7F,
+    BID_PROP_BLOCK_SUM        =   0x1D80
+    //BID_PROP_DATA_NULL        =   0x30FF
+};
 
 /* Block types */
-//enum { BLK_REG, BLK_HARDLINK, BLK_SYMLINK, BLK_CHARDEV, BLK_BLOCKDEV, BLK_DIR, BLK_FIFO };
-const short BLK_REG                   =   0x200B
-const short BLK_HARDLINK              =   0x200C
-const short BLK_SYMLINK               =   0x200D
-const short BLK_CHARDEV               =   0x200E
-const short BLK_BLOCKDEV              =   0x201A
-const short BLK_DIR                   =   0x201F
-const short BLK_FIFO                  =   0x202C
+enum {
+    BLK_REG                   =   0x200B,
+    BLK_HARDLINK              =   0x200C,
+    BLK_SYMLINK               =   0x200D,
+    BLK_CHARDEV               =   0x200E,
+    BLK_BLOCKDEV              =   0x201A,
+    BLK_DIR                   =   0x201F,
+    BLK_FIFO                  =   0x202C
+};
+
+/* Central Index, optional, follows the last body unit:
+   +-------+---------+-------+--------+--------+----+------------+
+   | MAGIC | ENTSIZE | COUNT | ENTRY0 | ENTRY1 |....| ENTRY(N-1) |
+   +-------+---------+-------+--------+--------+----+------------+
+   |   4   |    4    |   8   | ENTSIZE| ENTSIZE|....|  ENTSIZE   |
+   +-------+---------+-------+--------+--------+----+------------+
+   One entry per body unit, sorted by path hash then offset, so a pathname is
+   found with a binary search and a single read of its body unit. Version 2
+   entries are little-endian and laid out as HCIndexEntry on an LP64 host.   */
+#define HC_INDEX_MAGIC 0x58494348 /* "HCIX" */
+
+/* Metadata section, optional, follows the central index. Every body unit
+   has one row, rows are sorted by pathname and stored column by column:
+   +-------+---------+-------+---------+--------+--------+--------+-------+-------+-------+-------+
+   | MAGIC | RESERVED| COUNT | NAMELEN | OFFSET |  SIZE  |  MODE  |  UID  |  GID  | TYPE  | NAMES |
+   +-------+---------+-------+---------+--------+--------+--------+-------+-------+-------+-------+
+   |   4   |    4    |   8   |    8    |  8 * N |  8 * N |  4 * N | 4 * N | 4 * N | 2 * N |NAMELEN|
+   +-------+---------+-------+---------+--------+--------+--------+-------+-------+-------+-------+
+   OFFSET is BID_BEGIN from the InfoBlock, SIZE the original size. NAMES is
+   front-coded: per row the bytes it shares with the name of the row before
+   and the length of the rest, both as LEB128, then the rest as stored by
+   HCNameEncode() like in the property lists. Listing a cell is one read of
+   METALEN bytes.                                                            */
+#define HC_META_MAGIC 0x444D4348 /* "HCMD" */
+
+/* Digest tree, optional, follows the metadata section. A Merkle tree of
+   SHA-256 digests over the content of every regular file, hard links aside,
+   with one row per file in cell order:
+   +-------+----------+-------+--------+--------+--------+---------+---------+
+   | MAGIC | RESERVED | COUNT | LEAVES | OFFSET | FIRST  |  NODE   |  LEAF   |
+   +-------+----------+-------+--------+--------+--------+---------+---------+
+   |   4   |    4     |   8   |   8    |  8 * N |  8 * N | 32 * N  | 32 * L  |
+   +-------+----------+-------+--------+--------+--------+---------+---------+
+   LEAF is SHA-256(0x00 | frame) for every frame of a file as extracted,
+   holes included, FIRST the leaf of the first frame of each row. NODE is
+   SHA-256(0x02 | R | SIZE | pathname) where R is the root over the leaves
+   of the file, 32 zero bytes without any, SIZE the original size in 8 bytes
+   and the pathname is not encoded. An inner node is SHA-256(0x01 | L | R),
+   a tree of n > 1 hashes splits at the largest power of two below n and
+   ROOT of the InfoBlock is the root over every NODE. A file, or any frame of
+   it, is checked against ROOT with its own leaves and the nodes only.       */
+#define HC_TREE_MAGIC 0x544D4348 /* "HCMT" */
+
+/* Digest tree as loaded or built, column i of every array is row i */
+typedef struct _HCTree {
+    unsigned long       count;
+    unsigned long       leaves;
+    unsigned long long *offset;     // BID_BEGIN, from the InfoBlock, ascending
+    unsigned long long *first;      // count + 1 entries, the last one is leaves
+    unsigned char      *node;       // 32 bytes per row
+    unsigned char      *leaf;       // 32 bytes per frame
+    unsigned long       capacity;   // Of the rows, writer only
+    unsigned long       leafCapacity;
+} HCTree;
+
+/* Metadata section as loaded, column i of every array is row i */
+typedef struct _HCMeta {
+    unsigned long       count;
+    char               *names;      // Every pathname, NUL terminated
+    unsigned long      *nameOffset; // Of the pathname of each row in names
+    unsigned long long *offset;     // BID_BEGIN, from the InfoBlock
+    unsigned long long *fSize;      // Original
+    unsigned int       *fMode;
+    unsigned int       *fUID;
+    unsigned int       *fGID;
+    short              *fType;
+} HCMeta;
+
+typedef struct _HCIndexEntry {
+    unsigned long long  pathHash;   // HCPathHash() of the pathname
+    unsigned long long  offset;     // BID_BEGIN, from the InfoBlock
+    unsigned long long  fSize1;     // In Cell
+    unsigned long long  fSize2;     // Original
+    unsigned int        blockLen;   // BLKLEN, the header is read in one go
+    short               fType;
+    short               reserved;
+} HCIndexEntry;
+
+/* BID_BEGIN + RESERVED + BLKLEN + DATLEN */
+#define HC_BLOCK_HEADER_LEN 16
 
 /* Block Property Structure */
 typedef struct _HCBlockProperty {
@@ -87,6 +223,16 @@ typedef struct _HCBlockProperty {
     gid_t               fGID;
     unsigned int        dev1;   // Maj
     unsigned int        dev2;   // Min
+    unsigned int        frameSize;  // Uncompressed bytes per frame
+    unsigned int        frames;
+    unsigned int       *frameTable; // Compressed length of each frame
+    short               codec;      // HC_CODEC_*, frames as long as their
+                                    // output are stored as is
+    unsigned long long  dataRef;    // Shared payload, 0 if the block has its own
+    unsigned int        holes;
+    unsigned long long *holeTable;  // Offset and length of each hole, sorted
+    unsigned int       *frameSums;  // CRC-32 of each stored frame
+    unsigned int        blockSum;   // As stored, HCBlockParse() checks it
 } HCBlockProperty;
 
 /* Reader thread callback status code */
@@ -95,8 +241,33 @@ enum { CB_OK = 0, CB_FINISH, CB_FORCE_QUITED };
 /* Progress Callback */
 //typedef void (*HCReaderThreadCallback) (int, const char *, unsigned long, unsigned long);
 
+/* Importer handle, one per cell being built */
+typedef struct _HCCellWriter HCCellWriter;
+
 /* Function Export */
+extern HCCellWriter *HCCellWriterOpen(int cellfd, unsigned long offset, int workers);
+extern int  HCCellWriterSetCodec(HCCellWriter *w, int codec, int level);
+extern int  HCCellWriterSetDedup(HCCellWriter *w, int enable);
+extern int  HCCellWriterSetIndex(HCCellWriter *w, int enable);
+extern int  HCCellWriterSetMetadata(HCCellWriter *w, int enable);
+extern int  HCCellWriterSetObfuscation(HCCellWriter *w, int enable);
+extern int  HCCellWriterSetChecksums(HCCellWriter *w, int enable);
+extern int  HCCellWriterSetDigests(HCCellWriter *w, int enable);
+extern int  HCCellWriterAddPath(HCCellWriter *w, const char *path);
+extern int  HCCellWriterFinish(HCCellWriter **pw, unsigned long long *outFsSize,
+    unsigned long long *outRealSize, unsigned long *outBlocks);
+extern void HCCellWriterDestroy(HCCellWriter **pw);
+/* One path, one cell: open, add and finish in a single call */
 extern int HCImportPathToCell(int cellfd, const char *path, unsigned long offset, 
     unsigned long long *outFsSize, unsigned long long *outRealSize, unsigned long *outBlocks);
+/* Same as above, compresses with 'workers' threads while keeping the walk order */
+extern int HCImportPathToCellEx(int cellfd, const char *path, unsigned long offset, int workers,
+    unsigned long long *outFsSize, unsigned long long *outRealSize, unsigned long *outBlocks);
+/* Recreates the cell at 'offset' under 'prefix', one reader feeding a writer per core */
+extern int HCExportPathFromCell(int cellfd, const char *prefix, unsigned long offset);
+/* Same as above with 'workers' writers, 0 for one per core, which hold at most
+   'budget' bytes of payload between them, 0 for the default of 64 MiB */
+extern int HCExportPathFromCellEx(int cellfd, const char *prefix, unsigned long offset, int workers,
+    unsigned long long budget);
 
 #endif /* _HEXCELL_DATA_H_ */
\ No newline at end of file
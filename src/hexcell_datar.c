@@ -29,477 +29,1454 @@
  *
  */
 
+/* fallocate() */
+#if defined(LINUX) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <zlib.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/mman.h>
-#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 
 #include <hexcell_utils.h>
 #include <hexcell_message.h>
 #include <hexcell_data.h>
-#include <hexcell_progress.h>
-
-/* Type Definitions */
-typedef struct _HCQueue {
-    int size;
-    int writep;
-    int readp;
-    pthread_mutex_t mutex;
-    pthread_cond_t  full;
-    pthread_cond_t  empty;
-    void **data;
-} HCQueue;
-
-typedef struct _HCReaderThreadParam {
-    unsigned long totalBlocks;
+#include <hexcell_block.h>
+#include <hexcell_codec.h>
+#include <hexcell_ring.h>
+#include <hexcell_uring.h>
+
+/* Blocks in flight per writer thread */
+#define HC_EXPORT_RING_FACTOR   4
+/* Blocks a writer takes from the ring at once */
+#define HC_EXPORT_BATCH         8
+/* Frames per run at least when a file is split across writers */
+#define HC_EXPORT_SPLIT_FRAMES  8
+/* How far ahead of the reader a mapped cell is paged in */
+#define HC_EXPORT_WINDOW        (16 * 1024 * 1024)
+/* Payload bytes handed to the writers and not written yet, unless the
+   caller of HCExportPathFromCellEx() says otherwise */
+#define HC_EXPORT_BUDGET        (64 * 1024 * 1024)
+/* Bytes an unmapped cell is read in, headers of small files come many a read */
+#define HC_EXPORT_READ          (64 * 1024)
+
+/* An entry held back for the last phase */
+typedef struct _HCExportDeferred {
+    short fType;
+    mode_t fMode;
+    char *pathName;                // As stored, "." for the root
+    char *linkName;                // As stored, links only
+} HCExportDeferred;
+
+/* An open directory of the tree being extracted. The reader holds the ones
+   it is in, each entry handed out holds the one it goes in */
+typedef struct _HCExportDir {
+    int fd;
+    atomic_int refs;
+    size_t pathLen;
+    char path[1024];               // As stored, "" for the root
+} HCExportDir;
+
+/* Shared by the reader and the writers of one export */
+typedef struct _HCExportContext {
     int fd;
-    HCQueue *queue;
-} HCReaderThreadParam;
+    unsigned long offset;      // Of the InfoBlock, shared payloads are relative to it
+    unsigned int infoLen;      // The first block follows the InfoBlock
+    unsigned int flags;        // InfoBlock FLAGS
+    unsigned long totalBlocks;
+    int workers;
+    const char *prefix;
+    HCRing *ring;
+    /* The whole cell mapped read-only, NULL if it is read as a stream */
+    unsigned char *map;
+    size_t mapLen;
+    const unsigned char *cell;     // InfoBlock inside the mapping
+    unsigned long long cellLen;    // InfoBlock and fsSize, mapped or not
+    /* Directories from the root down to the last one made, reader only */
+    HCExportDir **dirStack;
+    int depth;
+    int stackCapacity;
+    /* Links and directory modes, left for after the writers */
+    HCExportDeferred *deferred;
+    unsigned long deferredCount;
+    unsigned long deferredCapacity;
+    /* Cancellation token: once set the reader stops before the next block and
+       writers before the next frame, what is queued is only released */
+    atomic_int aborted;
+    atomic_int writerStatus;   // First error of any writer
+    int readerStatus;          // Negative for I/O, positive for a directory
+    /* The reader waits while the payloads out with the writers add up to
+       more than the budget, the ring alone only counts blocks */
+    pthread_mutex_t budgetMutex;
+    pthread_cond_t budgetCond;
+    unsigned long long budget;
+    unsigned long long inFlight;
+    /* Blocks and runs in the ring or being written, plus one while the
+       reader runs. The ring is closed when it drops to 0, so writers stay
+       around for the runs of a file split at the very end */
+    atomic_ulong outstanding;
+} HCExportContext;
 
-typedef struct _HCWriterThreadParam {
-    pthread_t ofReader;
-    HCQueue * frmReader;
-    HCReaderThreadCallback callback;
-} HCWriterThreadParam;
+/* A regular file whose frames are written by several writers */
+typedef struct _HCExportFile {
+    HCExportContext *ctx;
+    unsigned long long charge;     // Taken over from the block
+    HCExportDir *dir;
+    const char *baseName;          // In property->pathName
+    HCBlockProperty *property;
+    const unsigned char *data;
+    unsigned long long dataOffset;
+    unsigned long long *frameOffsets;  // frames + 1, into the payload
+    int fd;
+    atomic_int pending;            // Runs not finished yet
+    atomic_int failed;
+} HCExportFile;
 
+/* One block on its way from the reader to a writer, or a run of frames
+   [firstFrame, lastFrame) of a split file */
 typedef struct _HCWriterQueueDataParam {
-    int status;
     HCBlockProperty *property;
     void *data;
+    int mapped;                    // data points into the cell mapping
+    unsigned long long dataOffset; // Payload from the InfoBlock if data is NULL
+    HCExportDir *dir;              // Where the entry goes
+    const char *baseName;          // In property->pathName
+    HCExportFile *file;
+    unsigned int firstFrame;
+    unsigned int lastFrame;
+    HCExportContext *ctx;
+    unsigned long long charge;     // Against the budget, given back on release
 } HCWriterQueueDataParam;
 
-static char    *__HCDecodeString(char *pStr);
-static HCQueue *__HCQueueInitialise(int size);
-static void     __HCQueueDestroy(HCQueue **queue);
-static void     __HCWriterQueueDataParamDestroy(HCWriterQueueDataParam **param);
+#ifdef HAVE_IO_URING
+/* Operations in the chain of a file written through io_uring */
+#define HC_URING_OPS 4
+
+/* A small file whose chain is in flight */
+typedef struct _HCExportPending {
+    HCWriterQueueDataParam *entry;
+    unsigned char *buffer;         // Inflated contents, reused
+    unsigned long bufferSize;
+    const unsigned char *source;   // What gets written
+    unsigned long length;
+    unsigned int ops;
+    int failed;
+} HCExportPending;
+#endif
 
-/* Internal Reader Thread Kill Signal */
-static int __InternalReaderKillRequestCounter = 0;
+/* Buffers owned by one writer thread, reused from file to file */
+typedef struct _HCExportWorker {
+    HCCodecContext *codec;
+    unsigned char *in;             // One compressed frame, unmapped cells only
+    unsigned long inSize;
+    unsigned char *out;            // One decompressed frame
+    unsigned long outSize;
+#ifdef HAVE_IO_URING
+    HCUring *uring;                // NULL without kernel support
+    HCExportPending pending[HC_EXPORT_BATCH];
+    unsigned int pendingCount;
+#endif
+} HCExportWorker;
+
+/* What the reader of an unmapped cell has read and not parsed yet */
+typedef struct _HCExportWindow {
+    unsigned char *data;
+    unsigned long size;
+    unsigned long long start;      // From the InfoBlock
+    unsigned long len;
+} HCExportWindow;
+
+static void    *__HCReaderThreadImpl(void *param);
+static void    *__HCWriterThreadImpl(void *param);
+static int      __HCNextBlockMapped(HCExportContext *ctx, unsigned long long *cursor,
+    HCWriterQueueDataParam *aWriterParam);
+static int      __HCNextBlockStream(HCExportContext *ctx, unsigned long long *cursor,
+    HCExportWindow *win, HCWriterQueueDataParam *aWriterParam);
+#if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
+static void     __HCExportMap(HCExportContext *ctx, const HCDataInfoBlock *info);
+static void     __HCExportAdvise(HCExportContext *ctx, unsigned long long from, unsigned long long len);
+static void     __HCExportRelease(const void *data, unsigned long long from, unsigned long long to);
+#endif
+static void     __HCExportCancel(HCExportContext *ctx);
+static void     __HCExportDone(HCExportContext *ctx, unsigned long count);
+static int      __HCExportCharge(HCExportContext *ctx, unsigned long long charge);
+static void     __HCExportCredit(HCExportContext *ctx, unsigned long long charge);
+static void     __HCWriterFailed(HCExportContext *ctx, int res);
+static int      __HCWriteEntry(HCExportContext *ctx, HCWriterQueueDataParam *aWriterParam,
+    HCExportWorker *worker);
+static int      __HCFetchFrame(HCExportContext *ctx, HCExportWorker *worker,
+    const HCBlockProperty *curProp, unsigned int frame, const unsigned char *data,
+    unsigned long long dataOffset, unsigned long long inOffset, const unsigned char **outFrame);
+#ifdef HAVE_IO_URING
+static int      __HCUringQueue(HCExportContext *ctx, HCWriterQueueDataParam *aWriterParam,
+    HCExportWorker *worker);
+static int      __HCUringFlush(HCExportContext *ctx, HCExportWorker *worker);
+#endif
+static int      __HCWriteFrames(HCExportContext *ctx, HCExportWorker *worker, int fd,
+    const char *pathName, const HCBlockProperty *curProp, const unsigned char *data,
+    unsigned long long dataOffset, unsigned int first, unsigned int last, unsigned long long inOffset);
+static int      __HCWriteExtents(int fd, const unsigned char *buffer, unsigned long length,
+    unsigned long long offset, const HCBlockProperty *curProp);
+static int      __HCExportAllocate(int fd, const HCBlockProperty *curProp);
+static int      __HCSplitFile(HCExportContext *ctx, HCWriterQueueDataParam *aWriterParam,
+    HCExportWorker *worker, int fd);
+static int      __HCWriteRange(HCExportContext *ctx, HCWriterQueueDataParam *aWriterParam,
+    HCExportWorker *worker);
+static void     __HCExportFileRelease(HCExportFile *file, int failed);
+static HCExportDir *__HCExportOpenDir(int atfd, const char *name, const char *path);
+static void     __HCExportDirRelease(HCExportDir **dir);
+static HCExportDir *__HCExportParent(HCExportContext *ctx, const char *pathName,
+    const char **baseName, int *outDepth);
+static int      __HCExportMakeDir(HCExportContext *ctx, const HCBlockProperty *property);
+static int      __HCExportDefer(HCExportContext *ctx, const HCBlockProperty *property);
+static int      __HCExportFinish(HCExportContext *ctx);
+static void     __HCWriterQueueDataParamDestroy(HCWriterQueueDataParam **param);
 
 int HCExportPathFromCell(int cellfd, const char *prefix, unsigned long offset)
+{
+    return HCExportPathFromCellEx(cellfd, prefix, offset, 0, 0);
+}
+
+int HCExportPathFromCellEx(int cellfd, const char *prefix, unsigned long offset, int workers,
+    unsigned long long budget)
 {
 #if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
-    int cores = (int)sysconf(_SC_NPROCESSORS_CONF);
-    pthread_t tids[cores + 1];
+    int cores = workers > 0 ? workers : (int)sysconf(_SC_NPROCESSORS_CONF);
 #else
-    int cores = -1;
+    int cores = workers > 0 ? workers : -1;
 #endif
-    HCQueue *aWriterQueue = NULL;
-    HCReaderThreadParam *ReaderParam = NULL;
-    HCWriterThreadParam *WriterParam = NULL;
-    HCDataInfoBlock *InfoBlock = NULL;
+    HCExportContext *ctx = NULL;
+    HCWriterQueueDataParam *aWriterParam = NULL;
+    HCDataInfoBlock InfoBlock;
+    pthread_t reader, writers[cores > 0 ? cores : 1];
+    int i, started = 0, readerStarted = 0, res = 0;
 
     HCAssert(cellfd > -1, return -1); // Bad file descriptor
-    if(offset > 0)
-        lseek(cellfd, offset, SEEK_SET);
     pushdeb("Current available CPU cores: %d %s\n", cores, cores == -1 ? "[Platform Not Supported]" : "");
     if(cores <= 0) {
         pushdeb("in %s: Invalid CPU configuration, exit now\n", __func__);
         return -2; /* ERR_SYSTEM */
     }
+    if(!prefix) prefix = ".";
 
-    if(!(ReaderParam = calloc(1, sizeof(HCReaderThreadParam)))) {
-        pushdeb("in %s: failed to allocate memory for thread parameters\n", __func__);
-        return -3 /* ERR_MEM */
+    /* Read InfoBlock and setting up parameters */
+    if((res = HCInfoBlockRead(cellfd, offset, &InfoBlock))) {
+        pushdeb("in %s: failed to read infoblock, %s\n", __func__,
+            res == -5 ? "written by a newer version" : res == -4 ? "not a cell" : "I/O error");
+        return -4; /* ERR_IO */
     }
-    if(!(WriterParam = calloc(1, sizeof(HCWriterThreadParam)))) {
-        pushdeb("in %s: failed to allocate memory for thread parameters\n", __func__);
-        return -3 /* ERR_MEM */
+    for(i = 0; i < HC_CODEC_MAX; i++)
+        if((InfoBlock.codecs & HC_CODEC_MASK(i)) && !HCCodecSupported(i)) {
+            pushdeb("in %s: cell uses codec %d which is not built in\n", __func__, i);
+            return -5; /* ERR_CODEC */
+        }
+    pushdeb("Totally %lu blocks in the cell, Install size: %llu\n", InfoBlock.blocks, InfoBlock.realSize);
+    if(mkpath(prefix, 0755)) {
+        pushdeb("in %s: failed to create \'%s\'\n", __func__, prefix);
+        return -6; /* ERR_CREAT */
     }
-    if(!(aWriterQueue = __HCQueueInitialise(cores * 2))) {
+
+    if(!(ctx = calloc(1, sizeof(HCExportContext))) ||
+        !(ctx->ring = HCRingNew(cores * HC_EXPORT_RING_FACTOR))) {
         pushdeb("in %s: failed to allocate memory for internal queue\n", __func__);
-        return -3;
+        if(ctx) free(ctx);
+        return -3; /* ERR_MEM */
     }
+    ctx->fd = cellfd;
+    ctx->offset = offset;
+    ctx->infoLen = InfoBlock.length;
+    ctx->flags = InfoBlock.flags;
+    ctx->cellLen = InfoBlock.length + InfoBlock.fsSize;
+    ctx->totalBlocks = InfoBlock.blocks;
+    ctx->workers = cores;
+    ctx->prefix = prefix;
+    ctx->budget = budget ? budget : HC_EXPORT_BUDGET;
+    /* Everything is created relative to the directory it goes in */
+    if(!(ctx->dirStack = calloc(16, sizeof(HCExportDir *))) ||
+        !(ctx->dirStack[0] = __HCExportOpenDir(AT_FDCWD, prefix, ""))) {
+        pushdeb("in %s: failed to open '%s'\n", __func__, prefix);
+        if(ctx->dirStack) free(ctx->dirStack);
+        HCRingDestroy(&ctx->ring);
+        free(ctx);
+        return -6; /* ERR_CREAT */
+    }
+    ctx->depth = 1;
+    ctx->stackCapacity = 16;
+    atomic_init(&ctx->aborted, 0);
+    atomic_init(&ctx->writerStatus, 0);
+    atomic_init(&ctx->outstanding, 1);
+    pthread_mutex_init(&ctx->budgetMutex, NULL);
+    pthread_cond_init(&ctx->budgetCond, NULL);
+#if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
+    /* Payloads then go from the page cache straight into the decompressors */
+    __HCExportMap(ctx, &InfoBlock);
+#endif
 
-    /* Read InfoBlock and setting up parameters */
-    InfoBlock = malloc(sizeof(HCDataInfoBlock));
-    if(HCReadFileX(cellfd, InfoBlock, sizeof(HCDataInfoBlock))) {
-        pushdeb("in %s: failed to read infoblock, I/O error\n", __func__);
-        free(ReaderParam); free(WriterParam);
-        return -4; /* ERR_IO */
+    /* One reader streams blocks into the ring, every core writes them out */
+    if(pthread_create(&reader, NULL, __HCReaderThreadImpl, ctx)) {
+        pushdeb("in %s: failed to start reader thread\n", __func__);
+        res = -2;
+        goto __HCEPFC_CLEANUP;
+    }
+    readerStarted = 1;
+    for(started = 0; started < cores; started++)
+        if(pthread_create(&writers[started], NULL, __HCWriterThreadImpl, ctx)) {
+            pushdeb("in %s: failed to start writer thread\n", __func__);
+            __HCExportCancel(ctx);
+            res = -2;
+            break;
+        }
+
+__HCEPFC_CLEANUP:
+    if(readerStarted) pthread_join(reader, NULL);
+    for(i = 0; i < started; i++)
+        pthread_join(writers[i], NULL);
+    /* Blocks left behind by an abort */
+    while(HCRingTryPop(ctx->ring, (void **)&aWriterParam, 1))
+        __HCWriterQueueDataParamDestroy(&aWriterParam);
+    if(!res && ctx->readerStatus) res = ctx->readerStatus > 0 ? -6 : -4; /* ERR_CREAT, ERR_IO */
+    if(!res && atomic_load(&ctx->writerStatus)) res = -6; /* ERR_CREAT */
+    /* Every file is in place, the links to them can go in */
+    if(!res && __HCExportFinish(ctx)) res = -6; /* ERR_CREAT */
+    for(i = 0; i < (int)ctx->deferredCount; i++) {
+        free(ctx->deferred[i].pathName);
+        if(ctx->deferred[i].linkName) free(ctx->deferred[i].linkName);
     }
-    ReaderParam->totalBlocks = InfoBlock->blocks;
-    pushdeb("Totally %lu blocks in the cell, Install size: %llu\n", InfoBlock->blocks, InfoBlock->realSize);
-    ReaderParam->fd = cellfd;
-    ReaderParam->queue = aWriterQueue;
+    if(ctx->deferred) free(ctx->deferred);
+    for(i = 0; i < ctx->depth; i++)
+        __HCExportDirRelease(&ctx->dirStack[i]);
+    free(ctx->dirStack);
+    HCRingDestroy(&ctx->ring);
+    pthread_mutex_destroy(&ctx->budgetMutex);
+    pthread_cond_destroy(&ctx->budgetCond);
+#if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
+    if(ctx->map) munmap(ctx->map, ctx->mapLen);
+#endif
+    free(ctx);
 
+    return res;
 }
 
-#define __HCReaderExitActions(full, mutex, ep) do { pthread_cond_broadcast(full); \
-    pthread_mutex_unlock(mutex); goto ep; } while(0)
-static void __HCReaderThreadImpl(void *param)
+static void *__HCReaderThreadImpl(void *param)
 {
-    int i = 0, fd = (HCReaderThreadParam *)param->fd;
-    HCQueue *toWriter = (HCReaderThreadParam *)param->queue;
+    HCExportContext *ctx = (HCExportContext *)param;
     HCWriterQueueDataParam *aWriterParam = NULL;
-    //HCReaderThreadCallback callback = (HCReaderThreadParam *)param->callback;
-    short bid = 0x0000;
-    unsigned long restBlocks = (HCReaderThreadParam *)param->totalBlocks;
-    unsigned long totalBlocks = restBlocks;
-    unsigned long _BlockLen = 0L, _BlockByteRead = 0L;
+    HCExportWindow win;
+    unsigned long i;
+    unsigned long long cursor = ctx->infoLen;
+    int res = 0;
+#if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
+    unsigned long long adviseMark = 0LL;
+    unsigned long long window = ctx->budget < HC_EXPORT_WINDOW ? ctx->budget : HC_EXPORT_WINDOW;
+#endif
+
+    memset(&win, 0, sizeof(HCExportWindow));
+    for(i = 0; i < ctx->totalBlocks && !atomic_load(&ctx->aborted); i++) {
+        HCCalloc(aWriterParam, 1, sizeof(HCWriterQueueDataParam), res = -3; break);
+        aWriterParam->ctx = ctx;
+        HCCalloc(aWriterParam->property, 1, sizeof(HCBlockProperty), res = -3; break);
+
+        if(ctx->cell) {
+#if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
+            /* Keep the kernel reading ahead of the writers */
+            if(cursor >= adviseMark) {
+                __HCExportAdvise(ctx, cursor, window);
+                adviseMark = cursor + window / 2;
+            }
+#endif
+            res = __HCNextBlockMapped(ctx, &cursor, aWriterParam);
+        } else
+            res = __HCNextBlockStream(ctx, &cursor, &win, aWriterParam);
+        if(res) break;
+
+        /* Directories are made here, before anything that goes in them is
+           handed out. Links wait until every file they may point to exists */
+        if(aWriterParam->property->fType == BLK_DIR) {
+            res = __HCExportMakeDir(ctx, aWriterParam->property);
+            __HCWriterQueueDataParamDestroy(&aWriterParam);
+            if(res) break;
+            continue;
+        }
+        if(aWriterParam->property->fType == BLK_HARDLINK || aWriterParam->property->fType == BLK_SYMLINK) {
+            res = __HCExportDefer(ctx, aWriterParam->property);
+            __HCWriterQueueDataParamDestroy(&aWriterParam);
+            if(res) break;
+            continue;
+        }
+
+        if(!(aWriterParam->dir = __HCExportParent(ctx, (char *)aWriterParam->property->pathName,
+            &aWriterParam->baseName, NULL))) {
+            res = 8; /* ERR_CREAT_DIR */
+            break;
+        }
+
+        /* A file bigger than the whole budget goes out alone, its frames are
+           streamed one at a time anyway */
+        aWriterParam->charge = aWriterParam->property->fSize1 < ctx->budget ?
+            aWriterParam->property->fSize1 : ctx->budget;
+        if(__HCExportCharge(ctx, aWriterParam->charge)) {
+            aWriterParam->charge = 0;
+            break;
+        }
+        /* Blocks only when the writers are behind, fails once they gave up */
+        atomic_fetch_add(&ctx->outstanding, 1);
+        if(HCRingPush(ctx->ring, (void **)&aWriterParam, 1) != 1) {
+            __HCExportDone(ctx, 1);
+            break;
+        }
+        aWriterParam = NULL;
+    }
+
+    if(res) {
+        pushdeb("reader: failed at block %lu (%d), exit now\n", i, res);
+        ctx->readerStatus = res;
+        __HCExportCancel(ctx);
+    }
+    __HCWriterQueueDataParamDestroy(&aWriterParam);
+    if(win.data) free(win.data);
+    /* Writers drain what is left and exit once nothing is outstanding */
+    __HCExportDone(ctx, 1);
+    pushdeb("reader thread exited\n");
+
+    pthread_exit(NULL);
+}
+
+/* Takes the next block from the mapping, the payload is left where it is */
+static int __HCNextBlockMapped(HCExportContext *ctx, unsigned long long *cursor,
+    HCWriterQueueDataParam *aWriterParam)
+{
+    HCBlockProperty *property = aWriterParam->property;
+    const unsigned char *p = ctx->cell + *cursor;
+    unsigned long long left = ctx->cellLen - *cursor, _DataLen = 0LL;
+    unsigned long _BlockLen = 0L, headerLen = HC_BLOCK_HEADER_LEN;
+
+    if(left < headerLen ||
+        HCBlockParse(p, headerLen, ctx->flags, property, &_BlockLen, &_DataLen) < 0 ||
+        headerLen + _BlockLen > left ||
+        _DataLen > left - headerLen - _BlockLen ||
+        HCBlockParse(p, headerLen + _BlockLen, ctx->flags, property, NULL, NULL)) {
+        /* Oops ... */
+        pushdeb("reader: bad block at %llu, the block may broken\n", *cursor);
+        return -7;
+    }
+    pushdeb("reader: block@%llu(%lu): datalen = %llu\n", *cursor, _BlockLen, _DataLen);
+
+    p += headerLen + _BlockLen;
+    aWriterParam->mapped = 1;
+    if(_DataLen > 0)
+        aWriterParam->data = (void *)p;
+    else if(property->dataRef && property->fSize1) {
+        /* Same content as an earlier file */
+        if(property->dataRef > ctx->cellLen || property->fSize1 > ctx->cellLen - property->dataRef) {
+            pushdeb("reader: shared payload is outside the cell\n");
+            return -7;
+        }
+        aWriterParam->data = (void *)(ctx->cell + property->dataRef);
+    }
+    *cursor += headerLen + _BlockLen + _DataLen;
+
+    return 0;
+}
+
+/* Makes [at, at + need) of the cell readable in the window, reading ahead
+   so that the blocks behind it come along */
+static int __HCWindowFill(HCExportContext *ctx, HCExportWindow *win, unsigned long long at,
+    unsigned long need)
+{
+    unsigned char *tBuffer = NULL;
+    unsigned long want = need > HC_EXPORT_READ ? need : HC_EXPORT_READ;
+    ssize_t n = 0;
+
+    if(at >= win->start && at + need <= win->start + win->len)
+        return 0;
+    if(at > ctx->cellLen || need > ctx->cellLen - at)
+        return -7;
+    if(want > ctx->cellLen - at)
+        want = ctx->cellLen - at;
+    if(want > win->size) {
+        if(!(tBuffer = realloc(win->data, want)))
+            return -3;
+        win->data = tBuffer;
+        win->size = want;
+    }
+    if((n = pread(ctx->fd, win->data, want, ctx->offset + at)) < (ssize_t)need)
+        return -4;
+    win->start = at;
+    win->len = n;
+
+    return 0;
+}
+
+/* Parses the next block out of the window, the payload is skipped */
+static int __HCNextBlockStream(HCExportContext *ctx, unsigned long long *cursor, HCExportWindow *win,
+    HCWriterQueueDataParam *aWriterParam)
+{
+    HCBlockProperty *property = aWriterParam->property;
+    const unsigned char *p = NULL;
+    unsigned long _BlockLen = 0L, headerLen = HC_BLOCK_HEADER_LEN;
     unsigned long long _DataLen = 0LL;
-    int _PropLen = 0, _RtcCounter = 0;
-
-    while(1) {
-        pthread_mutex_lock(&toWriter->mutex);
-        while(toWriter->readp < toWriter->writep) {
-            if(__InternalReaderKillRequestCounter) {
-                pushdeb("reader: terminal signal received (%d times), exit now\n", __InternalReaderKillRequestCounter);
-                //pthread_mutex_unlock(&toWriter->mutex);
-                goto __ReaderExitPoint;
+    int res = 0;
+
+    /* The header tells how long the property list is */
+    if((res = __HCWindowFill(ctx, win, *cursor, headerLen)))
+        return res;
+    p = win->data + (*cursor - win->start);
+    if(HCBlockParse(p, headerLen, ctx->flags, property, &_BlockLen, &_DataLen) < 0 ||
+        _BlockLen > ctx->cellLen - *cursor - headerLen ||
+        _DataLen > ctx->cellLen - *cursor - headerLen - _BlockLen) {
+        /* Oops ... */
+        pushdeb("reader: bad block at %llu, the block may broken\n", *cursor);
+        return -7;
+    }
+    if((res = __HCWindowFill(ctx, win, *cursor, headerLen + _BlockLen)))
+        return res;
+    p = win->data + (*cursor - win->start);
+    if(HCBlockParse(p, headerLen + _BlockLen, ctx->flags, property, NULL, NULL)) {
+        pushdeb("reader: bad property list, the block may broken\n");
+        return -7;
+    }
+    pushdeb("reader: block(%lu): datalen = %llu\n", _BlockLen, _DataLen);
+
+    /* The writer reads the payload frame by frame when it gets there */
+    *cursor += headerLen + _BlockLen;
+    if(_DataLen > 0) {
+        aWriterParam->dataOffset = *cursor;
+        *cursor += _DataLen;
+    } else if(property->dataRef && property->fSize1)
+        /* Same content as an earlier file */
+        aWriterParam->dataOffset = property->dataRef;
+
+    return 0;
+}
+
+#if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
+/* Asks for [from, from + len) of the cell to be paged in */
+static void __HCExportAdvise(HCExportContext *ctx, unsigned long long from, unsigned long long len)
+{
+    unsigned long long start = (ctx->cell - ctx->map) + from;
+    unsigned long long page = (unsigned long long)sysconf(_SC_PAGESIZE);
+
+    if(start >= ctx->mapLen)
+        return;
+    if(len > ctx->mapLen - start)
+        len = ctx->mapLen - start;
+    /* madvise() wants the start on a page boundary */
+    len += start % page;
+    start -= start % page;
+    madvise(ctx->map + start, len, MADV_WILLNEED);
+}
+
+/* Drops the pages of [from, to) of a mapped payload. The page 'from' starts
+   in was left over by the previous call, pages shared with the block before
+   are left alone */
+static void __HCExportRelease(const void *data, unsigned long long from, unsigned long long to)
+{
+    unsigned long page = (unsigned long)sysconf(_SC_PAGESIZE);
+    unsigned long base = (unsigned long)data;
+    unsigned long start = (base + from) & ~(page - 1);
+    unsigned long end = (base + to) & ~(page - 1);
+
+    if(start < base)
+        start += page;
+    if(end > start)
+        madvise((void *)start, end - start, MADV_DONTNEED);
+}
+#endif
+
+static void *__HCWriterThreadImpl(void *param)
+{
+    HCExportContext *ctx = (HCExportContext *)param;
+    HCWriterQueueDataParam *batch[HC_EXPORT_BATCH];
+    HCExportWorker worker;
+    size_t i, n, back;
+    int res = 0, none = 0;
+
+    memset(&worker, 0, sizeof(HCExportWorker));
+    worker.codec = HCCodecContextNew();
+#ifdef HAVE_IO_URING
+    worker.uring = HCUringNew(HC_EXPORT_BATCH * HC_URING_OPS, HC_EXPORT_BATCH);
+#endif
+    if(!worker.codec) {
+        atomic_compare_exchange_strong(&ctx->writerStatus, &none, -3);
+        __HCExportCancel(ctx);
+        pthread_exit(NULL);
+    }
+
+    while((n = HCRingPop(ctx->ring, (void **)batch, HC_EXPORT_BATCH)) > 0) {
+        for(i = 0; i < n; i++) {
+            /* A run takes a while, whatever was popped along with it goes
+               back to the writers that are idle. It stays outstanding */
+            if(batch[i]->file && i + 1 < n) {
+                back = HCRingTryPush(ctx->ring, (void **)(batch + i + 1), n - i - 1);
+                memmove(batch + i + 1, batch + i + 1 + back, (n - i - 1 - back) * sizeof(*batch));
+                n -= back;
             }
-            pthread_cond_wait(&toWriter->empty, &toWriter->mutex);
+#ifdef HAVE_IO_URING
+            if(worker.uring && !atomic_load(&ctx->aborted) && __HCUringQueue(ctx, batch[i], &worker))
+                continue;
+#endif
+            /* After an abort the rest is only released */
+            if(!atomic_load(&ctx->aborted) && (res = __HCWriteEntry(ctx, batch[i], &worker)))
+                __HCWriterFailed(ctx, res);
+            __HCWriterQueueDataParamDestroy(&batch[i]);
         }
-        /* Fill the queue */
-        for(i = 0; i < toWriter->size, restBlocks > 0; i++, restBlocks--) {
-            /* Reset if it holds old data */
-            if(toWriter->data[i]) 
-                __HCWriterQueueDataParamDestroy((HCWriterQueueDataParam *)toWriter->data[i]);
-            HCCalloc(aWriterParam, 1, sizeof(HCWriterQueueDataParam),
-                __HCReadExitActions(&toWriter->full, &toWriter->mutex, __ReaderExitPoint));
-            HCCalloc(aWriterParam->property, 1, sizeof(HCBlockProperty),
-                __HCReadExitActions(&toWriter->full, &toWriter->mutex, __ReaderExitPoint));
-
-            /* Check about BID_BEGIN */
-            if(HCReadFileX(fd, &bid, sizeof(short))) {
-                __HCWriterQueueDataParamDestroy(&aWriterParam);
-                __HCReaderExitActions(&toWriter->full, &toWriter->mutex, __ReaderExitPoint);
+        /* Entries queued to io_uring are flushed below, before the next pop */
+        __HCExportDone(ctx, n);
+#ifdef HAVE_IO_URING
+        if(worker.pendingCount && (res = __HCUringFlush(ctx, &worker)))
+            __HCWriterFailed(ctx, res);
+#endif
+    }
+
+#ifdef HAVE_IO_URING
+    HCUringDestroy(&worker.uring);
+    for(i = 0; i < HC_EXPORT_BATCH; i++)
+        if(worker.pending[i].buffer) free(worker.pending[i].buffer);
+#endif
+    HCCodecContextDestroy(&worker.codec);
+    if(worker.in) free(worker.in);
+    if(worker.out) free(worker.out);
+    pushdeb("worker@%lu: exited%s\n", pthread_self(), res ? " error" : "");
+    pthread_exit(NULL);
+}
+
+/* 'count' blocks or runs are finished, the last one closes the ring */
+static void __HCExportDone(HCExportContext *ctx, unsigned long count)
+{
+    if(count && atomic_fetch_sub(&ctx->outstanding, count) == count)
+        HCRingClose(ctx->ring);
+}
+
+/* Fires the cancellation token. Closing the ring wakes a reader blocked on
+   a full ring and writers blocked on an empty one, nobody is left waiting */
+static void __HCExportCancel(HCExportContext *ctx)
+{
+    atomic_store(&ctx->aborted, 1);
+    HCRingClose(ctx->ring);
+    pthread_mutex_lock(&ctx->budgetMutex);
+    pthread_cond_broadcast(&ctx->budgetCond);
+    pthread_mutex_unlock(&ctx->budgetMutex);
+}
+
+/* Waits until 'charge' more payload bytes fit in the budget and takes them.
+   Something always fits while nothing is out. Returns non-zero if the
+   export was cancelled meanwhile */
+static int __HCExportCharge(HCExportContext *ctx, unsigned long long charge)
+{
+    int cancelled = 0;
+
+    if(!charge)
+        return 0;
+    pthread_mutex_lock(&ctx->budgetMutex);
+    while(!(cancelled = atomic_load(&ctx->aborted)) && ctx->inFlight &&
+        ctx->inFlight + charge > ctx->budget)
+        pthread_cond_wait(&ctx->budgetCond, &ctx->budgetMutex);
+    if(!cancelled)
+        ctx->inFlight += charge;
+    pthread_mutex_unlock(&ctx->budgetMutex);
+
+    return cancelled;
+}
+
+static void __HCExportCredit(HCExportContext *ctx, unsigned long long charge)
+{
+    if(!charge)
+        return;
+    pthread_mutex_lock(&ctx->budgetMutex);
+    ctx->inFlight -= charge;
+    pthread_cond_signal(&ctx->budgetCond);
+    pthread_mutex_unlock(&ctx->budgetMutex);
+}
+
+/* Stops the export after the first writer error */
+static void __HCWriterFailed(HCExportContext *ctx, int res)
+{
+    int none = 0;
+
+    if(res != 11) /* ERR_CANCELLED, someone else failed first */
+        pushdeb("writer@%lu: critical error occurred, stopping the export...\n", pthread_self());
+    atomic_compare_exchange_strong(&ctx->writerStatus, &none, res);
+    __HCExportCancel(ctx);
+}
+
+/* Creates one entry under the prefix */
+static int __HCWriteEntry(HCExportContext *ctx, HCWriterQueueDataParam *aWriterParam,
+    HCExportWorker *worker)
+{
+    HCBlockProperty *curProp = NULL;
+    const char *curPathName = NULL;
+    int dirfd = -1, _ErrorOccurred = 0, fd = -1;
+
+    /* A run of frames from a file another writer split, it has no property */
+    if(aWriterParam->file)
+        return __HCWriteRange(ctx, aWriterParam, worker);
+
+    curProp = aWriterParam->property;
+    curPathName = (char *)curProp->pathName;
+    dirfd = aWriterParam->dir->fd;
+
+    /* Reserved: call progress callback */
+    // ...
+
+    switch(curProp->fType) {
+        case BLK_REG: {
+            /* Force override */
+            unlinkat(dirfd, aWriterParam->baseName, 0);
+            if((fd = openat(dirfd, aWriterParam->baseName, O_WRONLY | O_CREAT | O_TRUNC, curProp->fMode)) == -1) {
+                pushdeb("writer: failed to create file \'%s\', %s\n", curPathName, strerror(errno));
+                _ErrorOccurred = 1; /* ERR_CREAT */
+                break;
+            }
+            /* Before we formally start, check whether this is just an empty
+               file, if yes close the handle now */
+            if(!curProp->fSize2)
+                goto __WriterBlockSkipProcess_REG;
+
+            /* A file that is one hole has no payload */
+            if(curProp->fSize1 && !aWriterParam->data && !aWriterParam->dataOffset) {
+                pushdeb("writer: \'%s\' has no payload\n", curPathName);
+                _ErrorOccurred = 4; /* ERR_DECOMP_SIZE_MISMATCH */
+                goto __WriterBlockSkipProcess_REG;
             }
-            if(HCSwapBytes(bid) != BID_BEGIN) {
-                /* Oops ... */
-                pushdeb("reader: Unknown BID_BEGIN, the block may broken\n");
-                __HCWriterQueueDataParamDestroy(&aWriterParam);
-                __HCReaderExitActions(&toWriter->full, &toWriter->mutex, __ReaderExitPoint);
+            /* Every frame but the last holds frameSize bytes, which puts each
+               of them at a known place in the file */
+            if(!curProp->frameSize || !curProp->frames || curProp->frames !=
+                (curProp->fSize2 + curProp->frameSize - 1) / curProp->frameSize) {
+                pushdeb("writer: frame table does not match the size of \'%s\'\n", curPathName);
+                _ErrorOccurred = 4; /* ERR_DECOMP_SIZE_MISMATCH */
+                goto __WriterBlockSkipProcess_REG;
             }
 
-            /* BLKLEN & DATLEN */
-            if(HCReadFileX(fd, &_BlockLen, sizeof(unsigned long))) {
-                __HCWriterQueueDataParamDestroy(&aWriterParam);
-                __HCReaderExitActions(&toWriter->full, &toWriter->mutex, __ReaderExitPoint);
+            /* Big files are shared with the other writers */
+            if(ctx->workers > 1 && curProp->frames >= 2 * HC_EXPORT_SPLIT_FRAMES)
+                return __HCSplitFile(ctx, aWriterParam, worker, fd);
+            /* A hole at the end is never written, the size has to be set */
+            if(curProp->holes && __HCExportAllocate(fd, curProp)) {
+                pushdeb("writer: failed to size '%s', %s\n", curPathName, strerror(errno));
+                _ErrorOccurred = 10; /* ERR_IO */
+                goto __WriterBlockSkipProcess_REG;
             }
-            if(HCReadFileX(fd, &_DataLen, sizeof(unsigned long long))) {
-                __HCWriterQueueDataParamDestroy(&aWriterParam);
-                __HCReaderExitActions(&toWriter->full, &toWriter->mutex, __ReaderExitPoint);
+            _ErrorOccurred = __HCWriteFrames(ctx, worker, fd, curPathName, curProp, aWriterParam->data,
+                aWriterParam->dataOffset, 0, curProp->frames, 0);
+
+__WriterBlockSkipProcess_REG:
+            if(fd != -1) close(fd);
+            if(_ErrorOccurred) unlinkat(dirfd, aWriterParam->baseName, 0);
+            break;
+        } /* End of BLK_REG */
+
+        case BLK_BLOCKDEV:
+        case BLK_CHARDEV: {
+            /* Force override */
+            unlinkat(dirfd, aWriterParam->baseName, 0);
+            if(mknodat(dirfd, aWriterParam->baseName,
+                (curProp->fType == BLK_CHARDEV ? S_IFCHR : S_IFBLK) | curProp->fMode,
+                makedev(curProp->dev1, curProp->dev2))) {
+                pushdeb("writer: failed to create device, %s\n", strerror(errno));
+                _ErrorOccurred = 7; /* ERR_CREAT_DEVICE */
             }
-            pushdeb("reader: block@%05d(%lu): datalen = %llu\n", totalBlocks - restBlocks, _BlockLen, _DataLen);
-
-            /* Loop read the whole block property */
-            while(_BlockByteRead < _BlockLen) {
-                if(HCReadFileX(fd, &bid, sizeof(short))) {
-                    __HCWriterQueueDataParamDestroy(&aWriterParam);
-                    __HCReaderExitActions(&toWriter->full, &toWriter->mutex, __ReaderExitPoint);
-                }
-                if(HCReadFileX(fd, &_PropLen, sizeof(int))) {
-                    __HCWriterQueueDataParamDestroy(&aWriterParam);
-                    __HCReaderExitActions(&toWriter->full, &toWriter->mutex, __ReaderExitPoint);
-                }
-
-                switch(HCSwapBytes(bid)) {
-                    case BID_PROP_TYPE:
-                        _RtcCounter += HCReadFileX(fd, aWriterParam->property->fType, _PropLen);
-                        break;
-                    case BID_PROP_SIZE_INCELL:
-                        _RtcCounter += HCReadFileX(fd, aWriterParam->property->fSize1, _PropLen);
-                        break;
-                    case BID_PROP_SIZE_ORIGINAL:
-                        _RtcCounter += HCReadFileX(fd, aWriterParam->property->fSize2, _PropLen);
-                        break;
-                    case BID_PROP_PATHNAME:
-                        _RtcCounter += HCReadFileX(fd, aWriterParam->property->pathName, _PropLen);
-                        break;
-                    case BID_PROP_LINKNAME:
-                        _RtcCounter += HCReadFileX(fd, aWriterParam->property->linkName, _PropLen);
-                        break;
-                    case BID_PROP_MODE:
-                        _RtcCounter += HCReadFileX(fd, aWriterParam->property->fMode, _PropLen);
-                        break;
-                    case BID_PROP_UID:
-                        _RtcCounter += HCReadFileX(fd, aWriterParam->property->fUID, _PropLen);
-                        break;
-                    case BID_PROP_GID:
-                        _RtcCounter += HCReadFileX(fd, aWriterParam->property->fGID, _PropLen);
-                        break;
-                    case BID_PROP_DEV1:
-                        _RtcCounter += HCReadFileX(fd, aWriterParam->property->dev1, _PropLen);
-                        break;
-                    case BID_PROP_DEV2:
-                        _RtcCounter += HCReadFileX(fd, aWriterParam->property->dev2, _PropLen);
-                        break;
-                    default:
-                        pushdeb("reader: unknown BID: 0x%02x\n", HCSwapBytes(bid));
-                        __HCWriterQueueDataParamDestroy(&aWriterParam);
-                        __HCReaderExitActions(&toWriter->full, &toWriter->mutex, __ReaderExitPoint);
-                }
-                if(_RtcCounter) {
-                    __HCWriterQueueDataParamDestroy(&aWriterParam);
-                    __HCReaderExitActions(&toWriter->full, &toWriter->mutex, __ReaderExitPoint);
-                }
-
-                /* Read data to memory stream */
-                if(_DataLen > 0) {
-                    aWriterParam->status = 0;
-                    HCCalloc(aWriterParam->data, 1, _DataLen, 
-                        __HCWriterQueueDataParamDestroy(&aWriterParam);
-                        __HCReaderExitActions(&toWriter->full, &toWriter->mutex, __ReaderExitPoint));
-                    if(HCReadFileX(fd, aWriterParam->data, _DataLen)) {
-                        __HCWriterQueueDataParamDestroy(&aWriterParam);
-                        __HCReaderExitActions(&toWriter->full, &toWriter->mutex, __ReaderExitPoint);
-                    }
-                } else if(!_DataLen && HCSwapBytes(aWriterParam->property->fType) == BLK_REG) {
-                    aWriterParam->status = 1; // an empty file
-                    aWriterParam->data = NULL;
-                }
+            break;
+        } /* End of BLK_BLOCKDEV, BLK_CHARDEV */
+
+        case BLK_FIFO: {
+            /* Force override */
+            unlinkat(dirfd, aWriterParam->baseName, 0);
+            if(mknodat(dirfd, aWriterParam->baseName, S_IFIFO | curProp->fMode, 0)) {
+                pushdeb("writer: failed to create fifo, %s\n", strerror(errno));
+                _ErrorOccurred = 9; /* ERR_CREAT_FIFO */
             }
-            /* Push the writer param to the queue */
-            toWriter->data[i] = (void *)aWriterParam;
-            toWriter->writep = i + 1;
-        }
-        /* reset queue indicator */
-        toWriter->readp = 0;
-        //pthread_cond_broadcast(&queue->full);
-        //pthread_mutex_unlock(&queue->mutex);
+            break;
+        } /* End of BLK_FIFO */
+        default:
+            pusherr("Unknown block type, skipped\n");
     }
 
-__ReaderExitPoint:
-    pushdeb("reader thread exited\n");
-    pthread_cond_broadcast(&toWriter->full);
-    pthread_mutex_unlock(&toWriter->mutex);
+    return _ErrorOccurred;
+}
 
-    pthread_exit(NULL);
+#if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
+/* Maps the cell for the reader, which falls back to read() if this fails */
+static void __HCExportMap(HCExportContext *ctx, const HCDataInfoBlock *info)
+{
+    unsigned long page = (unsigned long)sysconf(_SC_PAGESIZE);
+    unsigned long start = ctx->offset - ctx->offset % page;
+    unsigned long long cellLen = info->length + info->fsSize;
+    struct stat st;
+    void *map = NULL;
+
+    /* A mapping past the end of a truncated cell would fault on access */
+    if(fstat(ctx->fd, &st) || !S_ISREG(st.st_mode) ||
+        (unsigned long long)st.st_size < ctx->offset + cellLen ||
+        ctx->offset - start + cellLen > (size_t)-1)
+        return;
+    if((map = mmap(NULL, ctx->offset - start + cellLen, PROT_READ, MAP_SHARED,
+        ctx->fd, start)) == MAP_FAILED) {
+        pushdeb("in %s: failed to map cell, reading it instead\n", __func__);
+        return;
+    }
+    madvise(map, ctx->offset - start + cellLen, MADV_SEQUENTIAL);
+    ctx->map = map;
+    ctx->mapLen = ctx->offset - start + cellLen;
+    ctx->cell = ctx->map + (ctx->offset - start);
 }
+#endif
 
-static void __HCWriterThreadImpl(void *param)
+/* Inflates frames [first, last) of a regular file, the first of them starts
+   inOffset bytes into the payload */
+static int __HCWriteFrames(HCExportContext *ctx, HCExportWorker *worker, int fd, const char *pathName,
+    const HCBlockProperty *curProp, const unsigned char *data, unsigned long long dataOffset,
+    unsigned int first, unsigned int last, unsigned long long inOffset)
 {
-    pthread_t reader_pid = ((HCWriterThreadParam *)param)->ofReader;
-    HCQueue *queue = ((HCWriterThreadParam *)param)->frmReader;
-    HCReaderThreadCallback callback = ((HCWriterThreadParam *)param)->callback;
-    HCWriterQueueDataParam *aWriterParam = NULL;
-    HCBlockProperty *curProp = NULL;
-    int _ErrorOccurred = 0, fd = -1, curStatus = 0;
-    char *curPathName = NULL;
-    /* Decompress related */
-    unsigned char *DecompBuffer = NULL, *DataBuffer = NULL;
-    unsigned long long DecompSize = 0LL;
+    const unsigned char *FrameBuffer = NULL;
+    unsigned char *tBuffer = NULL;
+    unsigned long DecompSize = 0L;
+    unsigned long long outOffset = (unsigned long long)first * curProp->frameSize, holeEnd = 0LL;
+    unsigned int i = 0;
     int zRes = Z_OK;
 
-    while(1) {
-        pthread_mutex_lock(&queue->mutex);
-        while(queue->readp > queue->writep)
-            pthread_cond_wait(&queue->full, &queue->mutex);
-        if((aWriterParam = (HCWriterQueueDataParam *)queue->data[queue->readp])) {
-            /* Clone the data then release */
-            curStatus = aWriterParam->status;
-            curProp = HCMemdup(aWriterParam->property, sizeof(_HCWriterQueueDataParam));
-            /* It is not recommended to process with large file */
-            DataBuffer = HCSwapBytes(curProp->fType) == BLK_REG ? HCMemdup(aWriterParam->data, curProp->fSize1) : NULL;
-            curPathName = __HCDecodeString(curProp->pathName);
-
-            /* Release the resource and lock so that other threads can fetch the data
-               as soon as possible */
-            __HCWriterQueueDataParamDestroy(&((HCWriterQueueDataParam *)queue->data[queue->readp]));
-            queue->data[queue->readp] = NULL; /* Just for sure */
-            queue->readp++; // Push the indicator to next data slot
-            pthread_mutex_unlock(&queue->mutex);
-
-            /* Reserved: call progress callback */
-            // ...
-
-            switch(HCSwapBytes(curProp->fType)) {
-                case BLK_REG: {
-                    /* Force override */
-                    if(isFileExists(curPathName))
-                        remove(curPathName);
-                    /* Uncompress data stream */
-                    /* Before we formally start, we must check status code,
-                       If this is just an empty file, close the handle now */
-                    if(curStatus = 1) {
-                        if((fd = creat(curPathName, curProp->fMode)) == -1) {
-                            pushdeb("writer: failed to create file, %s\n", strerror(errno));
-                            _ErrorOccurred = 1; /* ERR_CREAT */
-                            goto __WriterBlockSkipProcess_Reg;
-                        }
-                        close(fd); // curProp->fSize2 == 0
-                    } else {
-                        //HCCalloc(DecompBuffer, 1, curProp->fSize2, _ErrorOccurred = 1; goto __WriterExitPoint);
-                        //if((fd = creat(curPathName, curProp->fMode)) == -1) {
-                        if(HCCreateFile(curPathName, curProp->fSize2, curProp->fMode)) {
-                            pushdeb("writer: failed to create file \'%s\', %s\n", curPathName, strerror(errno));
-                            _ErrorOccurred = 1;
-                            goto __WriterBlockSkipProcess_Reg;
-                        }
-                        if((fd = open(curPathName, O_RDWR)) == -1 || 
-                            (DecompBuffer = mmap(NULL, curProp->fSize2, PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
-                            _ErrorOccurred = 2; /* ERR_OPEN_BIND_MEM */
-                            pushdeb("writer: failed to open file, %s\n", strerror(errno));
-                            remove(curPathName);
-                            goto __WriterBlockSkipProcess_Reg;
-                        }
-
-                        DecompSize = curProp->fSize2;
-
-                        if((zRes = uncompress(DecompBuffer, &DecompSize, aWriterParam->data, curProp->fSize1))) {
-                            pushdeb("write: decompressor returned 0x%08x\n", zRes);
-                            _ErrorOccurred = 3; /* ERR_DECOMP */
-                            goto __WriterBlockSkipProcess_Reg;
-                        }
-                        if(DecompSize != curProp->fSize2) {
-                            pushdeb("writer: failed to decompress data, size mismatched\n");
-                            _ErrorOccurred = 4; /* ERR_DECOMP_SIZE_MISMATCH */
-                            goto __WriterBlockSkipProcess_Reg;
-                        }
+    /* One frame in and one frame out at a time, memory stays the same
+       whatever the size of the file */
+    if(curProp->frameSize > worker->outSize) {
+        if(!(tBuffer = realloc(worker->out, curProp->frameSize)))
+            return 2; /* ERR_OPEN_BIND_MEM */
+        worker->out = tBuffer;
+        worker->outSize = curProp->frameSize;
+    }
 
-__WriterBlockSkipProcess_REG:
-                        if(DecompBuffer && DecompBuffer != MAP_FAILED)
-                            if(munmap(DecompBuffer, curProp->fsize2) == -1)
-                                pushdeb("writer: failed to unbind memory, ignored\n");
-                        if(DataBuffer) free(DataBuffer);
-                        close(fd);
-                    }
-                    break;
-                } /* End of BLK_REG */
-
-                case BLK_HARDLINK: {
-                    if(link(__HCDecodeString(curProp->linkName), curPathName)) {
-                        pushdeb("writer: failed to create hard link \'%s\'-->\'%s\', %s\n", curPathName,
-                            __HCDecodeString(curProp->linkName), strerror(errno));
-                        _ErrorOccurred = 5; /* ERR_CREAT_HARDLINK */
-                    }
-                    break;
-                } /* End of BLK_HARDLINK */
-
-                case BLK_SYMLINK: {
-                    if(symlink(__HCDecodeString(curProp->linkName), curPathName)) {
-                        pushdeb("writer: failed to create symbolic link \'%s\'-->\'%s\', %s\n", curPathName,
-                            __HCDecodeString(curProp->linkName), strerror(errno));
-                        _ErrorOccurred = 6; /* ERR_CREAT_SYMLINK */
-                    }
-                    break;
-                } /* End of BLK_SYMLINK */
-
-                case BLK_BLOCKDEV: {}
-                case BLK_CHARDEV: {
-                    if(mknod(curPathName, 
-                        (HCSwapBytes(curProp->fType) == BLK_CHARDEV ? S_IFCHR : S_IFBLK) | curProp->mode, 
-                        makedev(curProp->dev1, curProp->dev2))) {
-                        pushdeb("writer: failed to create device, %s\n", strerror(errno));
-                        _ErrorOccurred = 7; /* ERR_CREAT_DEVICE */
-                    }
-                    break;
-                } /* End of BLK_BLOCKDEV, BLK_CHARDEV */
+    /* Every frame inflates on its own into its slice of the file */
+    for(i = first; i < last; i++) {
+        /* A big file is many frames, do not finish it for nothing */
+        if(atomic_load_explicit(&ctx->aborted, memory_order_relaxed))
+            return 11; /* ERR_CANCELLED */
+        DecompSize = curProp->fSize2 - outOffset;
+        if(DecompSize > curProp->frameSize)
+            DecompSize = curProp->frameSize;
+        if(inOffset + curProp->frameTable[i] > curProp->fSize1) {
+            pushdeb("writer: frame table exceeds payload\n");
+            return 4; /* ERR_DECOMP_SIZE_MISMATCH */
+        }
+        /* Frames in a hole were never stored, the file has the hole already */
+        if(!curProp->frameTable[i]) {
+            if(!HCBlockHoleAt(curProp->holeTable, curProp->holes, outOffset, &holeEnd) ||
+                holeEnd < outOffset + DecompSize) {
+                pushdeb("writer: empty frame outside of a hole\n");
+                return 4; /* ERR_DECOMP_SIZE_MISMATCH */
+            }
+            outOffset += DecompSize;
+            continue;
+        }
+        if((zRes = __HCFetchFrame(ctx, worker, curProp, i, data, dataOffset, inOffset, &FrameBuffer)))
+            return zRes;
+        /* Stored frames are written as they are */
+        if(curProp->codec != HC_CODEC_STORE && curProp->frameTable[i] != DecompSize) {
+            if((zRes = HCCodecDecompress(worker->codec, curProp->codec, worker->out,
+                &DecompSize, FrameBuffer, curProp->frameTable[i]))) {
+                pushdeb("write: decompressor returned 0x%08x\n", zRes);
+                return 3; /* ERR_DECOMP */
+            }
+            FrameBuffer = worker->out;
+        } else if(curProp->frameTable[i] > DecompSize)
+            return 4; /* ERR_DECOMP_SIZE_MISMATCH */
+        else
+            DecompSize = curProp->frameTable[i];
+        /* Only the last frame may come out short */
+        if(i + 1 < curProp->frames && DecompSize != curProp->frameSize) {
+            pushdeb("writer: failed to decompress data, size mismatched\n");
+            return 4; /* ERR_DECOMP_SIZE_MISMATCH */
+        }
+        if(__HCWriteExtents(fd, FrameBuffer, DecompSize, outOffset, curProp)) {
+            pushdeb("writer: failed to write \'%s\', %s\n", pathName, strerror(errno));
+            return 10; /* ERR_IO */
+        }
+#if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
+        /* Done with these pages, they would otherwise stay in our RSS
+           until the whole cell is unmapped */
+        if(data)
+            __HCExportRelease(data, inOffset, inOffset + curProp->frameTable[i]);
+#endif
+        inOffset += curProp->frameTable[i];
+        outOffset += DecompSize;
+    }
+    if(last == curProp->frames && outOffset != curProp->fSize2) {
+        pushdeb("writer: failed to decompress data, size mismatched\n");
+        return 4; /* ERR_DECOMP_SIZE_MISMATCH */
+    }
 
-                case BLK_DIR: {
-                    if(mkpath(curPathName, curProp->mode)) {
-                        pushdeb("writer: failed to create dir \'%s\'\n", curPathName);
-                        _ErrorOccurred = 8; /* ERR_CREAT_DIR */
-                    }
-                    break;
-                } /* End of BLK_DIR */
+    return 0;
+}
 
-                case BLK_FIFO: {
-                    if(mknod(curPathName, S_IFIFO | curProp->mode, 0)) {
-                        pushdeb("writer: failed to create fifo, %s\n", strerror(errno));
-                        _ErrorOccurred = 9; /* ERR_CREAT_FIFO */
-                    }
-                    break;
-                } /* End of BLK_FIFO */
-                default:
-                    pusherr("Unknown block type, skipped\n");
-            }
+/* Writes 'length' bytes of a file from 'offset' on, what falls in a hole is
+   left out */
+static int __HCWriteExtents(int fd, const unsigned char *buffer, unsigned long length,
+    unsigned long long offset, const HCBlockProperty *curProp)
+{
+    unsigned long long at = offset, end = 0LL;
+    int inHole = 0;
+
+    if(!curProp->holes)
+        return HCPWriteFileX(fd, (void *)buffer, length, offset);
+    for(; at < offset + length; at = end) {
+        inHole = HCBlockHoleAt(curProp->holeTable, curProp->holes, at, &end);
+        if(end > offset + length)
+            end = offset + length;
+        if(!inHole && HCPWriteFileX(fd, (void *)(buffer + (at - offset)), end - at, at))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Gives a file its final size before any frame is written. Blocks are
+   reserved for the data only, the holes of a sparse file stay holes */
+static int __HCExportAllocate(int fd, const HCBlockProperty *curProp)
+{
+#if defined(LINUX) && defined(FALLOC_FL_KEEP_SIZE)
+    unsigned long long offset = 0LL, end = 0LL;
+#endif
 
-            /* Clean up now */
-            free(curProp);
-            if(_ErrorOccurred) {
-                /* Check whether the reader process still alive, if yes kill it */
-                /* Only the reader thread dead, other worker threads will stop  */
-                pushdeb("writer@%ld: critical error occurred, trying to kill the reader thread...\n", pthread_self());
-                if(pthread_kill(reader_pid) != ESRCH && pthread_kill(reader_pid) != EINVAL) {
-                    pushdeb("writer@%ld: reader thread exists, setting up terminal signal...\n");
-                    __InternalReaderKillRequestCounter++;
-                }
-                goto __WriterExitPoint;
+    if(ftruncate(fd, curProp->fSize2))
+        return -1;
+#if defined(LINUX) && defined(FALLOC_FL_KEEP_SIZE)
+    for(offset = 0; offset < curProp->fSize2; offset = end) {
+        if(HCBlockHoleAt(curProp->holeTable, curProp->holes, offset, &end))
+            continue;
+        if(end > curProp->fSize2)
+            end = curProp->fSize2;
+        /* Only a hint, writing finds out about a full disk all the same */
+        if(fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, end - offset))
+            break;
+    }
+#endif
+
+    return 0;
+}
+
+/* Points outFrame at 'length' bytes of a payload, inOffset into it. Mapped
+   cells hand out the mapping, others are read into the worker's buffer */
+static int __HCFetchFrame(HCExportContext *ctx, HCExportWorker *worker,
+    const HCBlockProperty *curProp, unsigned int frame, const unsigned char *data,
+    unsigned long long dataOffset, unsigned long long inOffset, const unsigned char **outFrame)
+{
+    unsigned char *tBuffer = NULL;
+    unsigned int length = curProp->frameTable[frame];
+
+    if(data) {
+        *outFrame = data + inOffset;
+        goto __HCFF_CHECK;
+    }
+    /* Not mapped, fetch just this frame */
+    if(length > worker->inSize) {
+        if(!(tBuffer = realloc(worker->in, length)))
+            return 2; /* ERR_OPEN_BIND_MEM */
+        worker->in = tBuffer;
+        worker->inSize = length;
+    }
+    if(pread(ctx->fd, worker->in, length, ctx->offset + dataOffset + inOffset) != length) {
+        pushdeb("writer: failed to read frame, I/O error\n");
+        return 10; /* ERR_IO */
+    }
+    *outFrame = worker->in;
+
+__HCFF_CHECK:
+    /* Stored frames have nothing else that would catch a flipped bit */
+    if(curProp->frameSums && crc32(0L, *outFrame, length) != curProp->frameSums[frame]) {
+        pushdeb("writer: frame %u of \'%s\' fails its checksum\n", frame, curProp->pathName);
+        return 12; /* ERR_CHECKSUM */
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+/* Queues a file of one frame at most on the worker's ring: unlink, open,
+   write and close linked into one chain. Returns 0 when the file is to be
+   written the synchronous way instead, which also reports what is wrong */
+static int __HCUringQueue(HCExportContext *ctx, HCWriterQueueDataParam *aWriterParam,
+    HCExportWorker *worker)
+{
+    HCBlockProperty *curProp = aWriterParam->property;
+    HCExportPending *pend = NULL;
+    struct io_uring_sqe *sqe = NULL;
+    const unsigned char *FrameBuffer = NULL;
+    unsigned char *tBuffer = NULL;
+    unsigned long DecompSize = 0L;
+    unsigned int slot = worker->pendingCount;
+
+    /* Runs of split files have no property of their own */
+    if(aWriterParam->file || curProp->fType != BLK_REG || slot >= HC_EXPORT_BATCH)
+        return 0;
+    /* Sparse files are written around their holes */
+    if(curProp->holes)
+        return 0;
+    if(curProp->fSize2 && (curProp->frames != 1 || curProp->fSize2 > curProp->frameSize ||
+        (!aWriterParam->data && !aWriterParam->dataOffset) || curProp->frameTable[0] > curProp->fSize1))
+        return 0;
+
+    pend = &worker->pending[slot];
+    pend->source = NULL;
+    pend->length = DecompSize = curProp->fSize2;
+    if(curProp->fSize2) {
+        if(__HCFetchFrame(ctx, worker, curProp, 0, aWriterParam->data, aWriterParam->dataOffset, 0,
+            &FrameBuffer))
+            return 0;
+        if(curProp->codec != HC_CODEC_STORE && curProp->frameTable[0] != DecompSize) {
+            /* The buffer has to live until the write completes */
+            if(curProp->fSize2 > pend->bufferSize) {
+                if(!(tBuffer = realloc(pend->buffer, curProp->fSize2)))
+                    return 0;
+                pend->buffer = tBuffer;
+                pend->bufferSize = curProp->fSize2;
             }
+            if(HCCodecDecompress(worker->codec, curProp->codec, pend->buffer, &DecompSize,
+                FrameBuffer, curProp->frameTable[0]) || DecompSize != curProp->fSize2)
+                return 0;
+            pend->source = pend->buffer;
+        } else if(curProp->frameTable[0] != DecompSize)
+            return 0;
+        else if(aWriterParam->data)
+            /* Stored and mapped, goes out of the page cache as it is */
+            pend->source = FrameBuffer;
+        else {
+            if(curProp->fSize2 > pend->bufferSize) {
+                if(!(tBuffer = realloc(pend->buffer, curProp->fSize2)))
+                    return 0;
+                pend->buffer = tBuffer;
+                pend->bufferSize = curProp->fSize2;
+            }
+            memcpy(pend->buffer, FrameBuffer, curProp->fSize2);
+            pend->source = pend->buffer;
+        }
+    }
+
+    /* The ring holds HC_URING_OPS entries per slot and is flushed once all
+       slots are taken, so there is always room */
+    /* Force override, fails for a new file: a hard link keeps the chain going */
+    sqe = HCUringGetSqe(worker->uring);
+    sqe->opcode = IORING_OP_UNLINKAT;
+    sqe->fd = aWriterParam->dir->fd;
+    sqe->addr = (unsigned long)aWriterParam->baseName;
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->user_data = slot * HC_URING_OPS + 0;
+    /* Opened straight into slot 'slot' of the registered files */
+    sqe = HCUringGetSqe(worker->uring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = aWriterParam->dir->fd;
+    sqe->addr = (unsigned long)aWriterParam->baseName;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = curProp->fMode;
+    sqe->file_index = slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = slot * HC_URING_OPS + 1;
+    if(pend->length) {
+        sqe = HCUringGetSqe(worker->uring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = slot;
+        sqe->addr = (unsigned long)pend->source;
+        sqe->len = pend->length;
+        sqe->off = 0;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->user_data = slot * HC_URING_OPS + 2;
+    }
+    sqe = HCUringGetSqe(worker->uring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+    sqe->user_data = slot * HC_URING_OPS + 3;
+
+    pend->entry = aWriterParam;
+    pend->ops = pend->length ? 4 : 3;
+    pend->failed = 0;
+    worker->pendingCount++;
+
+    return 1;
+}
+
+/* Submits the queued chains in one go and waits for all of them. A file
+   whose chain broke is written again the synchronous way */
+static int __HCUringFlush(HCExportContext *ctx, HCExportWorker *worker)
+{
+    HCExportPending *pend = NULL;
+    struct io_uring_cqe cqe;
+    unsigned int i, ops = 0, done = 0;
+    int res = 0, _ErrorOccurred = 0;
 
-        } else {
-            /* Can't get any data from the queue, if the reader thread has exited,
-              exit as well. */
-            if(pthread_kill(reader_pid, 0) == ESRCH) {
-                /* Reader thread has dead */
-                pushdeb("writer@%ld: exited without any errors\n", pthread_self());
-                pthread_mutex_unlock(&queue->mutex);
-                goto __WriterExitPoint;
-            } else {
-                if(queue->readp < queue->writep) {
-                    pushdeb("writer: exited due to a critical error occurred in the queue\n");
-                    __InternalReaderKillRequestCounter++;
+    for(i = 0; i < worker->pendingCount; i++)
+        ops += worker->pending[i].ops;
+    while(done < ops) {
+        if((res = HCUringSubmitAndWait(worker->uring, ops - done)) < 0) {
+            pushdeb("writer: io_uring failed, %s, going synchronous\n", strerror(-res));
+            /* Whatever is still in flight is cancelled with the ring */
+            HCUringDestroy(&worker->uring);
+            break;
+        }
+        while(HCUringPopCqe(worker->uring, &cqe)) {
+            done++;
+            pend = &worker->pending[cqe.user_data / HC_URING_OPS];
+            switch(cqe.user_data % HC_URING_OPS) {
+                case 0: /* Nothing to unlink is fine */
+                    break;
+                case 2:
+                    if(cqe.res != (int)pend->length)
+                        pend->failed = 1;
                     break;
-                }
+                default:
+                    if(cqe.res < 0)
+                        pend->failed = 1;
             }
-            pthread_cond_signal(&queue->empty); // contact to reader thread
         }
-        //pthread_mutex_unlock(&queue->mutex);
     }
-__WriterExitPoint:
-    pushdeb("worker@%lu: exited%s\n", pthread_self(), _ErrorOccurred ? " error" : "");
-    pthread_exit(NULL);
+
+    for(i = 0; i < worker->pendingCount; i++) {
+        pend = &worker->pending[i];
+        if((pend->failed || res < 0) && !_ErrorOccurred && !atomic_load(&ctx->aborted))
+            _ErrorOccurred = __HCWriteEntry(ctx, pend->entry, worker);
+#if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
+        if(pend->entry->data && pend->length)
+            __HCExportRelease(pend->entry->data, 0, pend->entry->property->frameTable[0]);
+#endif
+        __HCWriterQueueDataParamDestroy(&pend->entry);
+    }
+    worker->pendingCount = 0;
+
+    return _ErrorOccurred;
 }
+#endif /* HAVE_IO_URING */
 
-static void __HCWriterQueueDataParamDestroy(HCWriterQueueDataParam **param)
+/* Cuts a big regular file into runs of frames. The runs that fit go back to
+   the ring for idle writers, this writer takes the first one and whatever
+   did not fit. Takes over fd and the property of aWriterParam */
+static int __HCSplitFile(HCExportContext *ctx, HCWriterQueueDataParam *aWriterParam,
+    HCExportWorker *worker, int fd)
 {
-    HCWriterQueueDataParam *p = *param;
+    const char *pathName = (char *)aWriterParam->property->pathName;
+    HCBlockProperty *curProp = aWriterParam->property;
+    HCWriterQueueDataParam **ranges = NULL;
+    HCExportFile *file = NULL;
+    unsigned int perRange, count, i;
+    size_t pushed = 0;
+    int res = 0, _ErrorOccurred = 0;
 
-    if(*param) {
-        if(p->property) free(p->property);
-        if(p->data) free(p->data);
-        free(*param);
-        *param = NULL;
+    perRange = (curProp->frames + 2 * ctx->workers - 1) / (2 * ctx->workers);
+    if(perRange < HC_EXPORT_SPLIT_FRAMES)
+        perRange = HC_EXPORT_SPLIT_FRAMES;
+    count = (curProp->frames + perRange - 1) / perRange;
+
+    if(!(file = calloc(1, sizeof(HCExportFile))) ||
+        !(file->frameOffsets = calloc(curProp->frames + 1, sizeof(unsigned long long))) ||
+        !(ranges = calloc(count, sizeof(HCWriterQueueDataParam *)))) {
+        _ErrorOccurred = 2; /* ERR_OPEN_BIND_MEM */
+        goto __HCSF_FAILED;
+    }
+    for(i = 0; i < count; i++) {
+        HCCalloc(ranges[i], 1, sizeof(HCWriterQueueDataParam), _ErrorOccurred = 2; goto __HCSF_FAILED);
+        ranges[i]->file = file;
+        ranges[i]->firstFrame = i * perRange;
+        ranges[i]->lastFrame = i + 1 < count ? (i + 1) * perRange : curProp->frames;
+    }
+    /* Where each run starts in the payload */
+    for(i = 0; i < curProp->frames; i++)
+        file->frameOffsets[i + 1] = file->frameOffsets[i] + curProp->frameTable[i];
+    if(file->frameOffsets[curProp->frames] > curProp->fSize1) {
+        pushdeb("writer: frame table exceeds payload\n");
+        _ErrorOccurred = 4; /* ERR_DECOMP_SIZE_MISMATCH */
+        goto __HCSF_FAILED;
     }
+    /* Runs finish in any order, give the file its size first */
+    if(__HCExportAllocate(fd, curProp)) {
+        pushdeb("writer: failed to size \'%s\', %s\n", pathName, strerror(errno));
+        _ErrorOccurred = 10; /* ERR_IO */
+        goto __HCSF_FAILED;
+    }
+
+    file->ctx = ctx;
+    file->charge = aWriterParam->charge;
+    file->property = curProp;
+    file->data = aWriterParam->data;
+    file->dataOffset = aWriterParam->dataOffset;
+    file->fd = fd;
+    file->dir = aWriterParam->dir;
+    file->baseName = aWriterParam->baseName;
+    atomic_init(&file->pending, count);
+    atomic_init(&file->failed, 0);
+    aWriterParam->property = NULL;
+    aWriterParam->data = NULL;
+    aWriterParam->dir = NULL;
+    aWriterParam->charge = 0;
+
+    /* Counted before they can be taken, the ring must not close under them */
+    atomic_fetch_add(&ctx->outstanding, count - 1);
+    pushed = HCRingTryPush(ctx->ring, (void **)(ranges + 1), count - 1);
+    if(pushed < count - 1)
+        __HCExportDone(ctx, count - 1 - pushed);
+    pushdeb("writer: \'%s\' split into %u runs, %lu shared\n", pathName, count, (unsigned long)pushed);
+    for(i = 0; i < count; i++) {
+        if(i >= 1 && i < 1 + pushed)
+            continue;
+        if((_ErrorOccurred = __HCWriteRange(ctx, ranges[i], worker)) && !res)
+            res = _ErrorOccurred;
+        __HCWriterQueueDataParamDestroy(&ranges[i]);
+    }
+    free(ranges);
+
+    return res;
+
+__HCSF_FAILED:
+    if(ranges) {
+        for(i = 0; i < count; i++)
+            if(ranges[i]) free(ranges[i]);
+        free(ranges);
+    }
+    if(file) {
+        if(file->frameOffsets) free(file->frameOffsets);
+        free(file);
+    }
+    close(fd);
+    unlinkat(aWriterParam->dir->fd, aWriterParam->baseName, 0);
+    return _ErrorOccurred;
+}
+
+/* Writes one run of a split file */
+static int __HCWriteRange(HCExportContext *ctx, HCWriterQueueDataParam *aWriterParam,
+    HCExportWorker *worker)
+{
+    HCExportFile *file = aWriterParam->file;
+    int res = 0;
+
+    /* No use in writing a file that is going to be removed */
+    if(!atomic_load(&file->failed))
+        res = __HCWriteFrames(ctx, worker, file->fd, (char *)file->property->pathName, file->property, file->data,
+            file->dataOffset, aWriterParam->firstFrame, aWriterParam->lastFrame,
+            file->frameOffsets[aWriterParam->firstFrame]);
+    aWriterParam->file = NULL;
+    __HCExportFileRelease(file, res);
+
+    return res;
 }
 
-/* Basic Queue Allocations */
-static HCQueue *__HCQueueInitialise(int size)
+/* Called once per run, written or not. The last one closes the file, which
+   is removed unless every run made it */
+static void __HCExportFileRelease(HCExportFile *file, int failed)
 {
-    HCQueue *queue = calloc(1, sizeof(HCQueue));
+    if(failed)
+        atomic_store(&file->failed, 1);
+    if(atomic_fetch_sub(&file->pending, 1) != 1)
+        return;
 
-    if(!queue) return NULL;
-    queue->data = calloc(size, sizeof(void *));
-    if(!queue->data) {
-        free(queue);
+    close(file->fd);
+    if(atomic_load(&file->failed))
+        unlinkat(file->dir->fd, file->baseName, 0);
+    __HCExportDirRelease(&file->dir);
+    __HCExportCredit(file->ctx, file->charge);
+    HCBlockPropertyRelease(file->property);
+    free(file->property);
+    free(file->frameOffsets);
+    free(file);
+}
+
+/* Opens 'name' under atfd as the directory 'path' of the cell, with the
+   caller holding the only reference */
+static HCExportDir *__HCExportOpenDir(int atfd, const char *name, const char *path)
+{
+    HCExportDir *dir = NULL;
+    int fd = -1;
+
+    if((fd = openat(atfd, name, O_RDONLY | O_DIRECTORY)) == -1)
+        return NULL;
+    if(!(dir = calloc(1, sizeof(HCExportDir)))) {
+        close(fd);
         return NULL;
     }
-    queue->size = size;
-    queue->writep = queue->readp = 0;
-    pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->full, NULL);
-    pthread_cond_init(&queue->empty, NULL);
+    dir->fd = fd;
+    atomic_init(&dir->refs, 1);
+    dir->pathLen = snprintf(dir->path, sizeof(dir->path), "%s", path);
 
-    return queue;
+    return dir;
 }
 
-static void __HCQueueDestroy(HCQueue **queue)
+static void __HCExportDirRelease(HCExportDir **dir)
 {
-    int i;
-    HCQueue *pQueue = *queue;
+    if(*dir) {
+        if(atomic_fetch_sub(&(*dir)->refs, 1) == 1) {
+            close((*dir)->fd);
+            free(*dir);
+        }
+        *dir = NULL;
+    }
+}
+
+/* Takes a reference on the directory an entry goes in. The walk puts a
+   directory before its entries, so the parent is found on the stack of
+   directories the reader is in, no path is resolved again */
+static HCExportDir *__HCExportParent(HCExportContext *ctx, const char *pathName,
+    const char **baseName, int *outDepth)
+{
+    HCExportDir *dir = NULL;
+    const char *slash = strrchr(pathName, '/');
+    char parentPath[2048];
+    size_t len = slash ? (size_t)(slash - pathName) : 0;
+    int depth = 0;
 
-    if(*queue) {
-        for(i = 0; i < pQueue->size; i++)
-            if(pQueue->data[i]) free(pQueue->data[i]);
-        free(pQueue->data);
-        free(pQueue);
-        *queue = NULL;
+    *baseName = slash ? slash + 1 : pathName;
+    for(slash = pathName; *slash; slash++)
+        if(*slash == '/') depth++;
+    if(outDepth) *outDepth = depth;
+
+    if(depth < ctx->depth && (dir = ctx->dirStack[depth]) &&
+        dir->pathLen == len && !memcmp(dir->path, pathName, len)) {
+        atomic_fetch_add(&dir->refs, 1);
+        return dir;
+    }
+
+    /* A cell not written in walk order, look the parent up the long way */
+    snprintf(parentPath, sizeof(parentPath), "%.*s", (int)len, pathName);
+    if(!(dir = __HCExportOpenDir(ctx->dirStack[0]->fd, parentPath, parentPath)) && errno == ENOENT) {
+        snprintf(parentPath, sizeof(parentPath), "%s/%.*s", ctx->prefix, (int)len, pathName);
+        if(!mkpath(parentPath, 0755))
+            dir = __HCExportOpenDir(ctx->dirStack[0]->fd, parentPath + strlen(ctx->prefix) + 1,
+                parentPath + strlen(ctx->prefix) + 1);
     }
+    if(!dir)
+        pushdeb("reader: no directory for \'%s\', %s\n", pathName, strerror(errno));
+
+    return dir;
 }
 
-static char *__HCDecodeString(char *pStr)
+/* First phase, run by the reader in cell order. The owner gets rwx to let
+   the entries in, a mode without it is put back in the last phase */
+static int __HCExportMakeDir(HCExportContext *ctx, const HCBlockProperty *property)
 {
-    int i;
+    HCExportDir *parent = NULL, *dir = NULL, **tStack = NULL;
+    const char *baseName = NULL;
+    struct stat st;
+    mode_t mode = property->fMode | S_IRWXU;
+    int depth = 0, i;
 
-    if(pStr && strlen(pStr))
-        for(i = 0; i < strlen(pStr); i++) {
-            pStr[i] ^= 0x0A5E921F;
-            pStr[i] = HCCharSwap(pStr[i]);
+    /* The root of the cell is the prefix itself */
+    if(property->pathName[0]) {
+        if(!(parent = __HCExportParent(ctx, (char *)property->pathName, &baseName, &depth)))
+            return 8; /* ERR_CREAT_DIR */
+        if((mkdirat(parent->fd, baseName, mode) && (errno != EEXIST ||
+            fstatat(parent->fd, baseName, &st, 0) || !S_ISDIR(st.st_mode))) ||
+            !(dir = __HCExportOpenDir(parent->fd, baseName, (char *)property->pathName))) {
+            pushdeb("reader: failed to create dir \'%s\', %s\n", property->pathName, strerror(errno));
+            __HCExportDirRelease(&parent);
+            return 8; /* ERR_CREAT_DIR */
         }
+        __HCExportDirRelease(&parent);
 
-    return pStr;
-}
\ No newline at end of file
+        /* Everything deeper is done with, what follows goes in dir */
+        depth++;
+        if(depth >= ctx->stackCapacity) {
+            if(!(tStack = realloc(ctx->dirStack, (depth + 16) * sizeof(HCExportDir *)))) {
+                __HCExportDirRelease(&dir);
+                return -3;
+            }
+            ctx->dirStack = tStack;
+            ctx->stackCapacity = depth + 16;
+        }
+        for(i = depth; i < ctx->depth; i++)
+            __HCExportDirRelease(&ctx->dirStack[i]);
+        for(i = ctx->depth; i < depth; i++)
+            ctx->dirStack[i] = NULL;
+        ctx->dirStack[depth] = dir;
+        ctx->depth = depth + 1;
+    }
+    if((property->fMode & S_IRWXU) != S_IRWXU)
+        return __HCExportDefer(ctx, property);
+
+    return 0;
+}
+
+/* Holds an entry back for __HCExportFinish() */
+static int __HCExportDefer(HCExportContext *ctx, const HCBlockProperty *property)
+{
+    HCExportDeferred *tDeferred = NULL, *d = NULL;
+
+    if(ctx->deferredCount == ctx->deferredCapacity) {
+        if(!(tDeferred = realloc(ctx->deferred, (ctx->deferredCapacity ? ctx->deferredCapacity * 2 : 64) *
+            sizeof(HCExportDeferred))))
+            return -3;
+        ctx->deferred = tDeferred;
+        ctx->deferredCapacity = ctx->deferredCapacity ? ctx->deferredCapacity * 2 : 64;
+    }
+    d = &ctx->deferred[ctx->deferredCount];
+    d->fType = property->fType;
+    d->fMode = property->fMode;
+    d->linkName = NULL;
+    if(!(d->pathName = strdup(property->pathName[0] ? (char *)property->pathName : ".")))
+        return -3;
+    if(property->fType != BLK_DIR && !(d->linkName = strdup((char *)property->linkName))) {
+        free(d->pathName);
+        return -3;
+    }
+    ctx->deferredCount++;
+
+    return 0;
+}
+
+/* Last phase, every file is in place: links, then the directory modes that
+   were held back. Few entries get here, they are looked up from the root */
+static int __HCExportFinish(HCExportContext *ctx)
+{
+    HCExportDeferred *d = NULL;
+    int root = ctx->dirStack[0]->fd;
+    unsigned long i;
+
+    for(i = 0; i < ctx->deferredCount; i++) {
+        d = &ctx->deferred[i];
+        if(d->fType == BLK_DIR)
+            continue;
+        /* Force override, a directory in the way stays and fails below */
+        unlinkat(root, d->pathName, 0);
+        if(d->fType == BLK_HARDLINK) {
+            /* The target is an earlier entry of the same cell */
+            if(linkat(root, d->linkName, root, d->pathName, 0)) {
+                pushdeb("in %s: failed to create hard link \'%s\'-->\'%s\', %s\n", __func__,
+                    d->pathName, d->linkName, strerror(errno));
+                return 5; /* ERR_CREAT_HARDLINK */
+            }
+        } else if(symlinkat(d->linkName, root, d->pathName)) {
+            pushdeb("in %s: failed to create symbolic link \'%s\'-->\'%s\', %s\n", __func__,
+                d->pathName, d->linkName, strerror(errno));
+            return 6; /* ERR_CREAT_SYMLINK */
+        }
+    }
+    /* Deepest first, a parent without search permission would cut the way
+       to the entries below it */
+    for(i = ctx->deferredCount; i-- > 0;) {
+        d = &ctx->deferred[i];
+        if(d->fType == BLK_DIR && fchmodat(root, d->pathName, d->fMode & 07777, 0)) {
+            pushdeb("in %s: failed to set mode of \'%s\', %s\n", __func__, d->pathName, strerror(errno));
+            return 8; /* ERR_CREAT_DIR */
+        }
+    }
+
+    return 0;
+}
+
+static void __HCWriterQueueDataParamDestroy(HCWriterQueueDataParam **param)
+{
+    HCWriterQueueDataParam *p = *param;
+
+    if(*param) {
+        /* A run nobody wrote, the file cannot be complete */
+        if(p->file)
+            __HCExportFileRelease(p->file, 1);
+        if(p->ctx)
+            __HCExportCredit(p->ctx, p->charge);
+        __HCExportDirRelease(&p->dir);
+        if(p->property) {
+            HCBlockPropertyRelease(p->property);
+            free(p->property);
+        }
+        if(p->data && !p->mapped) free(p->data);
+        free(*param);
+        *param = NULL;
+    }
+}
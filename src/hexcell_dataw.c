@@ -29,390 +29,1203 @@
  *
  */
 
+/* SEEK_DATA and SEEK_HOLE */
+#if defined(LINUX) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <ftw.h>
-#include <zlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
 
 #include <hexcell_utils.h>
 #include <hexcell_data.h>
+#include <hexcell_block.h>
+#include <hexcell_codec.h>
+#include <hexcell_scan.h>
+#include <hexcell_hash.h>
+#include <hexcell_index.h>
+#include <hexcell_meta.h>
+#include <hexcell_tree.h>
 #include <hexcell_message.h>
 
+/* How many frames each compressor may run ahead of the appender */
+#define HC_IMPORT_WINDOW_FACTOR 4
+/* Directory scanning is I/O bound, a few threads are enough to hide latency */
+#define HC_IMPORT_MAX_SCANNERS  8
+/* Frames from this size on are mapped instead of read, below it setting up
+   the mapping costs more than the copy it saves */
+#define HC_IMPORT_MMAP_THRESHOLD (64 * 1024)
+/* A file broken into more holes than this keeps the rest as zeros */
+#define HC_IMPORT_MAX_HOLES     65536
+
+/* Used unless HCCellWriterSetCodec() says otherwise */
+#ifdef HAVE_ZSTD
+#define HC_DEFAULT_CODEC        HC_CODEC_ZSTD
+#define HC_DEFAULT_CODEC_LEVEL  3
+#else
+#define HC_DEFAULT_CODEC        HC_CODEC_ZLIB
+#define HC_DEFAULT_CODEC_LEVEL  Z_DEFAULT_COMPRESSION
+#endif
+
+/* Everything the importer knows about one cell. Writers share nothing, but a
+   writer must not be used by two threads at once */
+struct _HCCellWriter {
+    int                 fd;
+    unsigned long       beginOffset;  // Where the InfoBlock goes
+    int                 workers;
+    int                 codec;
+    int                 codecLevel;
+    int                 dedup;
+    int                 index;        // Append a central index on finish
+    int                 meta;         // Append a metadata section on finish
+    unsigned int        flags;        // InfoBlock FLAGS
+    int                 failed;       // A body unit may be half written, do not finish
+    HCCellBuffer        cb;
+    HHash              *inodes;       // (st_dev, st_ino) -> relative path, walk stage only
+    HHash              *payloads;     // (hash, st_size) -> HCPayloadRef, appender only
+    HCIndexEntry       *entries;      // One per body unit, in cell order
+    unsigned long       entryCapacity;
+    HCMetaEntry        *rows;         // Same, for the metadata section
+    unsigned long       rowCapacity;
+    HCTree             *tree;         // Regular files for the digest tree, NULL for none
+    unsigned char       zeroLeaf[HC_SHA256_LEN]; // Of a whole frame in a hole
+    unsigned long long  fsSize;
+    unsigned long long  realSize;
+    unsigned long       blocks;
+    unsigned long       codecs;
+};
+
+/* Header of a body unit, written once its first frame is appended */
+typedef struct _HCBodyUnit {
+    HCBlockProperty    *property;
+    unsigned long       blockLen;
+    unsigned long long  dataLen;
+    off_t               headerOffset;   // Where BID_BEGIN landed, large files are
+                                        // patched from there after the last frame
+    unsigned char      *header;         // Copy of the header of a large file, the
+                                        // patch goes over it
+    unsigned char      *leaves;         // HC_SHA256_LEN per frame, for the digest tree
+} HCBodyUnit;
+
+/* Entry found by the walk stage */
+typedef struct _HCImportEntry {
+    char               *path;
+    struct stat         st;
+    HCBodyUnit         *unit;      // Built along with frame 0
+    unsigned int        frames;
+    char               *linkTarget; // Relative path of the first link to the same
+                                    // inode, NULL unless this is a hard link
+    unsigned int        holes;
+    unsigned long long *holeTable; // Found by the walk stage, before any frame
+                                   // is looked at
+} HCImportEntry;
+
+/* One frame of one entry, the unit of work of the compressors */
+typedef struct _HCImportJob {
+    HCImportEntry      *entry;
+    unsigned int        frame;
+    int                 last;      // Last job of its entry
+    unsigned char      *data;      // Compressed frame
+    unsigned long       dataLen;
+    unsigned long long  hash;      // Of the compressed frame, single frame entries only
+    unsigned int        sum;       // CRC-32 of the compressed frame
+    unsigned char       digest[HC_SHA256_LEN]; // HCTreeLeaf() of the frame as read
+    int                 status;    // 0 pending, 1 done, < 0 failed
+} HCImportJob;
+
+/* Where a payload went, so that identical files can share it */
+typedef struct _HCPayloadRef {
+    off_t               offset;
+    unsigned long       length;
+    short               codec;
+} HCPayloadRef;
+
+/* Walk -> compress -> append pipeline state of one HCCellWriterAddPath() */
+typedef struct _HCImportPipeline {
+    HCCellWriter       *writer;
+    const char         *rootPath;
+    HCImportJob       **jobs;
+    unsigned long       count;
+    unsigned long       capacity;
+    unsigned long       nextJob;     // Next job to be claimed by a compressor
+    unsigned long       nextAppend;  // Next job expected by the appender
+    unsigned long       window;      // Jobs allowed in flight ahead of the appender
+    int                 scanners;    // Directory scanner threads of the walk stage
+    int                 walkDone;
+    int                 walkStatus;
+    int                 buildStatus; // First failure of a compressor, 0 if none
+    int                 aborted;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      work;        // New job, window moved, walk done or aborted
+    pthread_cond_t      built;       // Job done, walk done or aborted
+} HCImportPipeline;
+
 /* Internal Helper Functions Export */
-static char *__HCEncodeString(char *pStr);
-static int   __HCDataProcessFromPathW(const char *fPath, const struct stat *fStat,
-    int typeFlag);
-static int __HCLoadFile(const char *path, unsigned long size, unsigned char *buffer);
+static int   __HCDataCollectFromPath(const char *fPath, const struct stat *fStat,
+    void *userData);
+static HCBodyUnit *__HCBodyUnitBuild(HCImportPipeline *pl, HCImportEntry *entry, int *outErr);
+static int   __HCBodyUnitSeal(HCCellWriter *w, HCBodyUnit *unit);
+static void  __HCBodyUnitDestroy(HCBodyUnit **unit);
+static int   __HCPayloadDedup(HCCellWriter *w, HCImportJob *job);
+static void  __HCRelativePath(const char *rootPath, const char *fPath, char *outPath, size_t size);
+static int   __HCFrameCompress(HCCellWriter *w, HCImportJob *job, unsigned char *sourceBuffer,
+    HCCodecContext *ctx);
+static void  __HCImportEntryDestroy(HCImportEntry **entry);
+static int   __HCImportPipelinePush(HCImportPipeline *pl, const char *fPath, const struct stat *fStat);
+static int   __HCImportHoles(HCImportEntry *entry);
+static void  __HCImportPipelineAbort(HCImportPipeline *pl);
+static void  __HCImportBuildFailed(HCImportPipeline *pl, int res);
+static void *__HCWalkerThreadImpl(void *param);
+static void *__HCCompressorThreadImpl(void *param);
+
+/**
+ * @brief start a cell, nothing is written before the first path is added
+ * @param cellfd the cell file, readable as well if payloads are to be shared
+ * @param offset where the cell begins in 'cellfd'
+ * @param workers compressor threads, 0 for one per CPU core
+ * @return the writer, NULL on failure
+ */
+HCCellWriter *HCCellWriterOpen(int cellfd, unsigned long offset, int workers)
+{
+    HCCellWriter *w = NULL;
 
-/* Some important global variables... */
-static unsigned long _BeginOffset = -1;
-static int curFileHandle = -1;
-//static HCDataInfoBlock *curInfoBlock = NULL;
-static char *curRootPath = NULL;
-static int _HCWLocked = 0; // Prevent chaos from multithreading
+    HCAssert(cellfd > -1 && workers >= 0, return NULL);
+    if(!workers) {
+#if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
+        workers = (int)sysconf(_SC_NPROCESSORS_CONF);
+#endif
+        if(workers <= 0) workers = 1;
+    }
 
-static unsigned long long curFsSize = 0L, curRealSize = 0L;
-static unsigned long curBlocks = 0L;
+    HCCalloc(w, 1, sizeof(HCCellWriter), return NULL);
+    w->fd = cellfd;
+    w->beginOffset = offset;
+    w->workers = workers;
+    w->codec = HC_DEFAULT_CODEC;
+    w->codecLevel = HC_DEFAULT_CODEC_LEVEL;
+    w->dedup = 1;
+    w->index = 1;
+    w->meta = 1;
+    w->flags = HC_CELL_CHECKSUMS;
+    if(!(w->inodes = HHashNew(0)) || !(w->payloads = HHashNew(0)) ||
+        HCCellBufferInit(&w->cb, cellfd, offset + HC_INFO_BLOCK_LEN, HC_CELL_BUFFER_SIZE)) {
+        pushdeb("in %s: failed to set up cell writer\n", __func__);
+        HCCellWriterDestroy(&w);
+        return NULL;
+    }
 
-int HCImportPathToCell(int cellfd, const char *path, unsigned long offset, 
-    unsigned long long *outFsSize, unsigned long long *outRealSize, unsigned long *outBlocks)
+    return w;
+}
+
+/**
+ * @brief choose the codec regular files are compressed with
+ * @param w the writer
+ * @param codec HC_CODEC_*, payloads that look compressed already are stored
+ *        whatever is chosen here
+ * @param level codec specific level
+ * @return 0 on success, -1 if the codec is not built in
+ */
+int HCCellWriterSetCodec(HCCellWriter *w, int codec, int level)
+{
+    HCAssert(w && HCCodecSupported(codec), return -1);
+    w->codec = codec;
+    w->codecLevel = level;
+
+    return 0;
+}
+
+/**
+ * @brief let regular files with the same content share one payload
+ * @param w the writer
+ * @param enable 0 stores every payload, hard links are kept either way.
+ *        Candidates are compared against the bytes already in the cell, so
+ *        the cell descriptor has to be readable for sharing to happen
+ * @return 0 on success, -1 on bad arguments
+ */
+int HCCellWriterSetDedup(HCCellWriter *w, int enable)
+{
+    HCAssert(w, return -1);
+    w->dedup = enable ? 1 : 0;
+
+    return 0;
+}
+
+/**
+ * @brief whether to end the cell with a central index
+ * @param w the writer
+ * @param enable 0 leaves the index out, readers then have to scan the cell
+ * @return 0 on success, -1 on bad arguments
+ */
+int HCCellWriterSetIndex(HCCellWriter *w, int enable)
 {
-    HCDataInfoBlock *curInfoBlock = NULL;
+    HCAssert(w, return -1);
+    w->index = enable ? 1 : 0;
+
+    return 0;
+}
+
+/**
+ * @brief whether to end the cell with a metadata section
+ * @param w the writer
+ * @param enable 0 leaves the section out, listing the cell then reads every
+ *        block header
+ * @return 0 on success, -1 on bad arguments
+ */
+int HCCellWriterSetMetadata(HCCellWriter *w, int enable)
+{
+    HCAssert(w, return -1);
+    w->meta = enable ? 1 : 0;
+
+    return 0;
+}
+
+/**
+ * @brief whether pathnames are obfuscated in the cell, the default
+ * @param w the writer, nothing added to it yet
+ * @param enable 0 stores names as they are, which makes them readable with
+ *        any tool and saves encoding them both ways
+ * @return 0 on success, -1 on bad arguments or once a path was added
+ */
+int HCCellWriterSetObfuscation(HCCellWriter *w, int enable)
+{
+    HCAssert(w && !w->blocks, return -1);
+    if(enable)
+        w->flags &= ~HC_CELL_PLAIN_NAMES;
+    else
+        w->flags |= HC_CELL_PLAIN_NAMES;
+
+    return 0;
+}
+
+/**
+ * @brief whether blocks and frames carry checksums, the default
+ * @param w the writer, nothing added to it yet
+ * @param enable 0 leaves them out, HCCellVerify() then checks the structure
+ *        of the cell only
+ * @return 0 on success, -1 on bad arguments or once a path was added
+ */
+int HCCellWriterSetChecksums(HCCellWriter *w, int enable)
+{
+    HCAssert(w && !w->blocks, return -1);
+    if(enable)
+        w->flags |= HC_CELL_CHECKSUMS;
+    else
+        w->flags &= ~HC_CELL_CHECKSUMS;
+
+    return 0;
+}
+
+/**
+ * @brief whether the cell carries a digest tree of its content
+ * @param w the writer, nothing added to it yet
+ * @param enable 1 hashes every frame with SHA-256 on the compressors and
+ *        puts the root of the tree in the InfoBlock, so that files can be
+ *        authenticated one by one. Off by default, hashing costs about as
+ *        much CPU time as compressing
+ * @return 0 on success, -1 on bad arguments or once a path was added, -2
+ *         out of memory
+ */
+int HCCellWriterSetDigests(HCCellWriter *w, int enable)
+{
+    unsigned char *zeros = NULL;
+
+    HCAssert(w && !w->blocks, return -1);
+    if(!enable) {
+        HCTreeFree(&w->tree);
+        return 0;
+    }
+    if(!w->tree) {
+        HCCalloc(zeros, 1, HC_FRAME_SIZE, return -2);
+        HCCalloc(w->tree, 1, sizeof(HCTree), free(zeros); return -2);
+        HCTreeLeaf(zeros, HC_FRAME_SIZE, w->zeroLeaf);
+        free(zeros);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief append a directory tree or a single file to the cell
+ * @param w the writer
+ * @param path the tree, pathnames in the cell are relative to it
+ * @return 0 on success, otherwise are failed. After a failure from 4 on, or
+ *         any failure once part of the path was appended, the cell cannot be
+ *         finished any more
+ */
+int HCCellWriterAddPath(HCCellWriter *w, const char *path)
+{
+    HCImportPipeline *pl = NULL;
+    HCImportEntry *entry = NULL;
+    HCImportJob *job = NULL;
+    pthread_t walker, compressors[w && w->workers > 0 ? w->workers : 1];
+    int i, started = 0, walkerStarted = 0;
+    unsigned long j;
     struct stat st;
     int res = 0;
 
-    HCAssert(cellfd > -1 && path && !_HCWLocked, _HCWLocked = 0; return -1);
+    HCAssert(w && path && !w->failed, return -1);
     if(lstat(path, &st)) {
         pushdeb("in %s: cannot stat source directory\n", __func__);
-        res = 2; /* Failed to stat */
-        goto __HCIPTC_FAILED;
+        return 2; /* Failed to stat */
     }
-
-    /* Initialise all internal variables */
-    _BeginOffset = offset;
-    curFileHandle = cellfd;
-    curRootPath = path;
-    curFsSize = 0; curRealSize = 0; curBlocks = 0;
-    _HCWLocked = 1;
-
     if(S_ISLNK(st.st_mode)) {
         pushdeb("in %s: argument \'path\' is a symbolic link which is not supported\n", __func__);
-        res = 3; /* Type not expected */
+        return 3; /* Type not expected */
+    }
+    if(!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+        return 0;
+
+    HCCalloc(pl, 1, sizeof(HCImportPipeline), return 5);
+    pl->writer = w;
+    pl->rootPath = path;
+    pl->window = (unsigned long)w->workers * HC_IMPORT_WINDOW_FACTOR;
+    pl->scanners = w->workers < HC_IMPORT_MAX_SCANNERS ? w->workers : HC_IMPORT_MAX_SCANNERS;
+    pthread_mutex_init(&pl->mutex, NULL);
+    pthread_cond_init(&pl->work, NULL);
+    pthread_cond_init(&pl->built, NULL);
+
+    /* Stage 1: walk and stat the tree */
+    if(pthread_create(&walker, NULL, __HCWalkerThreadImpl, pl)) {
+        pushdeb("in %s: failed to start walker thread\n", __func__);
+        res = 6;
         goto __HCIPTC_FAILED;
+    }
+    walkerStarted = 1;
 
-    } else if(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) {
-        lseek(curFileHandle, offset + sizeof(HCDataInfoBlock), SEEK_SET);
-        if(S_ISDIR(st.st_mode))
-            res = ftw(path, __HCDataProcessFromPathW, 4096);
-        else
-            res = __HCDataProcessFromPathW(path, &st, 0);
-        if(res) {
-            pushdeb("in %s: failed to scan the path\n", __func__);
+    /* Stage 2: compress frames on all workers */
+    for(started = 0; started < w->workers; started++)
+        if(pthread_create(&compressors[started], NULL, __HCCompressorThreadImpl, pl)) {
+            pushdeb("in %s: failed to start compressor thread\n", __func__);
+            __HCImportPipelineAbort(pl);
+            res = 6;
             goto __HCIPTC_FAILED;
         }
 
-        HCCalloc(curInfoBlock, 1, sizeof(HCDataInfoBlock), res = 5; goto __HCIPTC_FAILED);
-        curInfoBlock->fsSize = curFsSize;
-        curInfoBlock->realSize = curRealSize;
-        curInfoBlock->blocks = curBlocks;
+    /* Stage 3: append frames in walk order, so the cell layout is deterministic */
+    while(1) {
+        pthread_mutex_lock(&pl->mutex);
+        while(!pl->aborted && (pl->nextAppend >= pl->count ? !pl->walkDone :
+            !pl->jobs[pl->nextAppend]->status))
+            pthread_cond_wait(&pl->built, &pl->mutex);
+        if(pl->aborted || pl->nextAppend >= pl->count) {
+            pthread_mutex_unlock(&pl->mutex);
+            break;
+        }
+        job = pl->jobs[pl->nextAppend++];
+        pthread_cond_broadcast(&pl->work);
+        pthread_mutex_unlock(&pl->mutex);
 
-        /* Seek back to the original position and write info block */
-        lseek(curFileHandle, _BeginOffset, SEEK_SET);
-        if(HCWriteFileX(curFileHandle, curInfoBlock, sizeof(HCDataInfoBlock))) {
-            pushdeb("in %s: failed to write info block\n", __func__);
-            free(curInfoBlock);
-            goto __HCIPTC_FAILED;
+        entry = job->entry;
+        if(!job->frame) {
+            if(entry->frames == 1) {
+                /* Small file, the header can be complete right away */
+                entry->unit->property->frameTable[0] = job->dataLen;
+                if(entry->unit->property->frameSums)
+                    entry->unit->property->frameSums[0] = job->sum;
+                entry->unit->property->fSize1 = job->dataLen;
+                entry->unit->dataLen = job->dataLen;
+                /* A file that is one hole has nothing to share */
+                if(w->dedup && job->dataLen)
+                    __HCPayloadDedup(w, job);
+            }
+            if(entry->frames > 1) {
+                /* Kept so the seal does not need to read it back */
+                entry->unit->headerOffset = HCCellBufferTell(&w->cb);
+                if(!(entry->unit->header = malloc(HC_BLOCK_HEADER_LEN + entry->unit->blockLen)))
+                    res = -2;
+                else if(!(res = HCBlockEncode(entry->unit->header, entry->unit->property, w->flags,
+                    entry->unit->blockLen, entry->unit->dataLen)))
+                    res = HCCellBufferAppend(&w->cb, entry->unit->header,
+                        HC_BLOCK_HEADER_LEN + entry->unit->blockLen);
+            } else
+                res = HCBlockSerialize(&w->cb, entry->unit->property, w->flags, entry->unit->blockLen,
+                    entry->unit->dataLen, &entry->unit->headerOffset);
+        }
+        if(!res && job->frame < entry->frames) {
+            if(!entry->unit->property->dataRef && job->dataLen)
+                res = HCCellBufferAppend(&w->cb, job->data, job->dataLen);
+            if(entry->unit->leaves)
+                memcpy(entry->unit->leaves + job->frame * HC_SHA256_LEN, job->digest, HC_SHA256_LEN);
+            entry->unit->property->frameTable[job->frame] = job->dataLen;
+            if(entry->unit->property->frameSums)
+                entry->unit->property->frameSums[job->frame] = job->sum;
+            if(entry->frames > 1)
+                entry->unit->dataLen += job->dataLen;
+        }
+        free(job->data);
+        job->data = NULL;
+        if(!res && job->last) {
+            res = __HCBodyUnitSeal(w, entry->unit);
+            __HCImportEntryDestroy(&job->entry);
+        }
+        if(res) {
+            pushdeb("in %s: failed to append body unit, I/O error\n", __func__);
+            __HCImportPipelineAbort(pl);
+            res = 4;
+            break;
         }
-        if(*outFsSize) *outFsSize = curFsSize;
-        if(*outRealSize) *outRealSize = curRealSize;
-        if(*outBlocks) *outBlocks = curBlocks;
     }
 
 __HCIPTC_FAILED:
-    _HCWLocked = 0;
+    if(walkerStarted) pthread_join(walker, NULL);
+    for(i = 0; i < started; i++)
+        pthread_join(compressors[i], NULL);
+    if(!res && pl->aborted && pl->buildStatus) {
+        pushdeb("in %s: failed to build a body unit (%d)\n", __func__, pl->buildStatus);
+        res = 8;
+    } else if(!res && pl->aborted) {
+        pushdeb("in %s: failed to scan the path\n", __func__);
+        res = pl->walkStatus ? pl->walkStatus : 7;
+    }
+    /* A scan may fail after part of the tree went out, the walker codes
+       are negative but leave the cell just as unfinished */
+    if(res >= 4 || (res && pl->nextAppend))
+        w->failed = 1;
+
+    for(j = 0; j < pl->count; j++) {
+        if(pl->jobs[j]->last)
+            __HCImportEntryDestroy(&pl->jobs[j]->entry);
+        free(pl->jobs[j]->data);
+        free(pl->jobs[j]);
+    }
+    free(pl->jobs);
+    pthread_mutex_destroy(&pl->mutex);
+    pthread_cond_destroy(&pl->work);
+    pthread_cond_destroy(&pl->built);
+    free(pl);
+    return res;
+}
+
+/**
+ * @brief write the InfoBlock and release the writer
+ * @param pw the writer, always released and set to NULL
+ * @param outFsSize receives the size of the cell, may be NULL
+ * @param outRealSize receives the size of the content, may be NULL
+ * @param outBlocks receives the count of body units, may be NULL
+ * @return 0 on success, 4 on I/O error, 8 if adding a path failed earlier
+ */
+int HCCellWriterFinish(HCCellWriter **pw, unsigned long long *outFsSize,
+    unsigned long long *outRealSize, unsigned long *outBlocks)
+{
+    HCCellWriter *w = NULL;
+    HCDataInfoBlock infoBlock;
+    unsigned char infoBuf[HC_INFO_BLOCK_LEN];
+    off_t indexOffset = 0, metaOffset = 0, treeOffset = 0;
+    unsigned long long metaLen = 0;
+    unsigned char root[HC_SHA256_LEN];
+    int res = 0;
+
+    HCAssert(pw && *pw, return -1);
+    w = *pw;
+    if(w->failed) {
+        pushdeb("in %s: the cell is incomplete\n", __func__);
+        res = 8;
+        goto __HCCWF_CLEANUP;
+    }
+    if(w->index) {
+        /* Counted in fsSize, so that nothing is put over it */
+        indexOffset = HCCellBufferTell(&w->cb);
+        if(HCIndexSerialize(&w->cb, w->entries, w->blocks)) {
+            pushdeb("in %s: failed to write index, I/O error\n", __func__);
+            res = 4;
+            goto __HCCWF_CLEANUP;
+        }
+        w->fsSize += HCCellBufferTell(&w->cb) - indexOffset;
+    }
+    if(w->meta) {
+        metaOffset = HCCellBufferTell(&w->cb);
+        if(HCMetaSerialize(&w->cb, w->rows, w->blocks, w->flags)) {
+            pushdeb("in %s: failed to write metadata, I/O error\n", __func__);
+            res = 4;
+            goto __HCCWF_CLEANUP;
+        }
+        metaLen = HCCellBufferTell(&w->cb) - metaOffset;
+        w->fsSize += metaLen;
+    }
+    if(w->tree) {
+        treeOffset = HCCellBufferTell(&w->cb);
+        if(HCTreeSerialize(&w->cb, w->tree, root)) {
+            pushdeb("in %s: failed to write digest tree, I/O error\n", __func__);
+            res = 4;
+            goto __HCCWF_CLEANUP;
+        }
+        w->fsSize += HCCellBufferTell(&w->cb) - treeOffset;
+    }
+    if(HCCellBufferFlush(&w->cb)) {
+        pushdeb("in %s: failed to flush cell writer, I/O error\n", __func__);
+        res = 4;
+        goto __HCCWF_CLEANUP;
+    }
+
+    memset(&infoBlock, 0, sizeof(HCDataInfoBlock));
+    infoBlock.fsSize = w->fsSize;
+    infoBlock.realSize = w->realSize;
+    infoBlock.blocks = w->blocks;
+    infoBlock.codecs = w->codecs;
+    infoBlock.flags = w->flags;
+    infoBlock.index = indexOffset ? indexOffset - w->beginOffset : 0;
+    if(metaOffset) {
+        infoBlock.meta = metaOffset - w->beginOffset;
+        infoBlock.metaLen = metaLen;
+    }
+    if(treeOffset) {
+        infoBlock.tree = treeOffset - w->beginOffset;
+        infoBlock.treeLen = HCCellBufferTell(&w->cb) - treeOffset;
+        memcpy(infoBlock.root, root, HC_SHA256_LEN);
+    }
+    HCInfoBlockSerialize(&infoBlock, infoBuf);
+    if(HCPWriteFileX(w->fd, infoBuf, HC_INFO_BLOCK_LEN, w->beginOffset)) {
+        pushdeb("in %s: failed to write info block\n", __func__);
+        res = 4;
+        goto __HCCWF_CLEANUP;
+    }
+    if(outFsSize) *outFsSize = w->fsSize;
+    if(outRealSize) *outRealSize = w->realSize;
+    if(outBlocks) *outBlocks = w->blocks;
+
+__HCCWF_CLEANUP:
+    HCCellWriterDestroy(pw);
     return res;
 }
 
-static int __HCLoadFile(const char *path, unsigned long size, unsigned char *buffer)
+/**
+ * @brief release a writer without finishing the cell
+ * @param pw the writer, set to NULL
+ */
+void HCCellWriterDestroy(HCCellWriter **pw)
+{
+    HCCellWriter *w = *pw;
+    unsigned long i;
+
+    if(*pw) {
+        HCCellBufferDestroy(&w->cb);
+        HHashDestroy(&w->inodes);
+        HHashDestroy(&w->payloads);
+        if(w->entries) free(w->entries);
+        for(i = 0; w->rows && i < w->blocks; i++)
+            free(w->rows[i].path);
+        if(w->rows) free(w->rows);
+        HCTreeFree(&w->tree);
+        free(*pw);
+        *pw = NULL;
+    }
+}
+
+int HCImportPathToCell(int cellfd, const char *path, unsigned long offset, 
+    unsigned long long *outFsSize, unsigned long long *outRealSize, unsigned long *outBlocks)
+{
+    return HCImportPathToCellEx(cellfd, path, offset, 0, outFsSize, outRealSize, outBlocks);
+}
+
+int HCImportPathToCellEx(int cellfd, const char *path, unsigned long offset, int workers,
+    unsigned long long *outFsSize, unsigned long long *outRealSize, unsigned long *outBlocks)
+{
+    HCCellWriter *w = NULL;
+    int res = 0;
+
+    HCAssert(cellfd > -1 && path && workers >= 0, return -1);
+    if(!(w = HCCellWriterOpen(cellfd, offset, workers)))
+        return 5;
+    if((res = HCCellWriterAddPath(w, path))) {
+        HCCellWriterDestroy(&w);
+        return res;
+    }
+
+    return HCCellWriterFinish(&w, outFsSize, outRealSize, outBlocks);
+}
+
+static void *__HCWalkerThreadImpl(void *param)
+{
+    HCImportPipeline *pl = (HCImportPipeline *)param;
+    int res = 0;
+
+    /* Entries come in sorted order whatever the number of scanners */
+    res = HCScanTree(pl->rootPath, pl->scanners, __HCDataCollectFromPath, pl);
+
+    pthread_mutex_lock(&pl->mutex);
+    pl->walkDone = 1;
+    if(res && !pl->aborted) {
+        pl->walkStatus = res;
+        pl->aborted = 1;
+    }
+    pthread_cond_broadcast(&pl->work);
+    pthread_cond_broadcast(&pl->built);
+    pthread_mutex_unlock(&pl->mutex);
+
+    pthread_exit(NULL);
+}
+
+static void *__HCCompressorThreadImpl(void *param)
+{
+    HCImportPipeline *pl = (HCImportPipeline *)param;
+    HCImportJob *job = NULL;
+    unsigned char *sourceBuffer = NULL;
+    HCCodecContext *ctx = NULL;
+    int res = 0;
+
+    /* One frame worth of input and one codec context, reused for every job
+       of this thread */
+    HCCalloc(sourceBuffer, 1, HC_FRAME_SIZE, __HCImportBuildFailed(pl, -2); pthread_exit(NULL));
+    if(!(ctx = HCCodecContextNew())) {
+        free(sourceBuffer);
+        __HCImportBuildFailed(pl, -2);
+        pthread_exit(NULL);
+    }
+
+    while(1) {
+        pthread_mutex_lock(&pl->mutex);
+        while(!pl->aborted && (pl->nextJob >= pl->count ? !pl->walkDone :
+            pl->nextJob >= pl->nextAppend + pl->window))
+            pthread_cond_wait(&pl->work, &pl->mutex);
+        if(pl->aborted || pl->nextJob >= pl->count) {
+            pthread_mutex_unlock(&pl->mutex);
+            break;
+        }
+        job = pl->jobs[pl->nextJob++];
+        pthread_mutex_unlock(&pl->mutex);
+
+        /* The heavy part runs unlocked */
+        res = 0;
+        if(!job->frame && !(job->entry->unit = __HCBodyUnitBuild(pl, job->entry, &res)))
+            res = res < 0 ? res : -1;
+        if(!res && job->frame < job->entry->frames)
+            res = __HCFrameCompress(pl->writer, job, sourceBuffer, ctx);
+        if(!res && pl->writer->dedup && job->entry->frames == 1)
+            job->hash = ((unsigned long long)crc32(0L, job->data, job->dataLen) << 32) |
+                adler32(1L, job->data, job->dataLen);
+
+        pthread_mutex_lock(&pl->mutex);
+        job->status = res ? res : 1;
+        if(res) {
+            pushdeb("compressor: failed to build \'%s\' (%d)\n", job->entry->path, res);
+            if(!pl->aborted)
+                pl->buildStatus = res;
+            pl->aborted = 1;
+            pthread_cond_broadcast(&pl->work);
+        }
+        pthread_cond_broadcast(&pl->built);
+        pthread_mutex_unlock(&pl->mutex);
+    }
+
+    HCCodecContextDestroy(&ctx);
+    free(sourceBuffer);
+    pthread_exit(NULL);
+}
+
+static void __HCImportPipelineAbort(HCImportPipeline *pl)
+{
+    pthread_mutex_lock(&pl->mutex);
+    pl->aborted = 1;
+    pthread_cond_broadcast(&pl->work);
+    pthread_cond_broadcast(&pl->built);
+    pthread_mutex_unlock(&pl->mutex);
+}
+
+/* Aborts on behalf of a compressor, 'res' is kept unless something else
+   failed first */
+static void __HCImportBuildFailed(HCImportPipeline *pl, int res)
 {
-    FILE *fp = NULL;
-    unsigned long sizeRead = 0L;
+    pthread_mutex_lock(&pl->mutex);
+    if(!pl->aborted)
+        pl->buildStatus = res;
+    pl->aborted = 1;
+    pthread_cond_broadcast(&pl->work);
+    pthread_cond_broadcast(&pl->built);
+    pthread_mutex_unlock(&pl->mutex);
+}
+
+static int __HCImportPipelinePush(HCImportPipeline *pl, const char *fPath, const struct stat *fStat)
+{
+    HCImportEntry *entry = NULL;
+    HCImportJob **tJobs = NULL;
+    unsigned long i, njobs, capacity;
+    char *target = NULL;
 
-    if(!(fp = fopen(path, "rb")) || !size) return -1;
-    if((sizeRead = fread(buffer, 1, size, fp)) != size) {
-        fclose(fp);
+    HCCalloc(entry, 1, sizeof(HCImportEntry), return -2);
+    if(!(entry->path = strdup(fPath))) {
+        free(entry);
         return -2;
     }
+    memcpy(&entry->st, fStat, sizeof(struct stat));
+    if(S_ISREG(fStat->st_mode))
+        entry->frames = (fStat->st_size + HC_FRAME_SIZE - 1) / HC_FRAME_SIZE;
+    if(S_ISREG(fStat->st_mode) && fStat->st_nlink > 1) {
+        /* The first path of an inode carries the payload and the others link
+           to it. Paths come in sorted order, so the choice is stable */
+        if((target = HHashFind(pl->writer->inodes, fStat->st_dev, fStat->st_ino))) {
+            if(!(entry->linkTarget = strdup(target))) {
+                __HCImportEntryDestroy(&entry);
+                return -2;
+            }
+            entry->frames = 0;
+        } else if((target = malloc(1024))) {
+            __HCRelativePath(pl->rootPath, fPath, target, 1024);
+            if(HHashInsert(pl->writer->inodes, fStat->st_dev, fStat->st_ino, target))
+                free(target);
+        }
+    }
+    /* Fewer blocks than bytes, the file has holes somewhere */
+    if(entry->frames && (unsigned long long)fStat->st_blocks * 512 < (unsigned long long)fStat->st_size &&
+        __HCImportHoles(entry)) {
+        __HCImportEntryDestroy(&entry);
+        return -2;
+    }
+    njobs = entry->frames ? entry->frames : 1;
+
+    pthread_mutex_lock(&pl->mutex);
+    if(pl->aborted) {
+        pthread_mutex_unlock(&pl->mutex);
+        __HCImportEntryDestroy(&entry);
+        return -1;
+    }
+    if(pl->count + njobs > pl->capacity) {
+        /* Only the pointer array moves, jobs stay where workers see them */
+        for(capacity = pl->capacity ? pl->capacity : 256; capacity < pl->count + njobs; capacity *= 2);
+        if(!(tJobs = realloc(pl->jobs, capacity * sizeof(HCImportJob *)))) {
+            pthread_mutex_unlock(&pl->mutex);
+            __HCImportEntryDestroy(&entry);
+            return -2;
+        }
+        pl->jobs = tJobs;
+        pl->capacity = capacity;
+    }
+    for(i = 0; i < njobs; i++) {
+        HCCalloc(pl->jobs[pl->count + i], 1, sizeof(HCImportJob),
+            while(i--) free(pl->jobs[pl->count + i]);
+            pthread_mutex_unlock(&pl->mutex);
+            __HCImportEntryDestroy(&entry);
+            return -2);
+        pl->jobs[pl->count + i]->entry = entry;
+        pl->jobs[pl->count + i]->frame = i;
+        pl->jobs[pl->count + i]->last = (i == njobs - 1);
+    }
+    pl->count += njobs;
+    pthread_cond_broadcast(&pl->work);
+    pthread_mutex_unlock(&pl->mutex);
 
     return 0;
 }
 
-/* Before calling this function, make sure we have correct offset for infoblock */
-static int __HCDataProcessFromPathW(const char *fPath, const struct stat *fStat,
-    int typeFlag)
+static int __HCDataCollectFromPath(const char *fPath, const struct stat *fStat,
+    void *userData)
 {
-    HCblockProperty *tProperty = NULL;
-    mode_t fMode = fStat->st_mode;
-    unsigned long _BlockLen = 0;
-    unsigned long long _DataLen = 0;
-    int _RtcCounter = 0;
-    unsigned char *tempBuffer = NULL;
+    return __HCImportPipelinePush((HCImportPipeline *)userData, fPath, fStat);
+}
 
-    HCAssert(_BeginOffset > -1 && curFileHandle > -1 && curInfoBlock && curRootPath, return -1);
-    HCCalloc(tProperty, 1, sizeof(HCBlockProperty), return -2); // Memory failure
-    //tProperty->begin = BID_PROP_BEGIN;
+static void __HCImportEntryDestroy(HCImportEntry **entry)
+{
+    HCImportEntry *p = *entry;
+
+    if(*entry) {
+        __HCBodyUnitDestroy(&p->unit);
+        if(p->path) free(p->path);
+        if(p->linkTarget) free(p->linkTarget);
+        if(p->holeTable) free(p->holeTable);
+        free(*entry);
+        *entry = NULL;
+    }
+}
 
-    if(curRootPath[strlen(curRootPath)] != '/')
-        snprintf(tProperty->pathName, 1024, "%s", fPath + strlen(curRootPath) + 1);
+/* Lists the holes of a sparse file. A file the system cannot tell about is
+   stored as if it had none, only running out of memory is an error */
+static int __HCImportHoles(HCImportEntry *entry)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    unsigned long long *tTable = NULL;
+    unsigned int capacity = 0;
+    off_t hole = 0, data = 0;
+    int fd = -1;
+
+    if((fd = open(entry->path, O_RDONLY)) == -1)
+        return 0;
+    while(entry->holes < HC_IMPORT_MAX_HOLES &&
+        (hole = lseek(fd, data, SEEK_HOLE)) != (off_t)-1 && hole < entry->st.st_size) {
+        /* No data past the hole means it runs to the end of the file */
+        if((data = lseek(fd, hole, SEEK_DATA)) == (off_t)-1 || data > entry->st.st_size)
+            data = entry->st.st_size;
+        if(entry->holes == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            if(!(tTable = realloc(entry->holeTable, capacity * 2 * sizeof(unsigned long long)))) {
+                close(fd);
+                return -2;
+            }
+            entry->holeTable = tTable;
+        }
+        entry->holeTable[2 * entry->holes] = hole;
+        entry->holeTable[2 * entry->holes + 1] = data - hole;
+        entry->holes++;
+    }
+    close(fd);
+#elif defined(LINUX)
+#error "SEEK_DATA and SEEK_HOLE are missing, sparse files would be stored in full"
+#else
+    (void)entry;
+#endif
+
+    return 0;
+}
+
+/* Compresses one frame of a regular file, memory use does not depend on the
+   size of the file. Large frames are compressed straight from a read-only
+   mapping, small ones are read into the buffer of the calling thread */
+static int __HCFrameCompress(HCCellWriter *w, HCImportJob *job, unsigned char *sourceBuffer,
+    HCCodecContext *ctx)
+{
+    HCImportEntry *entry = job->entry;
+    off_t frameOffset = (off_t)job->frame * HC_FRAME_SIZE;
+    unsigned long SourceLen = entry->st.st_size - frameOffset;
+    unsigned long CompressedLen = 0L;
+    unsigned long long holeEnd = 0LL;
+    const unsigned char *source = sourceBuffer;
+    void *map = MAP_FAILED;
+    unsigned char head[8];
+    struct stat st;
+    int fd = -1, zRes = 0, codec = w->codec, res = 0;
+
+    if(SourceLen > HC_FRAME_SIZE)
+        SourceLen = HC_FRAME_SIZE;
+    /* Nothing to read in a hole, the frame is left out of the payload */
+    if(entry->holes && HCBlockHoleAt(entry->holeTable, entry->holes, frameOffset, &holeEnd) &&
+        holeEnd >= frameOffset + SourceLen) {
+        if(!job->frame)
+            entry->unit->property->codec = codec;
+        if(w->tree && SourceLen == HC_FRAME_SIZE)
+            memcpy(job->digest, w->zeroLeaf, HC_SHA256_LEN);
+        else if(w->tree) {
+            memset(sourceBuffer, 0, SourceLen);
+            HCTreeLeaf(sourceBuffer, SourceLen, job->digest);
+        }
+        job->dataLen = 0;
+        return 0;
+    }
+    if((fd = open(entry->path, O_RDONLY)) == -1) {
+        pushdeb("in %s: failed to open \'%s\'\n", __func__, entry->path);
+        return -4;
+    }
+    if(SourceLen >= HC_IMPORT_MMAP_THRESHOLD) {
+        /* A mapping past the end of a file that shrank would fault on access */
+        if(fstat(fd, &st) || st.st_size < frameOffset + (off_t)SourceLen) {
+            pushdeb("in %s: \'%s\' changed while importing\n", __func__, entry->path);
+            close(fd);
+            return -4;
+        }
+        /* Frames are a multiple of the page size, so is frameOffset */
+        if((map = mmap(NULL, SourceLen, PROT_READ, MAP_PRIVATE, fd, frameOffset)) != MAP_FAILED) {
+#if defined(LINUX) || defined(FREEBSD) || defined(PATRON) || defined(DARWIN)
+            madvise(map, SourceLen, MADV_SEQUENTIAL);
+            madvise(map, SourceLen, MADV_WILLNEED);
+#endif
+            source = map;
+        }
+    }
+#if defined(LINUX) || defined(FREEBSD)
+    /* The next frame goes to another compressor soon, start reading it now */
+    if(!job->last)
+        posix_fadvise(fd, frameOffset + HC_FRAME_SIZE, HC_FRAME_SIZE, POSIX_FADV_WILLNEED);
+#endif
+    if((map == MAP_FAILED && pread(fd, sourceBuffer, SourceLen, frameOffset) != (ssize_t)SourceLen) ||
+        (job->frame && pread(fd, head, sizeof(head), 0) <= 0)) {
+        pushdeb("in %s: failed to read \'%s\'\n", __func__, entry->path);
+        res = -4;
+        goto __HCFC_CLEANUP;
+    }
+
+    /* Every frame looks at the head of the file, so they all agree on the codec */
+    if(job->frame ? HCCodecLooksCompressed(head, sizeof(head)) :
+        HCCodecLooksCompressed(source, SourceLen < sizeof(head) ? SourceLen : sizeof(head)))
+        codec = HC_CODEC_STORE;
+    if(!job->frame)
+        entry->unit->property->codec = codec;
+    if(w->tree)
+        HCTreeLeaf(source, SourceLen, job->digest);
+
+    /* Predict how many memory we need */
+    CompressedLen = HCCodecBound(codec, SourceLen);
+    HCCalloc(job->data, 1, CompressedLen,
+        pushdeb("in %s: failed to allocate memory\n", __func__);
+        res = -2;
+        goto __HCFC_CLEANUP);
+    if(codec != HC_CODEC_STORE && HCCodecWorthCompressing(ctx, source, SourceLen))
+        zRes = HCCodecCompress(ctx, codec, w->codecLevel, job->data, &CompressedLen, source, SourceLen);
     else
-        snprintf(tProperty->pathName, 1024, "%s", fPath + strlen(curRootPath));
+        CompressedLen = SourceLen;
+    if(zRes) {
+        pushdeb("in %s: Failed to compress data, compressor returned 0x%8x\n", __func__, zRes);
+        free(job->data);
+        job->data = NULL;
+        res = -3;
+        goto __HCFC_CLEANUP;
+    }
+    if(CompressedLen >= SourceLen) {
+        /* Did not shrink, keep the frame as is. The reader tells from its length */
+        memcpy(job->data, source, SourceLen);
+        CompressedLen = SourceLen;
+    }
+    job->dataLen = CompressedLen;
+    /* Here, so that it runs on every compressor at once */
+    if(w->flags & HC_CELL_CHECKSUMS)
+        job->sum = crc32(0L, job->data, CompressedLen);
+
+__HCFC_CLEANUP:
+    if(map != MAP_FAILED)
+        munmap(map, SourceLen);
+    close(fd);
+    return res;
+}
+
+/* Builds the properties of a body unit, safe to call from any compressor thread */
+static HCBodyUnit *__HCBodyUnitBuild(HCImportPipeline *pl, HCImportEntry *entry, int *outErr)
+{
+    const char *fPath = entry->path;
+    const struct stat *fStat = &entry->st;
+    HCBlockProperty *tProperty = NULL;
+    HCBodyUnit *unit = NULL;
+    mode_t fMode = fStat->st_mode;
+    char *tempBuffer = NULL;
+    size_t rootLen = 0;
+
+    HCAssert(pl->rootPath, *outErr = -1; return NULL);
+    rootLen = strlen(pl->rootPath);
+    HCCalloc(unit, 1, sizeof(HCBodyUnit), *outErr = -2; return NULL);
+    HCCalloc(tProperty, 1, sizeof(HCBlockProperty), free(unit); *outErr = -2; return NULL);
+    unit->property = tProperty;
+
+    __HCRelativePath(pl->rootPath, fPath, (char *)tProperty->pathName, 1024);
     tProperty->fMode = fMode & 0777;
     tProperty->fUID = fStat->st_uid;
     tProperty->fGID = fStat->st_gid;
     tProperty->fSize2 = fStat->st_size;
 
-    if(S_ISREG(fMode)) {
+    if(entry->linkTarget) {
+        /* Another path of an inode which is in the cell already */
+        tProperty->fType = BLK_HARDLINK;
+        tProperty->fSize2 = 0;
+        snprintf((char *)tProperty->linkName, 1024, "%s", entry->linkTarget);
+
+    } else if(S_ISREG(fMode)) {
         tProperty->fType = BLK_REG;
-        {
-            unsigned long long SourceLen = fStat->st_size;
-            unsigned long      CompressedLen = 0L;
-            unsigned char *_SourceBuffer = calloc(1, SourceLen),
-                           _CompressBuffer = NULL;
-            if(!_SourceBuffer) {
+        tProperty->frameSize = HC_FRAME_SIZE;
+        tProperty->frames = entry->frames;
+        if(entry->frames)
+            HCCalloc(tProperty->frameTable, entry->frames, sizeof(unsigned int),
                 pushdeb("in %s: failed to allocate memory\n", __func__);
-                free(tProperty);
-                return -2;
-            }
-            /* Predict how many memory we need */
-            CompressedLen = compressBound(SourceLen);
-            HCCalloc(_CompressBuffer, 1, CompressedLen,
+                __HCBodyUnitDestroy(&unit);
+                *outErr = -2;
+                return NULL);
+        if(entry->frames && (pl->writer->flags & HC_CELL_CHECKSUMS))
+            HCCalloc(tProperty->frameSums, entry->frames, sizeof(unsigned int),
+                pushdeb("in %s: failed to allocate memory\n", __func__);
+                __HCBodyUnitDestroy(&unit);
+                *outErr = -2;
+                return NULL);
+        if(entry->frames && pl->writer->tree)
+            HCCalloc(unit->leaves, entry->frames, HC_SHA256_LEN,
                 pushdeb("in %s: failed to allocate memory\n", __func__);
-                free(tProperty);
-                free(_SourceBuffer);
-                return -2);
-            int zRes = compress2(_CompressBuffer, &CompressedLen, _SourceBuffer, SourceLen, 9);
-            if(zRes) {
-                pushdeb("in %s: Failed to compress data, compressor returned 0x%8x\n", zRes);
-                free(tProperty);
-                free(_SourceBuffer);
-                return -3;
+                __HCBodyUnitDestroy(&unit);
+                *outErr = -2;
+                return NULL);
+        if(entry->holes) {
+            if(!(tProperty->holeTable = HCMemdup(entry->holeTable, 2 * sizeof(unsigned long long) * entry->holes))) {
+                pushdeb("in %s: failed to allocate memory\n", __func__);
+                __HCBodyUnitDestroy(&unit);
+                *outErr = -2;
+                return NULL;
             }
-            tProperty->fSize1 = CompressedLen;
-
-            /* Calculate BLKLEN and DATLEN */
-            _BlockLen = sizeof(short) + sizeof(int) + sizeof(short) + // BID_TYPE
-                        sizeof(short) + sizeof(int) + sizeof(unsigned long) + // BID_INCELL
-                        sizeof(short) + sizeof(int) + sizeof(unsigned long long) + //BID_ORIGINAL
-                        sizeof(short) + sizeof(int) + sizeof(char) * strlen(tProperty->pathName) + //BID_PATHNAME
-                        //sizeof(short) + sizeof(int) + sizeof(short) + //BID_LINKNAME
-                        sizeof(short) + sizeof(int) + sizeof(mode_t) + //BID_MODE
-                        sizeof(short) + sizeof(int) + sizeof(uid_t) + //BID_UID
-                        sizeof(short) + sizeof(int) + sizeof(gid_t); //BID_GID
-                        //sizeof(short) + sizeof(int) + sizeof(short) + //BID_DEV1
-                        //sizeof(short) + sizeof(int) + sizeof(short);  //BID_DEV2
-            _DataLen = CompressedLen;
-
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_BEGIN, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (void *)&_BlockLen, sizeof(unsigned long));
-            _RtcCounter += HCWriteFileX(curFileHandle, (void *)&_DataLen, sizeof(unsigned long long));
-
-            /* BID_INCELL */
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_SIZE_INCELL, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(unsigned long), sizeof(int));
-            _RtcCounter += HCWriteFileX(curFileHandle, tProperty->fSize1, sizeof(unsigned long)); // CompressedLen
-
-            /* BID_ORIGINAL */
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_SIZE_ORIGINAL, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(unsigned long long), sizeof(int));
-            _RtcCounter += HCWriteFileX(curFileHandle, tProperty->fSize2, sizeof(unsigned long long));
-
-            _RtcCounter += HCWriteFileX(curFileHandle, _CompressBuffer, _DataLen);
-
-            /* Clean up ... */
-            free(_CompressBuffer);
-            free(_SourceBuffer);
+            tProperty->holes = entry->holes;
         }
 
+
     } else if(S_ISDIR(fMode)) {
         tProperty->fType = BLK_DIR;
-        /* Nothing to do, just write */
-        _BlockLen = sizeof(short) + sizeof(int) + sizeof(short) + // BID_TYPE
-                    sizeof(short) + sizeof(int) + sizeof(unsigned long long) + //BID_ORIGINAL
-                    sizeof(short) + sizeof(int) + sizeof(char) * strlen(tProperty->pathName) + //BID_PATHNAME
-                    sizeof(short) + sizeof(int) + sizeof(mode_t) + //BID_MODE
-                    sizeof(short) + sizeof(int) + sizeof(uid_t) + //BID_UID
-                    sizeof(short) + sizeof(int) + sizeof(gid_t); //BID_GID
-        _DataLen = 0;
-
-        {
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_BEGIN, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (void *)&_BlockLen, sizeof(unsigned long));
-            _RtcCounter += HCWriteFileX(curFileHandle, (void *)&_DataLen, sizeof(unsigned long long));
-
-            /* BID_ORIGINAL */
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_SIZE_ORIGINAL, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(unsigned long long), sizeof(int));
-            _RtcCounter += HCWriteFileX(curFileHandle, tProperty->fSize2, sizeof(unsigned long long));
-        }
 
     } else if(S_ISLNK(fMode)) {
         tProperty->fType = BLK_SYMLINK;
         /* Here count symbolic link size as 0 */
-        CALLOC(tempBuffer, 1, 1024, free(tProperty); return -2);
-        if(readlink(fPath, tempBuffer, 1024) < 0) {
+        tProperty->fSize2 = 0;
+        HCCalloc(tempBuffer, 1, 1024, __HCBodyUnitDestroy(&unit); *outErr = -2; return NULL);
+        if(readlink(fPath, tempBuffer, 1023) < 0) {
             pushdeb("in %s: Failed to read link\n", __func__);
-            free(tProperty);
-            return -4;
+            free(tempBuffer);
+            __HCBodyUnitDestroy(&unit);
+            *outErr = -4;
+            return NULL;
         }
-        if(!strncmp(curRootPath, tempBuffer, strlen(curRootPath)))
+        if(!strncmp(pl->rootPath, tempBuffer, rootLen))
             /* We need fix the target to right place */
-            if(curRootPath[strlen(curRootPath)] != '/')
-                snprintf(tProperty->linkName, 1024, "%s", tempBuffer + strlen(curRootPath) + 1);
-            else
-                snprintf(tProperty->linkName, 1024, "%s", tempBuffer + strlen(curRootPath));
+            __HCRelativePath(pl->rootPath, tempBuffer, (char *)tProperty->linkName, 1024);
         else
-            strcpy(tProperty->linkName, tempBuffer);
-
+            strcpy((char *)tProperty->linkName, tempBuffer);
         free(tempBuffer);
-        {
-            _BlockLen = sizeof(short) + sizeof(int) + sizeof(short) + // BID_TYPE
-                        //sizeof(short) + sizeof(int) + sizeof(unsigned long) +
-                        //sizeof(short) + sizeof(int) + sizeof(unsigned long long) +
-                        sizeof(short) + sizeof(int) + sizeof(char) * strlen(tProperty->pathName) + //BID_PATHNAME
-                        sizeof(short) + sizeof(int) + sizeof(char) * strlen(tProperty->linkName) +//BID_LINKNAME
-                        sizeof(short) + sizeof(int) + sizeof(mode_t) + //BID_MODE
-                        sizeof(short) + sizeof(int) + sizeof(uid_t) + //BID_UID
-                        sizeof(short) + sizeof(int) + sizeof(gid_t);  //BID_GID
-                        //sizeof(short) + sizeof(int) + sizeof(short) + //BID_DEV1
-                        //sizeof(short) + sizeof(int) + sizeof(short);  //BID_DEV2
-            _DataLen = 0;
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_BEGIN, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (void *)&_BlockLen, sizeof(unsigned long));
-            _RtcCounter += HCWriteFileX(curFileHandle, (void *)&_DataLen, sizeof(unsigned long long));
-
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_LINKNAME, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (int *)&strlen(tProperty->linkName), sizeof(int));
-            _RtcCounter += HCWriteFileX(curFileHandle, HCCharSwap(tProperty->linkName), strlen(tProperty->linkName));
-        }
 
-    } else if(S_ISCHR(fMode)) {
-        tProperty->fType = BLK_CHARDEV;
-        tProperty->dev1 = major(fStat->st_dev);
-        tProperty->dev2 = minor(fStat->st_dev);
-        {
-            _BlockLen = sizeof(short) + sizeof(int) + sizeof(short) + // BID_TYPE
-                        //sizeof(short) + sizeof(int) + sizeof(unsigned long) + // BID_INCELL
-                        //sizeof(short) + sizeof(int) + sizeof(unsigned long long) + //BID_ORIGINAL
-                        sizeof(short) + sizeof(int) + sizeof(char) * strlen(tProperty->pathName) + //BID_PATHNAME
-                        //sizeof(short) + sizeof(int) + sizeof(short) + //BID_LINKNAME
-                        sizeof(short) + sizeof(int) + sizeof(mode_t) + //BID_MODE
-                        sizeof(short) + sizeof(int) + sizeof(uid_t) + //BID_UID
-                        sizeof(short) + sizeof(int) + sizeof(gid_t) + //BID_GID
-                        sizeof(short) + sizeof(int) + sizeof(unsigned int) + //BID_DEV1
-                        sizeof(short) + sizeof(int) + sizeof(unsigned int);  //BID_DEV2
-            _DataLen = 0;
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_BEGIN, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (void *)&_BlockLen, sizeof(unsigned long));
-            _RtcCounter += HCWriteFileX(curFileHandle, (void *)&_DataLen, sizeof(unsigned long long));
-
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_DEV1, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(unsigned int), sizeof(int));
-            _RtcCounter += HCWriteFileX(curFileHandle, tProperty->dev1, sizeof(unsigned int));
-
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_DEV2, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(unsigned int), sizeof(int));
-            _RtcCounter += HCWriteFileX(curFileHandle, tProperty->dev2, sizeof(unsigned int));
-        }
 
-    } else if(S_ISBLK(fMode)) {
-        tProperty->fType = BLK_BLOCKDEV;
-        tProperty->dev1 = major(fStat->st_dev);
-        tProperty->dev2 = minor(fStat->st_dev);
-        {
-            _BlockLen = sizeof(short) + sizeof(int) + sizeof(short) + // BID_TYPE
-                        //sizeof(short) + sizeof(int) + sizeof(unsigned long) + // BID_INCELL
-                        //sizeof(short) + sizeof(int) + sizeof(unsigned long long) + //BID_ORIGINAL
-                        sizeof(short) + sizeof(int) + sizeof(char) * strlen(tProperty->pathName) + //BID_PATHNAME
-                        //sizeof(short) + sizeof(int) + sizeof(short) + //BID_LINKNAME
-                        sizeof(short) + sizeof(int) + sizeof(mode_t) + //BID_MODE
-                        sizeof(short) + sizeof(int) + sizeof(uid_t) + //BID_UID
-                        sizeof(short) + sizeof(int) + sizeof(gid_t) + //BID_GID
-                        sizeof(short) + sizeof(int) + sizeof(unsigned int) + //BID_DEV1
-                        sizeof(short) + sizeof(int) + sizeof(unsigned int);  //BID_DEV2
-            _DataLen = 0;
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_BEGIN, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (void *)&_BlockLen, sizeof(unsigned long));
-            _RtcCounter += HCWriteFileX(curFileHandle, (void *)&_DataLen, sizeof(unsigned long long));
-
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_DEV1, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(unsigned int), sizeof(int));
-            _RtcCounter += HCWriteFileX(curFileHandle, tProperty->dev1, sizeof(unsigned int));
-
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_DEV2, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(unsigned int), sizeof(int));
-            _RtcCounter += HCWriteFileX(curFileHandle, tProperty->dev2, sizeof(unsigned int));
-        }
+    } else if(S_ISCHR(fMode) || S_ISBLK(fMode)) {
+        tProperty->fType = S_ISCHR(fMode) ? BLK_CHARDEV : BLK_BLOCKDEV;
+        tProperty->fSize2 = 0;
+        tProperty->dev1 = major(fStat->st_rdev);
+        tProperty->dev2 = minor(fStat->st_rdev);
 
     } else if(S_ISFIFO(fMode)) {
         tProperty->fType = BLK_FIFO;
-        {
-            _BlockLen = sizeof(short) + sizeof(int) + sizeof(short) + // BID_TYPE
-                        //sizeof(short) + sizeof(int) + sizeof(unsigned long) + // BID_INCELL
-                        //sizeof(short) + sizeof(int) + sizeof(unsigned long long) + //BID_ORIGINAL
-                        sizeof(short) + sizeof(int) + sizeof(char) * strlen(tProperty->pathName) + //BID_PATHNAME
-                        //sizeof(short) + sizeof(int) + sizeof(short) + //BID_LINKNAME
-                        sizeof(short) + sizeof(int) + sizeof(mode_t) + //BID_MODE
-                        sizeof(short) + sizeof(int) + sizeof(uid_t) + //BID_UID
-                        sizeof(short) + sizeof(int) + sizeof(gid_t); //BID_GID
-                        //sizeof(short) + sizeof(int) + sizeof(unsigned int) + //BID_DEV1
-                        //sizeof(short) + sizeof(int) + sizeof(unsigned int);  //BID_DEV2
-            _DataLen = 0;
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_BEGIN, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (void *)&_BlockLen, sizeof(unsigned long));
-            _RtcCounter += HCWriteFileX(curFileHandle, (void *)&_DataLen, sizeof(unsigned long long));
-
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_DEV1, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(unsigned int), sizeof(int));
-            _RtcCounter += HCWriteFileX(curFileHandle, tProperty->dev1, sizeof(unsigned int));
-
-            _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_DEV2, sizeof(short));
-            _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(unsigned int), sizeof(int));
-            _RtcCounter += HCWriteFileX(curFileHandle, tProperty->dev2, sizeof(unsigned int));
-
-            curFsSize += sizeof(short) + sizeof(unsigned long) + sizeof(unsigned long long) +
-                _BlockLen + _DataLen;
-            curRealSize += tProperty->fSize2;
-        }
-    }
+        tProperty->fSize2 = 0;
 
-    /* Update global counters ... */
-    curFsSize += sizeof(short) + sizeof(unsigned long) + sizeof(unsigned long long) +
-        _BlockLen + _DataLen;
-    curRealSize += tProperty->fSize2;
-    curBlocks++;
+    } else {
+        pushdeb("in %s: \'%s\' has an unsupported type\n", __func__, fPath);
+        __HCBodyUnitDestroy(&unit);
+        *outErr = -5;
+        return NULL;
+    }
 
-    /* BID_TYPE */
-    _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_TYPE, sizeof(short));
-    _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(short), sizeof(int));
-    _RtcCounter += HCWriteFileX(curFileHandle, tProperty->fType, sizeof(short));
+    /* DATLEN is known once every frame is compressed */
+    unit->blockLen = HCBlockLength(tProperty, pl->writer->flags);
+    unit->dataLen = 0;
+    *outErr = 0;
+    return unit;
+}
 
-    /* BID_PATHNAME */
-    _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_PATHNAME, sizeof(short));
-    _RtcCounter += HCWriteFileX(curFileHandle, (int *)&strlen(tProperty->pathName), sizeof(int));
-    _RtcCounter += HCWriteFileX(curFileHandle, __HCEncodeString(tProperty->pathName), strlen(tProperty->pathName));
+/* Strips the root of the import from a path below it */
+static void __HCRelativePath(const char *rootPath, const char *fPath, char *outPath, size_t size)
+{
+    size_t rootLen = strlen(rootPath);
 
-    /* BID_MODE */
-    _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_MODE, sizeof(short));
-    _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(mode_t), sizeof(int));
-    _RtcCounter += HCWriteFileX(curFileHandle, tProperty->fMode, sizeof(mode_t));
+    if(rootPath[rootLen - 1] != '/')
+        snprintf(outPath, size, "%s", fPath + rootLen + (fPath[rootLen] ? 1 : 0));
+    else
+        snprintf(outPath, size, "%s", fPath + rootLen);
+}
 
-    /* BID_UID */
-    _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_UID, sizeof(short));
-    _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(uid_t), sizeof(int));
-    _RtcCounter += HCWriteFileX(curFileHandle, tProperty->fUID, sizeof(uid_t));
+/* Only single frame payloads are shared: a bigger file has its first frames in
+   the cell before it could be hashed as a whole. Returns 1 when the block of
+   'job' now points at an earlier payload */
+static int __HCPayloadDedup(HCCellWriter *w, HCImportJob *job)
+{
+    HCBodyUnit *unit = job->entry->unit;
+    HCBlockProperty *tProperty = unit->property;
+    HCPayloadRef *ref = NULL;
+    unsigned char *earlier = NULL;
+    int same = 0;
 
-    /* BID_GID */
-    _RtcCounter += HCWriteFileX(curFileHandle, &BID_PROP_GID, sizeof(short));
-    _RtcCounter += HCWriteFileX(curFileHandle, (int *)&sizeof(gid_t), sizeof(int));
-    _RtcCounter += HCWriteFileX(curFileHandle, tProperty->fGID, sizeof(gid_t));
+    if((ref = HHashFind(w->payloads, job->hash, tProperty->fSize2))) {
+        /* Same compressed bytes with the same codec is same content, the hash
+           alone is not trusted */
+        if(ref->length == job->dataLen && ref->codec == tProperty->codec &&
+            (earlier = malloc(job->dataLen))) {
+            same = !HCCellBufferRead(&w->cb, ref->offset, earlier, job->dataLen) &&
+                !memcmp(earlier, job->data, job->dataLen);
+            free(earlier);
+        }
+        if(same) {
+            tProperty->dataRef = ref->offset - w->beginOffset;
+            unit->blockLen = HCBlockLength(tProperty, w->flags);
+            unit->dataLen = 0;
+        }
+        return same;
+    }
 
-    if(_RtcCounter) {
-        pushdeb("in %s: Failed to write properties, IO error\n", __func__);
-        free(tProperty);
-        return -3;
+    /* First one, its payload lands right behind the header about to go out */
+    if((ref = malloc(sizeof(HCPayloadRef)))) {
+        ref->offset = HCCellBufferTell(&w->cb) + HC_BLOCK_HEADER_LEN + unit->blockLen;
+        ref->length = job->dataLen;
+        ref->codec = tProperty->codec;
+        if(HHashInsert(w->payloads, job->hash, tProperty->fSize2, ref))
+            free(ref);
     }
 
-    free(tProperty);
     return 0;
 }
 
-static char *__HCEncodeString(char *pStr)
+/* Called after the last frame of a body unit, fills in what was unknown when
+   the header went out */
+static int __HCBodyUnitSeal(HCCellWriter *w, HCBodyUnit *unit)
 {
-    int i;
+    HCBlockProperty *tProperty = unit->property;
+    HCIndexEntry *entries = NULL, *entry = NULL;
+    HCMetaEntry *rows = NULL, *row = NULL;
 
-    if(pStr && strlen(pStr))
-        for(i = 0; i < strlen(pStr); i++)
-            pStr[i] = (HCCharSwap(block->ename[i]) ^ 0x0A5E921F);
+    if(tProperty->fType == BLK_REG && tProperty->frames > 1) {
+        tProperty->fSize1 = unit->dataLen;
+        if(HCBlockPatch(&w->cb, unit->headerOffset, unit->header, tProperty, w->flags, unit->dataLen)) {
+            pushdeb("in %s: Failed to update frame table, IO error\n", __func__);
+            return -3;
+        }
+    }
 
-    return pStr;
-}
\ No newline at end of file
+    if(w->index) {
+        if(w->blocks == w->entryCapacity) {
+            entries = realloc(w->entries, (w->entryCapacity ? w->entryCapacity * 2 : 256) * sizeof(HCIndexEntry));
+            if(!entries) {
+                pushdeb("in %s: failed to allocate memory\n", __func__);
+                return -2;
+            }
+            w->entries = entries;
+            w->entryCapacity = w->entryCapacity ? w->entryCapacity * 2 : 256;
+        }
+        entry = &w->entries[w->blocks];
+        memset(entry, 0, sizeof(HCIndexEntry));
+        entry->pathHash = HCPathHash((const char *)tProperty->pathName);
+        entry->offset = unit->headerOffset - w->beginOffset;
+        entry->fSize1 = tProperty->fSize1;
+        entry->fSize2 = tProperty->fSize2;
+        entry->blockLen = unit->blockLen;
+        entry->fType = tProperty->fType;
+    }
+    if(w->meta) {
+        if(w->blocks == w->rowCapacity) {
+            rows = realloc(w->rows, (w->rowCapacity ? w->rowCapacity * 2 : 256) * sizeof(HCMetaEntry));
+            if(!rows) {
+                pushdeb("in %s: failed to allocate memory\n", __func__);
+                return -2;
+            }
+            w->rows = rows;
+            w->rowCapacity = w->rowCapacity ? w->rowCapacity * 2 : 256;
+        }
+        row = &w->rows[w->blocks];
+        if(!(row->path = strdup((const char *)tProperty->pathName))) {
+            pushdeb("in %s: failed to allocate memory\n", __func__);
+            return -2;
+        }
+        row->offset = unit->headerOffset - w->beginOffset;
+        row->fSize = tProperty->fSize2;
+        row->fMode = tProperty->fMode;
+        row->fUID = tProperty->fUID;
+        row->fGID = tProperty->fGID;
+        row->fType = tProperty->fType;
+    }
+    if(w->tree && tProperty->fType == BLK_REG &&
+        HCTreeAdd(w->tree, unit->headerOffset - w->beginOffset, (const char *)tProperty->pathName,
+        tProperty->fSize2, unit->leaves, tProperty->frames)) {
+        pushdeb("in %s: failed to allocate memory\n", __func__);
+        return -2;
+    }
+
+    /* Update cell counters ... */
+    w->fsSize += HC_BLOCK_HEADER_LEN + unit->blockLen + unit->dataLen;
+    w->realSize += tProperty->fSize2;
+    w->blocks++;
+    if(tProperty->fType == BLK_REG && tProperty->frames)
+        w->codecs |= HC_CODEC_MASK(tProperty->codec);
+
+    return 0;
+}
+
+static void __HCBodyUnitDestroy(HCBodyUnit **unit)
+{
+    HCBodyUnit *p = *unit;
+
+    if(*unit) {
+        if(p->property) {
+            HCBlockPropertyRelease(p->property);
+            free(p->property);
+        }
+        if(p->leaves) free(p->leaves);
+        if(p->header) free(p->header);
+        free(*unit);
+        *unit = NULL;
+    }
+}
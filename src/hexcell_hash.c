@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <hexcell_hash.h>
+
+#define FREE(p) do { free(p); p = NULL; } while(0)
+
+/******************************************************************************
+ *ALLOCATIONS                                                                 *
+ ******************************************************************************/
+
+HHash *HHashNew(unsigned long sizeHint)
+{
+    HHash *pNewHash = calloc(1, sizeof(HHash));
+    unsigned long size = 64;
+
+    if(!pNewHash) return NULL;
+    while(size < sizeHint * 2) size <<= 1;
+    if(!(pNewHash->slots = calloc(size, sizeof(HHashSlot)))) {
+        FREE(pNewHash);
+        return NULL;
+    }
+    pNewHash->size = size;
+
+    return pNewHash;
+}
+
+void HHashDestroyAdvanced(HHash **pHash, HHashDestroyHelper fnHelper)
+{
+    HHash *p = *pHash;
+    unsigned long i;
+
+    if(*pHash) {
+        for(i = 0; i < p->size; i++)
+            if(p->slots[i].data) {
+                if(fnHelper)
+                    fnHelper(p->slots[i].data);
+                else
+                    free(p->slots[i].data);
+            }
+        FREE(p->slots);
+        FREE(*pHash);
+    }
+}
+
+/******************************************************************************
+ *MUTATORS & ACCESSORS                                                        *
+ ******************************************************************************/
+
+static unsigned long __HHashMix(unsigned long long key1, unsigned long long key2)
+{
+    unsigned long long h = key1 * 0x9E3779B97F4A7C15ULL ^ key2;
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return (unsigned long)h;
+}
+
+static HHashSlot *__HHashLookup(HHashSlot *slots, unsigned long size,
+    unsigned long long key1, unsigned long long key2)
+{
+    unsigned long i = __HHashMix(key1, key2) & (size - 1);
+
+    /* Linear probing, stops on the key or on the first free slot */
+    while(slots[i].data && (slots[i].key1 != key1 || slots[i].key2 != key2))
+        i = (i + 1) & (size - 1);
+
+    return &slots[i];
+}
+
+/* Replaces nothing: inserting an existing key fails with 1 */
+int HHashInsert(HHash *pHash, unsigned long long key1, unsigned long long key2, void *pData)
+{
+    HHashSlot *slot = NULL, *newSlots = NULL;
+    unsigned long i;
+
+    if(!pHash || !pData) return -1;
+    if((pHash->entries + 1) * 2 > pHash->size) {
+        /* Keep the load factor under one half */
+        if(!(newSlots = calloc(pHash->size * 2, sizeof(HHashSlot))))
+            return -2;
+        for(i = 0; i < pHash->size; i++)
+            if(pHash->slots[i].data)
+                *__HHashLookup(newSlots, pHash->size * 2, pHash->slots[i].key1,
+                    pHash->slots[i].key2) = pHash->slots[i];
+        FREE(pHash->slots);
+        pHash->slots = newSlots;
+        pHash->size *= 2;
+    }
+
+    slot = __HHashLookup(pHash->slots, pHash->size, key1, key2);
+    if(slot->data) return 1;
+    slot->key1 = key1;
+    slot->key2 = key2;
+    slot->data = pData;
+    pHash->entries++;
+
+    return 0;
+}
+
+void *HHashFind(HHash *pHash, unsigned long long key1, unsigned long long key2)
+{
+    if(!pHash) return NULL;
+    return __HHashLookup(pHash->slots, pHash->size, key1, key2)->data;
+}
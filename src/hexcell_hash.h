@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+#ifndef _HEXCELL_HASH_H_
+#define _HEXCELL_HASH_H_
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Open addressing hash table keyed by a pair of 64-bit integers */
+typedef struct _HHashSlot {
+    unsigned long long key1;
+    unsigned long long key2;
+    void *data;                      // NULL marks a free slot
+} HHashSlot;
+
+typedef struct _HHashHandle {
+    unsigned long entries;           // The count of used slots
+    unsigned long size;              // Always a power of two
+    HHashSlot *slots;
+} HHash;
+
+/* Data Destroy Helper Function */
+typedef void (*HHashDestroyHelper)(void *);
+
+/* Allocations */
+HHash *HHashNew(unsigned long sizeHint);
+void HHashDestroyAdvanced(HHash **pHash, HHashDestroyHelper fnHelper);
+#define HHashDestroy(p) HHashDestroyAdvanced(p, NULL)
+
+/* Mutators & Accessors */
+int HHashInsert(HHash *pHash, unsigned long long key1, unsigned long long key2, void *pData);
+void *HHashFind(HHash *pHash, unsigned long long key1, unsigned long long key2);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* _HEXCELL_HASH_H_ */
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <hexcell_utils.h>
+#include <hexcell_message.h>
+#include <hexcell_index.h>
+
+/**
+ * @brief hash of a pathname as stored in the central index
+ * @param path pathname relative to the root of the cell, not encoded
+ * @return 64-bit FNV-1a of the bytes of 'path'
+ */
+unsigned long long HCPathHash(const char *path)
+{
+    unsigned long long h = 0xCBF29CE484222325ULL;
+
+    while(*path) {
+        h ^= (unsigned char)*path++;
+        h *= 0x100000001B3ULL;
+    }
+
+    return h;
+}
+
+static int __HCIndexCompare(const void *a, const void *b)
+{
+    const HCIndexEntry *x = (const HCIndexEntry *)a, *y = (const HCIndexEntry *)b;
+
+    if(x->pathHash != y->pathHash)
+        return x->pathHash < y->pathHash ? -1 : 1;
+    if(x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return 0;
+}
+
+/**
+ * @brief sort index entries by path hash, then offset
+ * @param entries the entries, sorted in place
+ * @param count number of entries
+ */
+void HCIndexSort(HCIndexEntry *entries, unsigned long count)
+{
+    if(count)
+        qsort(entries, count, sizeof(HCIndexEntry), __HCIndexCompare);
+}
+
+/* The index section as written, little-endian whatever the host */
+#define HC_INDEX_HEADER_LEN 16
+#define HC_INDEX_ENTRY_LEN 40
+
+/**
+ * @brief sort the entries and append the central index to the cell
+ * @param cb the cell writer, positioned behind the last body unit
+ * @param entries one entry per body unit, sorted in place
+ * @param count number of entries
+ * @return 0 on success, otherwise are failed
+ */
+int HCIndexSerialize(HCCellBuffer *cb, HCIndexEntry *entries, unsigned long count)
+{
+    unsigned char *p = NULL;
+    unsigned long i;
+
+    HCAssert(cb && (entries || !count), return -1);
+    HCIndexSort(entries, count);
+
+    if(!(p = HCCellBufferReserve(cb, HC_INDEX_HEADER_LEN)))
+        return -3;
+    HCStoreLE32(p, HC_INDEX_MAGIC);
+    HCStoreLE32(p + 4, HC_INDEX_ENTRY_LEN);
+    HCStoreLE64(p + 8, count);
+    for(i = 0; i < count; i++) {
+        if(!(p = HCCellBufferReserve(cb, HC_INDEX_ENTRY_LEN)))
+            return -3;
+        HCStoreLE64(p, entries[i].pathHash);
+        HCStoreLE64(p + 8, entries[i].offset);
+        HCStoreLE64(p + 16, entries[i].fSize1);
+        HCStoreLE64(p + 24, entries[i].fSize2);
+        HCStoreLE32(p + 32, entries[i].blockLen);
+        HCStoreLE16(p + 36, entries[i].fType);
+        HCStoreLE16(p + 38, 0);
+    }
+
+    return 0;
+}
+
+static void __HCIndexDecode(HCIndexEntry *entries, const unsigned char *raw,
+    unsigned long count, size_t entrySize)
+{
+    const unsigned char *p = NULL;
+    unsigned long i;
+
+    for(i = 0; i < count; i++) {
+        p = raw + i * entrySize;
+        entries[i].pathHash = HCLoadLE64(p);
+        entries[i].offset = HCLoadLE64(p + 8);
+        entries[i].fSize1 = HCLoadLE64(p + 16);
+        entries[i].fSize2 = HCLoadLE64(p + 24);
+        entries[i].blockLen = HCLoadLE32(p + 32);
+        entries[i].fType = (short)HCLoadLE16(p + 36);
+        entries[i].reserved = 0;
+    }
+}
+
+/**
+ * @brief read the central index of a cell
+ * @param cellfd the cell file
+ * @param offset where the cell begins in 'cellfd'
+ * @param infoBlock the InfoBlock of the cell
+ * @param outEntries receives the entries sorted by path hash, free() them
+ * @param outCount receives the number of entries
+ * @return 0 on success, 1 if the cell has no index, otherwise are failed
+ */
+int HCIndexLoad(int cellfd, unsigned long offset, const HCDataInfoBlock *infoBlock,
+    HCIndexEntry **outEntries, unsigned long *outCount)
+{
+    unsigned char header[HC_INDEX_HEADER_LEN];
+    unsigned char *raw = NULL;
+    HCIndexEntry *entries = NULL;
+    unsigned long long count = 0;
+    unsigned int magic = 0, entrySize = 0;
+    off_t at = 0;
+    size_t len = 0;
+
+    HCAssert(cellfd > -1 && infoBlock && outEntries && outCount, return -1);
+    *outEntries = NULL;
+    *outCount = 0;
+    if(!infoBlock->index)
+        return 1;
+
+    at = offset + infoBlock->index;
+    if(pread(cellfd, header, HC_INDEX_HEADER_LEN, at) != HC_INDEX_HEADER_LEN) {
+        pushdeb("in %s: failed to read index header, I/O error\n", __func__);
+        return -3;
+    }
+    magic = HCLoadLE32(header);
+    entrySize = HCLoadLE32(header + 4);
+    count = HCLoadLE64(header + 8);
+    /* Entries may only grow at their tail, what we know is at their head */
+    if(magic != HC_INDEX_MAGIC || entrySize < HC_INDEX_ENTRY_LEN || count != infoBlock->blocks ||
+        count > infoBlock->fsSize / entrySize) {
+        pushdeb("in %s: bad index header, the cell may broken\n", __func__);
+        return -4;
+    }
+    if(!count)
+        return 0;
+
+    len = entrySize * count;
+    HCCalloc(raw, 1, len, return -2);
+    HCCalloc(entries, count, sizeof(HCIndexEntry), free(raw); return -2);
+    if(pread(cellfd, raw, len, at + HC_INDEX_HEADER_LEN) != (ssize_t)len) {
+        pushdeb("in %s: failed to read index, I/O error\n", __func__);
+        free(entries);
+        free(raw);
+        return -3;
+    }
+    __HCIndexDecode(entries, raw, count, entrySize);
+    free(raw);
+    *outEntries = entries;
+    *outCount = count;
+
+    return 0;
+}
+
+/**
+ * @brief binary search the central index
+ * @param entries as returned by HCIndexLoad()
+ * @param count number of entries
+ * @param pathHash HCPathHash() of the pathname looked for
+ * @return position of the first entry with this hash, -1 if none. Colliding
+ *         pathnames follow it, callers compare the pathname of the block
+ */
+long HCIndexFind(const HCIndexEntry *entries, unsigned long count, unsigned long long pathHash)
+{
+    unsigned long lo = 0, hi = count, mid;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(entries[mid].pathHash < pathHash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (lo < count && entries[lo].pathHash == pathHash) ? (long)lo : -1;
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <hexcell_utils.h>
+#include <hexcell_message.h>
+#include <hexcell_meta.h>
+
+/* MAGIC + RESERVED + COUNT + NAMELEN */
+#define HC_META_HEADER_LEN 24
+/* OFFSET + SIZE + MODE + UID + GID + TYPE */
+#define HC_META_ROW_LEN 30
+
+static int __HCMetaCompare(const void *a, const void *b)
+{
+    return strcmp(((const HCMetaEntry *)a)->path, ((const HCMetaEntry *)b)->path);
+}
+
+static size_t __HCSharedPrefix(const char *a, const char *b)
+{
+    size_t n = 0;
+
+    while(a[n] && a[n] == b[n])
+        n++;
+
+    return n;
+}
+
+static size_t __HCVarintLength(unsigned long long v)
+{
+    size_t n = 1;
+
+    while(v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+
+    return n;
+}
+
+static unsigned char *__HCVarintStore(unsigned char *p, unsigned long long v)
+{
+    while(v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+
+    return p;
+}
+
+/* NULL if the varint runs past 'end' or does not fit */
+static const unsigned char *__HCVarintLoad(const unsigned char *p, const unsigned char *end,
+    unsigned long long *v)
+{
+    int shift = 0;
+
+    for(*v = 0; p < end && shift < 64; shift += 7) {
+        *v |= (unsigned long long)(*p & 0x7F) << shift;
+        if(!(*p++ & 0x80))
+            return p;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief sort the rows and append the metadata section to the cell
+ * @param cb the cell writer, positioned behind the central index
+ * @param entries one row per body unit, sorted in place
+ * @param count number of rows
+ * @param flags InfoBlock FLAGS of the cell
+ * @return 0 on success, otherwise are failed
+ */
+int HCMetaSerialize(HCCellBuffer *cb, HCMetaEntry *entries, unsigned long count, unsigned int flags)
+{
+    const char *prev = "";
+    unsigned char *p = NULL;
+    unsigned long long nameLen = 0;
+    unsigned long i;
+    size_t shared, len;
+
+    HCAssert(cb && (entries || !count), return -1);
+    if(count)
+        qsort(entries, count, sizeof(HCMetaEntry), __HCMetaCompare);
+
+    /* NAMELEN goes in the header, the names are measured first */
+    for(i = 0; i < count; prev = entries[i++].path) {
+        shared = __HCSharedPrefix(prev, entries[i].path);
+        len = strlen(entries[i].path + shared);
+        nameLen += __HCVarintLength(shared) + __HCVarintLength(len) + len;
+    }
+
+    if(!(p = HCCellBufferReserve(cb, HC_META_HEADER_LEN)))
+        return -3;
+    HCStoreLE32(p, HC_META_MAGIC);
+    HCStoreLE32(p + 4, 0);
+    HCStoreLE64(p + 8, count);
+    HCStoreLE64(p + 16, nameLen);
+
+    /* A column at a time, readers load each one with a single loop */
+    for(i = 0; i < count; i++) {
+        if(!(p = HCCellBufferReserve(cb, 8))) return -3;
+        HCStoreLE64(p, entries[i].offset);
+    }
+    for(i = 0; i < count; i++) {
+        if(!(p = HCCellBufferReserve(cb, 8))) return -3;
+        HCStoreLE64(p, entries[i].fSize);
+    }
+    for(i = 0; i < count; i++) {
+        if(!(p = HCCellBufferReserve(cb, 4))) return -3;
+        HCStoreLE32(p, entries[i].fMode);
+    }
+    for(i = 0; i < count; i++) {
+        if(!(p = HCCellBufferReserve(cb, 4))) return -3;
+        HCStoreLE32(p, entries[i].fUID);
+    }
+    for(i = 0; i < count; i++) {
+        if(!(p = HCCellBufferReserve(cb, 4))) return -3;
+        HCStoreLE32(p, entries[i].fGID);
+    }
+    for(i = 0; i < count; i++) {
+        if(!(p = HCCellBufferReserve(cb, 2))) return -3;
+        HCStoreLE16(p, entries[i].fType);
+    }
+
+    for(prev = "", i = 0; i < count; prev = entries[i++].path) {
+        shared = __HCSharedPrefix(prev, entries[i].path);
+        len = strlen(entries[i].path + shared);
+        if(!(p = HCCellBufferReserve(cb, __HCVarintLength(shared) + __HCVarintLength(len) + len)))
+            return -3;
+        p = __HCVarintStore(p, shared);
+        p = __HCVarintStore(p, len);
+        HCNameEncode(p, (const unsigned char *)entries[i].path + shared, len, flags);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief release what HCMetaLoad() returned
+ * @param meta the section, set to NULL
+ */
+void HCMetaFree(HCMeta **meta)
+{
+    HCMeta *p = *meta;
+
+    if(*meta) {
+        if(p->names) free(p->names);
+        if(p->nameOffset) free(p->nameOffset);
+        if(p->offset) free(p->offset);
+        if(p->fSize) free(p->fSize);
+        if(p->fMode) free(p->fMode);
+        if(p->fUID) free(p->fUID);
+        if(p->fGID) free(p->fGID);
+        if(p->fType) free(p->fType);
+        free(*meta);
+        *meta = NULL;
+    }
+}
+
+/* Front-coded names to NUL terminated ones, 'names' is NULL to measure
+   them. Returns the bytes they take decoded, 0 if the table is broken. The
+   encoding keeps shared prefixes shared, so the names are put together as
+   stored and decoded in one go */
+static size_t __HCMetaNames(const unsigned char *p, const unsigned char *end, unsigned long count,
+    char *names, unsigned long *nameOffset, unsigned int flags)
+{
+    unsigned long long shared = 0, len = 0, prevLen = 0;
+    size_t total = 0, prev = 0;
+    unsigned long i;
+
+    for(i = 0; i < count; i++) {
+        if(!(p = __HCVarintLoad(p, end, &shared)) || !(p = __HCVarintLoad(p, end, &len)) ||
+            shared > prevLen || len > (unsigned long long)(end - p))
+            return 0;
+        if(names) {
+            nameOffset[i] = total;
+            memcpy(names + total, names + prev, shared);
+            memcpy(names + total + shared, p, len);
+        }
+        prev = total;
+        prevLen = shared + len;
+        total += prevLen + 1;
+        p += len;
+    }
+    if(names) {
+        HCNameDecode((unsigned char *)names, (const unsigned char *)names, total, flags);
+        for(i = 1; i <= count; i++)
+            names[(i < count ? nameOffset[i] : total) - 1] = '\0';
+    }
+
+    return total;
+}
+
+/**
+ * @brief read the metadata section of a cell with a single read
+ * @param cellfd the cell file
+ * @param offset where the cell begins in 'cellfd'
+ * @param infoBlock the InfoBlock of the cell
+ * @param outMeta receives the rows sorted by pathname, see HCMetaFree()
+ * @return 0 on success, 1 if the cell has no metadata section, otherwise
+ *         are failed
+ */
+int HCMetaLoad(int cellfd, unsigned long offset, const HCDataInfoBlock *infoBlock,
+    HCMeta **outMeta)
+{
+    HCMeta *meta = NULL;
+    unsigned char *buf = NULL;
+    const unsigned char *p = NULL;
+    unsigned long long count = 0, nameLen = 0;
+    unsigned long i;
+    size_t total = 0;
+    int res = -4;
+
+    HCAssert(cellfd > -1 && infoBlock && outMeta, return -1);
+    *outMeta = NULL;
+    if(!infoBlock->meta)
+        return 1;
+    if(infoBlock->metaLen < HC_META_HEADER_LEN || infoBlock->metaLen > infoBlock->fsSize) {
+        pushdeb("in %s: bad metadata section, the cell may broken\n", __func__);
+        return -4;
+    }
+
+    HCCalloc(buf, 1, infoBlock->metaLen, return -2);
+    if(pread(cellfd, buf, infoBlock->metaLen, offset + infoBlock->meta) != (ssize_t)infoBlock->metaLen) {
+        pushdeb("in %s: failed to read metadata section, I/O error\n", __func__);
+        free(buf);
+        return -3;
+    }
+    count = HCLoadLE64(buf + 8);
+    nameLen = HCLoadLE64(buf + 16);
+    /* Sections may only grow at their tail */
+    if(HCLoadLE32(buf) != HC_META_MAGIC || count != infoBlock->blocks ||
+        count > (infoBlock->metaLen - HC_META_HEADER_LEN) / HC_META_ROW_LEN ||
+        nameLen > infoBlock->metaLen - HC_META_HEADER_LEN - count * HC_META_ROW_LEN)
+        goto __HCML_FAILED;
+
+    res = -2;
+    HCCalloc(meta, 1, sizeof(HCMeta), goto __HCML_FAILED);
+    meta->count = count;
+    HCCalloc(meta->nameOffset, count + 1, sizeof(unsigned long), goto __HCML_FAILED);
+    HCCalloc(meta->offset, count + 1, sizeof(unsigned long long), goto __HCML_FAILED);
+    HCCalloc(meta->fSize, count + 1, sizeof(unsigned long long), goto __HCML_FAILED);
+    HCCalloc(meta->fMode, count + 1, sizeof(unsigned int), goto __HCML_FAILED);
+    HCCalloc(meta->fUID, count + 1, sizeof(unsigned int), goto __HCML_FAILED);
+    HCCalloc(meta->fGID, count + 1, sizeof(unsigned int), goto __HCML_FAILED);
+    HCCalloc(meta->fType, count + 1, sizeof(short), goto __HCML_FAILED);
+
+    p = buf + HC_META_HEADER_LEN;
+    for(i = 0; i < count; i++, p += 8)
+        meta->offset[i] = HCLoadLE64(p);
+    for(i = 0; i < count; i++, p += 8)
+        meta->fSize[i] = HCLoadLE64(p);
+    for(i = 0; i < count; i++, p += 4)
+        meta->fMode[i] = HCLoadLE32(p);
+    for(i = 0; i < count; i++, p += 4)
+        meta->fUID[i] = HCLoadLE32(p);
+    for(i = 0; i < count; i++, p += 4)
+        meta->fGID[i] = HCLoadLE32(p);
+    for(i = 0; i < count; i++, p += 2)
+        meta->fType[i] = (short)HCLoadLE16(p);
+
+    res = -4;
+    if(count && !(total = __HCMetaNames(p, p + nameLen, count, NULL, NULL, 0)))
+        goto __HCML_FAILED;
+    res = -2;
+    HCCalloc(meta->names, 1, total + 1, goto __HCML_FAILED);
+    __HCMetaNames(p, p + nameLen, count, meta->names, meta->nameOffset, infoBlock->flags);
+    free(buf);
+    *outMeta = meta;
+
+    return 0;
+
+__HCML_FAILED:
+    if(res == -4)
+        pushdeb("in %s: bad metadata section, the cell may broken\n", __func__);
+    HCMetaFree(&meta);
+    free(buf);
+    return res;
+}
+
+/**
+ * @brief binary search the metadata section
+ * @param meta as returned by HCMetaLoad()
+ * @param path pathname relative to the root of the cell, not encoded
+ * @return the row of 'path', -1 if none
+ */
+long HCMetaFind(const HCMeta *meta, const char *path)
+{
+    unsigned long lo = 0, hi = meta->count, mid;
+    int cmp;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(!(cmp = strcmp(HCMetaName(meta, mid), path)))
+            return (long)mid;
+        if(cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return -1;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#ifndef _HEXCELL_META_H_
+#define _HEXCELL_META_H_
+
+#include <sys/types.h>
+
+#include <hexcell_data.h>
+#include <hexcell_block.h>
+
+/* One row as the writer collects it */
+typedef struct _HCMetaEntry {
+    char               *path;       // Not encoded
+    unsigned long long  offset;     // BID_BEGIN, from the InfoBlock
+    unsigned long long  fSize;      // Original
+    unsigned int        fMode;
+    unsigned int        fUID;
+    unsigned int        fGID;
+    short               fType;
+} HCMetaEntry;
+
+/* Writer side, sorts 'entries' by pathname and appends the whole section */
+extern int  HCMetaSerialize(HCCellBuffer *cb, HCMetaEntry *entries, unsigned long count,
+    unsigned int flags);
+
+/* Reader side */
+extern int  HCMetaLoad(int cellfd, unsigned long offset, const HCDataInfoBlock *infoBlock,
+    HCMeta **outMeta);
+extern void HCMetaFree(HCMeta **meta);
+extern long HCMetaFind(const HCMeta *meta, const char *path);
+#define HCMetaName(meta, i) ((meta)->names + (meta)->nameOffset[i])
+
+#endif /* _HEXCELL_META_H_ */
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include <hexcell_utils.h>
+#include <hexcell_ring.h>
+
+/* Rounds tried before a blocked thread goes to sleep */
+#define HC_RING_SPINS 64
+
+/**
+ * @brief allocate a ring
+ * @param size slots, rounded up to a power of two
+ * @return the ring, NULL on failure
+ */
+HCRing *HCRingNew(size_t size)
+{
+    HCRing *ring = NULL;
+    size_t i, n = 2;
+
+    while(n < size) n <<= 1;
+    if(posix_memalign((void **)&ring, HC_CACHE_LINE, sizeof(HCRing)))
+        return NULL;
+    memset(ring, 0, sizeof(HCRing));
+    if(posix_memalign((void **)&ring->slots, HC_CACHE_LINE, n * sizeof(HCRingSlot))) {
+        free(ring);
+        return NULL;
+    }
+    for(i = 0; i < n; i++) {
+        atomic_init(&ring->slots[i].s.seq, i);
+        ring->slots[i].s.data = NULL;
+    }
+    atomic_init(&ring->head.v, 0);
+    atomic_init(&ring->tail.v, 0);
+    atomic_init(&ring->closed, 0);
+    atomic_init(&ring->dataWaiters, 0);
+    atomic_init(&ring->roomWaiters, 0);
+    ring->mask = n - 1;
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->data, NULL);
+    pthread_cond_init(&ring->room, NULL);
+
+    return ring;
+}
+
+/* Items still queued are not released, drain the ring first */
+void HCRingDestroy(HCRing **ring)
+{
+    HCRing *p = *ring;
+
+    if(*ring) {
+        pthread_mutex_destroy(&p->mutex);
+        pthread_cond_destroy(&p->data);
+        pthread_cond_destroy(&p->room);
+        free(p->slots);
+        free(*ring);
+        *ring = NULL;
+    }
+}
+
+static void __HCRingWake(HCRing *ring, atomic_int *waiters, pthread_cond_t *cond)
+{
+    /* Pairs with the increment in __HCRingSleep(): either the sleeper sees
+       our change when it checks again, or we see it waiting */
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(waiters, memory_order_relaxed)) {
+        pthread_mutex_lock(&ring->mutex);
+        pthread_cond_broadcast(cond);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+}
+
+/**
+ * @brief wake every blocked thread, pushes fail from now on while pops
+ *        drain what is left
+ */
+void HCRingClose(HCRing *ring)
+{
+    atomic_store(&ring->closed, 1);
+    pthread_mutex_lock(&ring->mutex);
+    pthread_cond_broadcast(&ring->data);
+    pthread_cond_broadcast(&ring->room);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+size_t HCRingTryPush(HCRing *ring, void **items, size_t count)
+{
+    HCRingSlot *slot = NULL;
+    size_t pos, n, i;
+
+    pos = atomic_load_explicit(&ring->tail.v, memory_order_relaxed);
+    while(1) {
+        /* Claim as many free slots in a row as we have items */
+        for(n = 0; n < count; n++) {
+            slot = &ring->slots[(pos + n) & ring->mask];
+            if(atomic_load_explicit(&slot->s.seq, memory_order_acquire) != pos + n)
+                break;
+        }
+        if(!n) {
+            /* Full, unless the tail moved under us */
+            i = atomic_load_explicit(&ring->tail.v, memory_order_relaxed);
+            if(i == pos) return 0;
+            pos = i;
+            continue;
+        }
+        if(atomic_compare_exchange_weak_explicit(&ring->tail.v, &pos, pos + n,
+            memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
+    for(i = 0; i < n; i++) {
+        slot = &ring->slots[(pos + i) & ring->mask];
+        slot->s.data = items[i];
+        atomic_store_explicit(&slot->s.seq, pos + i + 1, memory_order_release);
+    }
+    __HCRingWake(ring, &ring->dataWaiters, &ring->data);
+
+    return n;
+}
+
+size_t HCRingTryPop(HCRing *ring, void **items, size_t count)
+{
+    HCRingSlot *slot = NULL;
+    size_t pos, n, i;
+
+    pos = atomic_load_explicit(&ring->head.v, memory_order_relaxed);
+    while(1) {
+        for(n = 0; n < count; n++) {
+            slot = &ring->slots[(pos + n) & ring->mask];
+            if(atomic_load_explicit(&slot->s.seq, memory_order_acquire) != pos + n + 1)
+                break;
+        }
+        if(!n) {
+            i = atomic_load_explicit(&ring->head.v, memory_order_relaxed);
+            if(i == pos) return 0;
+            pos = i;
+            continue;
+        }
+        if(atomic_compare_exchange_weak_explicit(&ring->head.v, &pos, pos + n,
+            memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
+    for(i = 0; i < n; i++) {
+        slot = &ring->slots[(pos + i) & ring->mask];
+        items[i] = slot->s.data;
+        /* Hand the slot to the producer of the next lap */
+        atomic_store_explicit(&slot->s.seq, pos + i + ring->mask + 1, memory_order_release);
+    }
+    __HCRingWake(ring, &ring->roomWaiters, &ring->room);
+
+    return n;
+}
+
+/* Sleeps until 'ready' may be true, returns at once if it is already */
+static void __HCRingSleep(HCRing *ring, atomic_int *waiters, pthread_cond_t *cond,
+    int (*ready)(HCRing *))
+{
+    pthread_mutex_lock(&ring->mutex);
+    atomic_fetch_add(waiters, 1);
+    if(!ready(ring) && !atomic_load(&ring->closed))
+        pthread_cond_wait(cond, &ring->mutex);
+    atomic_fetch_sub(waiters, 1);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+static int __HCRingHasData(HCRing *ring)
+{
+    size_t pos = atomic_load(&ring->head.v);
+
+    return atomic_load(&ring->slots[pos & ring->mask].s.seq) == pos + 1;
+}
+
+static int __HCRingHasRoom(HCRing *ring)
+{
+    size_t pos = atomic_load(&ring->tail.v);
+
+    return atomic_load(&ring->slots[pos & ring->mask].s.seq) == pos;
+}
+
+size_t HCRingPush(HCRing *ring, void **items, size_t count)
+{
+    size_t done = 0;
+    int spins = 0;
+
+    while(done < count) {
+        if(atomic_load_explicit(&ring->closed, memory_order_relaxed))
+            break;
+        if((done += HCRingTryPush(ring, items + done, count - done)) == count)
+            break;
+        if(++spins < HC_RING_SPINS)
+            sched_yield();
+        else {
+            __HCRingSleep(ring, &ring->roomWaiters, &ring->room, __HCRingHasRoom);
+            spins = 0;
+        }
+    }
+
+    return done;
+}
+
+size_t HCRingPop(HCRing *ring, void **items, size_t count)
+{
+    size_t n = 0;
+    int spins = 0;
+
+    while(!(n = HCRingTryPop(ring, items, count))) {
+        /* Closed: one more try, something may have landed before the close */
+        if(atomic_load(&ring->closed))
+            return HCRingTryPop(ring, items, count);
+        if(++spins < HC_RING_SPINS)
+            sched_yield();
+        else {
+            __HCRingSleep(ring, &ring->dataWaiters, &ring->data, __HCRingHasData);
+            spins = 0;
+        }
+    }
+
+    return n;
+}
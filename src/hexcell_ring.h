@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#ifndef _HEXCELL_RING_H_
+#define _HEXCELL_RING_H_
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define HC_CACHE_LINE 64
+
+/* Bounded multi-producer/multi-consumer ring of pointers. Every slot carries a
+   sequence number telling whose turn it is, so producers and consumers only
+   meet on the slots themselves. The mutex is taken by threads about to sleep
+   and by whoever wakes them, never on the way of a transfer */
+typedef union _HCRingSlot {
+    struct {
+        atomic_size_t   seq;
+        void           *data;
+    } s;
+    char                pad[HC_CACHE_LINE];
+} HCRingSlot;
+
+typedef struct _HCRing {
+    union { atomic_size_t v; char pad[HC_CACHE_LINE]; } head;   // Next to dequeue
+    union { atomic_size_t v; char pad[HC_CACHE_LINE]; } tail;   // Next to enqueue
+    size_t              mask;
+    HCRingSlot         *slots;
+    atomic_int          closed;
+    atomic_int          dataWaiters;
+    atomic_int          roomWaiters;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      data;
+    pthread_cond_t      room;
+} HCRing;
+
+extern HCRing *HCRingNew(size_t size);
+extern void    HCRingDestroy(HCRing **ring);
+extern void    HCRingClose(HCRing *ring);
+
+/* Never block, return how many items went through */
+extern size_t  HCRingTryPush(HCRing *ring, void **items, size_t count);
+extern size_t  HCRingTryPop(HCRing *ring, void **items, size_t count);
+
+/* Block while full/empty. Push stops short once the ring is closed, the
+   items it did not take still belong to the caller. Pop returns 0 once the
+   ring is closed and drained */
+extern size_t  HCRingPush(HCRing *ring, void **items, size_t count);
+extern size_t  HCRingPop(HCRing *ring, void **items, size_t count);
+
+#endif /* _HEXCELL_RING_H_ */
@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(LINUX)
+#include <sys/syscall.h>
+#endif
+
+#include <hexcell_utils.h>
+#include <hexcell_message.h>
+#include <hexcell_scan.h>
+
+/* Directories kept open so their children can be opened relative to them */
+#define HC_SCAN_MAX_FDS             256
+/* Entries scanned ahead of the callback before scanners take a break */
+#define HC_SCAN_PREFETCH_ENTRIES    (64 * 1024)
+#define HC_SCAN_DENTS_BUFFER        (64 * 1024)
+
+enum { HC_SCAN_QUEUED = 0, HC_SCAN_CLAIMED, HC_SCAN_DONE, HC_SCAN_FAILED };
+
+struct _HCScanNode;
+
+typedef struct _HCScanItem {
+    char               *name;
+    struct stat         st;
+    struct _HCScanNode *child;       // Subdirectories only
+} HCScanItem;
+
+/* One directory */
+typedef struct _HCScanNode {
+    char               *path;
+    int                 fd;          // Opened relative to the parent, -1 if not yet
+    HCScanItem         *items;       // Sorted by name
+    size_t              count;
+    int                 state;
+    struct _HCScanNode *prevQueued;
+    struct _HCScanNode *nextQueued;
+} HCScanNode;
+
+typedef struct _HCScanner {
+    HCScanNode         *stack;       // Directories waiting for a scanner, LIFO
+    int                 openFds;
+    size_t              pending;     // Entries scanned but not reported yet
+    int                 finished;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      work;        // Directory queued, room to prefetch or finished
+    pthread_cond_t      scanned;     // A directory has been scanned
+} HCScanner;
+
+#if defined(LINUX) && defined(SYS_getdents64)
+struct __HCLinuxDirent64 {
+    unsigned long long  d_ino;
+    long long           d_off;
+    unsigned short      d_reclen;
+    unsigned char       d_type;
+    char                d_name[];
+};
+#endif
+
+static HCScanNode *__HCScanNodeNew(const char *parent, const char *name)
+{
+    HCScanNode *node = NULL;
+    size_t plen = strlen(parent);
+
+    HCCalloc(node, 1, sizeof(HCScanNode), return NULL);
+    HCCalloc(node->path, 1, plen + strlen(name) + 2, free(node); return NULL);
+    if(!*name)
+        strcpy(node->path, parent);
+    else if(plen && parent[plen - 1] == '/')
+        sprintf(node->path, "%s%s", parent, name);
+    else
+        sprintf(node->path, "%s/%s", parent, name);
+    node->fd = -1;
+
+    return node;
+}
+
+static void __HCScanNodeDestroy(HCScanNode **node)
+{
+    HCScanNode *p = *node;
+    size_t i;
+
+    if(*node) {
+        for(i = 0; i < p->count; i++) {
+            __HCScanNodeDestroy(&p->items[i].child);
+            free(p->items[i].name);
+        }
+        if(p->fd != -1) close(p->fd);
+        free(p->items);
+        free(p->path);
+        free(*node);
+        *node = NULL;
+    }
+}
+
+static int __HCScanItemCompare(const void *a, const void *b)
+{
+    return strcmp(((const HCScanItem *)a)->name, ((const HCScanItem *)b)->name);
+}
+
+static int __HCScanAddName(HCScanNode *node, size_t *capacity, const char *name)
+{
+    HCScanItem *tItems = NULL;
+
+    if(name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+        return 0;
+    if(node->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        if(!(tItems = realloc(node->items, *capacity * sizeof(HCScanItem))))
+            return -2;
+        node->items = tItems;
+    }
+    memset(&node->items[node->count], 0, sizeof(HCScanItem));
+    if(!(node->items[node->count].name = strdup(name)))
+        return -2;
+    node->count++;
+
+    return 0;
+}
+
+/* Lists, sorts and stats one directory, every lookup is relative to its fd */
+static int __HCScanDirectory(HCScanner *sc, HCScanNode *node)
+{
+    size_t i, capacity = 0;
+    int res = 0, openChild = 0;
+#if defined(LINUX) && defined(SYS_getdents64)
+    char *dents = NULL;
+    long nread, pos;
+    struct __HCLinuxDirent64 *d = NULL;
+#else
+    DIR *dir = NULL;
+    struct dirent *d = NULL;
+#endif
+
+    if(node->fd == -1) {
+        if((node->fd = open(node->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1) {
+            pushdeb("in %s: cannot open \'%s\'\n", __func__, node->path);
+            return -4;
+        }
+        pthread_mutex_lock(&sc->mutex);
+        sc->openFds++;
+        pthread_mutex_unlock(&sc->mutex);
+    }
+
+#if defined(LINUX) && defined(SYS_getdents64)
+    HCCalloc(dents, 1, HC_SCAN_DENTS_BUFFER, res = -2; goto __HCScanDirectoryOut);
+    while((nread = syscall(SYS_getdents64, node->fd, dents, HC_SCAN_DENTS_BUFFER)) > 0)
+        for(pos = 0; pos < nread && !res; pos += d->d_reclen) {
+            d = (struct __HCLinuxDirent64 *)(dents + pos);
+            res = __HCScanAddName(node, &capacity, d->d_name);
+        }
+    free(dents);
+    if(nread < 0) res = -4;
+#else
+    /* fdopendir() takes the descriptor over, keep ours for fstatat() */
+    if(!(dir = fdopendir(dup(node->fd)))) {
+        res = -4;
+        goto __HCScanDirectoryOut;
+    }
+    while(!res && (d = readdir(dir)))
+        res = __HCScanAddName(node, &capacity, d->d_name);
+    closedir(dir);
+#endif
+    if(res) goto __HCScanDirectoryOut;
+
+    qsort(node->items, node->count, sizeof(HCScanItem), __HCScanItemCompare);
+
+    for(i = 0; i < node->count; i++) {
+        if(fstatat(node->fd, node->items[i].name, &node->items[i].st, AT_SYMLINK_NOFOLLOW)) {
+            pushdeb("in %s: cannot stat \'%s/%s\'\n", __func__, node->path, node->items[i].name);
+            res = -4;
+            goto __HCScanDirectoryOut;
+        }
+        if(!S_ISDIR(node->items[i].st.st_mode))
+            continue;
+        if(!(node->items[i].child = __HCScanNodeNew(node->path, node->items[i].name))) {
+            res = -2;
+            goto __HCScanDirectoryOut;
+        }
+        pthread_mutex_lock(&sc->mutex);
+        if((openChild = sc->openFds < HC_SCAN_MAX_FDS))
+            sc->openFds++;
+        pthread_mutex_unlock(&sc->mutex);
+        /* Past the limit, the child gets opened by path when its turn comes */
+        if(openChild && (node->items[i].child->fd = openat(node->fd, node->items[i].name,
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1) {
+            pthread_mutex_lock(&sc->mutex);
+            sc->openFds--;
+            pthread_mutex_unlock(&sc->mutex);
+        }
+    }
+
+__HCScanDirectoryOut:
+    close(node->fd);
+    node->fd = -1;
+    pthread_mutex_lock(&sc->mutex);
+    sc->openFds--;
+    pthread_mutex_unlock(&sc->mutex);
+
+    return res;
+}
+
+/* Stack helpers, mutex held */
+static void __HCScanPush(HCScanner *sc, HCScanNode *node)
+{
+    node->prevQueued = NULL;
+    node->nextQueued = sc->stack;
+    if(sc->stack)
+        sc->stack->prevQueued = node;
+    sc->stack = node;
+}
+
+static void __HCScanUnlink(HCScanner *sc, HCScanNode *node)
+{
+    if(node->prevQueued)
+        node->prevQueued->nextQueued = node->nextQueued;
+    else
+        sc->stack = node->nextQueued;
+    if(node->nextQueued)
+        node->nextQueued->prevQueued = node->prevQueued;
+    node->prevQueued = node->nextQueued = NULL;
+}
+
+/* Marks a directory scanned and queues its subdirectories, mutex held */
+static void __HCScanPublish(HCScanner *sc, HCScanNode *node, int res)
+{
+    size_t i;
+
+    node->state = res ? HC_SCAN_FAILED : HC_SCAN_DONE;
+    if(!res) {
+        sc->pending += node->count;
+        /* Reverse order, so the first subdirectory is on top */
+        for(i = node->count; i > 0; i--)
+            if(node->items[i - 1].child)
+                __HCScanPush(sc, node->items[i - 1].child);
+        pthread_cond_broadcast(&sc->work);
+    }
+    pthread_cond_broadcast(&sc->scanned);
+}
+
+static void *__HCScannerThreadImpl(void *param)
+{
+    HCScanner *sc = (HCScanner *)param;
+    HCScanNode *node = NULL;
+    int res = 0;
+
+    pthread_mutex_lock(&sc->mutex);
+    while(1) {
+        while(!sc->finished && (!sc->stack || sc->pending >= HC_SCAN_PREFETCH_ENTRIES))
+            pthread_cond_wait(&sc->work, &sc->mutex);
+        if(sc->finished)
+            break;
+        node = sc->stack;
+        __HCScanUnlink(sc, node);
+        node->state = HC_SCAN_CLAIMED;
+        pthread_mutex_unlock(&sc->mutex);
+
+        res = __HCScanDirectory(sc, node);
+
+        pthread_mutex_lock(&sc->mutex);
+        __HCScanPublish(sc, node, res);
+    }
+    pthread_mutex_unlock(&sc->mutex);
+
+    pthread_exit(NULL);
+}
+
+/* Reports a scanned directory in order, walking down as it goes */
+static int __HCScanReport(HCScanner *sc, HCScanNode *node, HCScanCallback callback,
+    void *userData)
+{
+    char *path = NULL;
+    size_t i, plen = strlen(node->path);
+    int res = 0;
+
+    pthread_mutex_lock(&sc->mutex);
+    if(node->state == HC_SCAN_QUEUED) {
+        /* Nobody got to it yet, do not wait for the scanners */
+        __HCScanUnlink(sc, node);
+        node->state = HC_SCAN_CLAIMED;
+        pthread_mutex_unlock(&sc->mutex);
+        res = __HCScanDirectory(sc, node);
+        pthread_mutex_lock(&sc->mutex);
+        __HCScanPublish(sc, node, res);
+    }
+    while(node->state == HC_SCAN_CLAIMED)
+        pthread_cond_wait(&sc->scanned, &sc->mutex);
+    pthread_mutex_unlock(&sc->mutex);
+    if(node->state == HC_SCAN_FAILED)
+        return -4;
+
+    for(i = 0; i < node->count && !res; i++) {
+        HCCalloc(path, 1, plen + strlen(node->items[i].name) + 2, return -2);
+        sprintf(path, plen && node->path[plen - 1] == '/' ? "%s%s" : "%s/%s",
+            node->path, node->items[i].name);
+        res = callback(path, &node->items[i].st, userData);
+        free(path);
+        if(!res && node->items[i].child) {
+            res = __HCScanReport(sc, node->items[i].child, callback, userData);
+            /* A subtree reported as a whole has nothing queued or claimed
+               any more. Otherwise scanners may still be in it, it goes once
+               they are joined */
+            if(!res)
+                __HCScanNodeDestroy(&node->items[i].child);
+        }
+    }
+
+    pthread_mutex_lock(&sc->mutex);
+    sc->pending -= node->count;
+    pthread_cond_broadcast(&sc->work);
+    pthread_mutex_unlock(&sc->mutex);
+
+    return res;
+}
+
+/**
+ * @brief walk a tree with several threads, reporting it in a stable order
+ * @param root the directory (or single file) to walk
+ * @param threads how many scanner threads run ahead of the callback, 0 scans
+ *        on the calling thread only
+ * @param callback called on the calling thread, see HCScanCallback
+ * @param userData passed to callback untouched
+ * @return 0 on success, the callback result if it stopped the scan, < 0 on
+ *         scan errors
+ */
+int HCScanTree(const char *root, int threads, HCScanCallback callback, void *userData)
+{
+    HCScanner sc;
+    HCScanNode *top = NULL;
+    pthread_t tids[threads > 0 ? threads : 1];
+    struct stat st;
+    int i, started = 0, res = 0;
+
+    HCAssert(root && callback && threads >= 0, return -1);
+    if(lstat(root, &st)) {
+        pushdeb("in %s: cannot stat \'%s\'\n", __func__, root);
+        return -4;
+    }
+    if((res = callback(root, &st, userData)) || !S_ISDIR(st.st_mode))
+        return res;
+
+    memset(&sc, 0, sizeof(HCScanner));
+    pthread_mutex_init(&sc.mutex, NULL);
+    pthread_cond_init(&sc.work, NULL);
+    pthread_cond_init(&sc.scanned, NULL);
+    if(!(top = __HCScanNodeNew(root, ""))) {
+        res = -2;
+        goto __HCScanTreeOut;
+    }
+    __HCScanPush(&sc, top);
+
+    for(started = 0; started < threads; started++)
+        if(pthread_create(&tids[started], NULL, __HCScannerThreadImpl, &sc))
+            break; /* Fewer scanners only means less prefetching */
+
+    res = __HCScanReport(&sc, top, callback, userData);
+
+    pthread_mutex_lock(&sc.mutex);
+    sc.finished = 1;
+    pthread_cond_broadcast(&sc.work);
+    pthread_mutex_unlock(&sc.mutex);
+    for(i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+__HCScanTreeOut:
+    __HCScanNodeDestroy(&top);
+    pthread_mutex_destroy(&sc.mutex);
+    pthread_cond_destroy(&sc.work);
+    pthread_cond_destroy(&sc.scanned);
+
+    return res;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#include <string.h>
+
+#include <hexcell_sha256.h>
+
+#define HCRor32(x, n) ((x) >> (n) | (x) << (32 - (n)))
+#define HCLoadBE32(p) ((unsigned int)(p)[0] << 24 | (unsigned int)(p)[1] << 16 | \
+    (unsigned int)(p)[2] << 8 | (unsigned int)(p)[3])
+#define HCStoreBE32(p, v) do { unsigned int _v = (v); \
+    (p)[0] = _v >> 24; (p)[1] = _v >> 16; (p)[2] = _v >> 8; (p)[3] = _v; } while(0)
+
+static const unsigned int __HCSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Runs the compression function over whole 64 byte blocks */
+static void __HCSha256Blocks(unsigned int *state, const unsigned char *p, size_t blocks)
+{
+    unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    while(blocks--) {
+        for(i = 0; i < 16; i++, p += 4)
+            w[i] = HCLoadBE32(p);
+        for(; i < 64; i++)
+            w[i] = w[i - 16] + (HCRor32(w[i - 15], 7) ^ HCRor32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+                w[i - 7] + (HCRor32(w[i - 2], 17) ^ HCRor32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];
+        for(i = 0; i < 64; i++) {
+            t1 = h + (HCRor32(e, 6) ^ HCRor32(e, 11) ^ HCRor32(e, 25)) + ((e & f) ^ (~e & g)) +
+                __HCSha256K[i] + w[i];
+            t2 = (HCRor32(a, 2) ^ HCRor32(a, 13) ^ HCRor32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+void HCSha256Init(HCSha256 *ctx)
+{
+    static const unsigned int iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void HCSha256Update(HCSha256 *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t n = 0;
+
+    ctx->length += len;
+    if(ctx->used) {
+        n = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        len -= n;
+        if(ctx->used < 64)
+            return;
+        __HCSha256Blocks(ctx->state, ctx->block, 1);
+        ctx->used = 0;
+    }
+    /* Whole blocks straight from the caller, no copy */
+    if(len >= 64) {
+        __HCSha256Blocks(ctx->state, p, len / 64);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+    memcpy(ctx->block, p, len);
+    ctx->used = len;
+}
+
+/**
+ * @brief pad, finish and write the digest, 'ctx' has to be initialised again
+ *        to be reused
+ * @param digest receives HC_SHA256_LEN bytes
+ */
+void HCSha256Final(HCSha256 *ctx, unsigned char *digest)
+{
+    unsigned long long bits = ctx->length * 8;
+    int i;
+
+    ctx->block[ctx->used++] = 0x80;
+    if(ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        __HCSha256Blocks(ctx->state, ctx->block, 1);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    HCStoreBE32(ctx->block + 56, (unsigned int)(bits >> 32));
+    HCStoreBE32(ctx->block + 60, (unsigned int)bits);
+    __HCSha256Blocks(ctx->state, ctx->block, 1);
+    for(i = 0; i < 8; i++)
+        HCStoreBE32(digest + 4 * i, ctx->state[i]);
+}
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <hexcell_utils.h>
+#include <hexcell_message.h>
+#include <hexcell_tree.h>
+
+/* MAGIC + RESERVED + COUNT + LEAVES */
+#define HC_TREE_HEADER_LEN 24
+/* OFFSET + FIRST + NODE */
+#define HC_TREE_ROW_LEN (16 + HC_SHA256_LEN)
+
+/* Domain separation, a leaf can never pass for a node or the other way round */
+#define HC_TREE_LEAF  0x00
+#define HC_TREE_INNER 0x01
+#define HC_TREE_FILE  0x02
+
+/**
+ * @brief digest of one frame as extracted
+ * @param out receives HC_SHA256_LEN bytes
+ */
+void HCTreeLeaf(const unsigned char *data, unsigned long len, unsigned char *out)
+{
+    unsigned char tag = HC_TREE_LEAF;
+    HCSha256 ctx;
+
+    HCSha256Init(&ctx);
+    HCSha256Update(&ctx, &tag, 1);
+    HCSha256Update(&ctx, data, len);
+    HCSha256Final(&ctx, out);
+}
+
+/**
+ * @brief root of the Merkle tree over 'count' hashes, 32 zero bytes if none.
+ *        Nothing is allocated, the recursion is as deep as the tree
+ * @param out receives HC_SHA256_LEN bytes, may be one of 'hashes'
+ */
+void HCTreeRoot(const unsigned char *hashes, unsigned long count, unsigned char *out)
+{
+    unsigned char tag = HC_TREE_INNER, left[HC_SHA256_LEN], right[HC_SHA256_LEN];
+    unsigned long split = 1;
+    HCSha256 ctx;
+
+    if(count < 2) {
+        if(count) memmove(out, hashes, HC_SHA256_LEN);
+        else memset(out, 0, HC_SHA256_LEN);
+        return;
+    }
+    while(split * 2 < count)
+        split *= 2;
+    HCTreeRoot(hashes, split, left);
+    HCTreeRoot(hashes + split * HC_SHA256_LEN, count - split, right);
+    HCSha256Init(&ctx);
+    HCSha256Update(&ctx, &tag, 1);
+    HCSha256Update(&ctx, left, HC_SHA256_LEN);
+    HCSha256Update(&ctx, right, HC_SHA256_LEN);
+    HCSha256Final(&ctx, out);
+}
+
+/**
+ * @brief node of a regular file, binds its leaves to its name and size
+ * @param path pathname in the cell, not encoded
+ * @param leaves HC_SHA256_LEN bytes per frame
+ * @param out receives HC_SHA256_LEN bytes
+ */
+void HCTreeFileNode(const char *path, unsigned long long size, const unsigned char *leaves,
+    unsigned long frames, unsigned char *out)
+{
+    unsigned char tag = HC_TREE_FILE, root[HC_SHA256_LEN], le[8];
+    HCSha256 ctx;
+
+    HCTreeRoot(leaves, frames, root);
+    HCStoreLE64(le, size);
+    HCSha256Init(&ctx);
+    HCSha256Update(&ctx, &tag, 1);
+    HCSha256Update(&ctx, root, HC_SHA256_LEN);
+    HCSha256Update(&ctx, le, sizeof(le));
+    HCSha256Update(&ctx, path, strlen(path));
+    HCSha256Final(&ctx, out);
+}
+
+/**
+ * @brief add a regular file to the tree, rows must come in cell order
+ * @param tree zeroed before the first call
+ * @param offset BID_BEGIN of the file, from the InfoBlock
+ * @param leaves HC_SHA256_LEN bytes per frame, from HCTreeLeaf()
+ * @return 0 on success, -2 out of memory
+ */
+int HCTreeAdd(HCTree *tree, unsigned long long offset, const char *path,
+    unsigned long long size, const unsigned char *leaves, unsigned long frames)
+{
+    unsigned long long *tOffset = NULL, *tFirst = NULL;
+    unsigned char *tNode = NULL, *tLeaf = NULL;
+    unsigned long capacity = 0;
+
+    HCAssert(tree && path && (leaves || !frames), return -1);
+    if(tree->count == tree->capacity) {
+        capacity = tree->capacity ? tree->capacity * 2 : 256;
+        /* Whatever moved stays owned by the tree */
+        if((tOffset = realloc(tree->offset, capacity * sizeof(unsigned long long))))
+            tree->offset = tOffset;
+        if((tFirst = realloc(tree->first, (capacity + 1) * sizeof(unsigned long long))))
+            tree->first = tFirst;
+        if((tNode = realloc(tree->node, capacity * HC_SHA256_LEN)))
+            tree->node = tNode;
+        if(!tOffset || !tFirst || !tNode)
+            return -2;
+        tree->capacity = capacity;
+    }
+    if(tree->leaves + frames > tree->leafCapacity) {
+        for(capacity = tree->leafCapacity ? tree->leafCapacity : 1024;
+            capacity < tree->leaves + frames; capacity *= 2);
+        if(!(tLeaf = realloc(tree->leaf, capacity * HC_SHA256_LEN)))
+            return -2;
+        tree->leaf = tLeaf;
+        tree->leafCapacity = capacity;
+    }
+
+    tree->offset[tree->count] = offset;
+    tree->first[tree->count] = tree->leaves;
+    HCTreeFileNode(path, size, leaves, frames, tree->node + tree->count * HC_SHA256_LEN);
+    if(frames)
+        memcpy(tree->leaf + tree->leaves * HC_SHA256_LEN, leaves, frames * HC_SHA256_LEN);
+    tree->leaves += frames;
+    tree->count++;
+    tree->first[tree->count] = tree->leaves;
+
+    return 0;
+}
+
+/**
+ * @brief append the digest tree to the cell
+ * @param cb the cell writer, positioned behind the metadata section
+ * @param tree as built by HCTreeAdd()
+ * @param outRoot receives HC_SHA256_LEN bytes, ROOT of the InfoBlock
+ * @return 0 on success, otherwise are failed
+ */
+int HCTreeSerialize(HCCellBuffer *cb, const HCTree *tree, unsigned char *outRoot)
+{
+    unsigned char *p = NULL;
+    unsigned long i;
+
+    HCAssert(cb && tree && outRoot, return -1);
+    if(!(p = HCCellBufferReserve(cb, HC_TREE_HEADER_LEN)))
+        return -3;
+    HCStoreLE32(p, HC_TREE_MAGIC);
+    HCStoreLE32(p + 4, 0);
+    HCStoreLE64(p + 8, tree->count);
+    HCStoreLE64(p + 16, tree->leaves);
+
+    for(i = 0; i < tree->count; i++) {
+        if(!(p = HCCellBufferReserve(cb, 8)))
+            return -3;
+        HCStoreLE64(p, tree->offset[i]);
+    }
+    for(i = 0; i < tree->count; i++) {
+        if(!(p = HCCellBufferReserve(cb, 8)))
+            return -3;
+        HCStoreLE64(p, tree->first[i]);
+    }
+    /* Digests are bytes already */
+    if((tree->count && HCCellBufferAppend(cb, tree->node, tree->count * HC_SHA256_LEN)) ||
+        (tree->leaves && HCCellBufferAppend(cb, tree->leaf, tree->leaves * HC_SHA256_LEN)))
+        return -3;
+    HCTreeRoot(tree->node, tree->count, outRoot);
+
+    return 0;
+}
+
+/**
+ * @brief release what HCTreeLoad() returned
+ * @param tree the tree, set to NULL
+ */
+void HCTreeFree(HCTree **tree)
+{
+    HCTree *p = *tree;
+
+    if(*tree) {
+        if(p->offset) free(p->offset);
+        if(p->first) free(p->first);
+        if(p->node) free(p->node);
+        if(p->leaf) free(p->leaf);
+        free(*tree);
+        *tree = NULL;
+    }
+}
+
+/**
+ * @brief read the digest tree of a cell with a single read and check its
+ *        nodes against ROOT, the leaves are left to the caller
+ * @param cellfd the cell file
+ * @param offset where the cell begins in 'cellfd'
+ * @param infoBlock the InfoBlock of the cell
+ * @param outTree receives the tree, see HCTreeFree()
+ * @return 0 on success, 1 if the cell has no digest tree, -5 if the nodes
+ *         do not lead to ROOT, otherwise are failed
+ */
+int HCTreeLoad(int cellfd, unsigned long offset, const HCDataInfoBlock *infoBlock,
+    HCTree **outTree)
+{
+    HCTree *tree = NULL;
+    unsigned char *buf = NULL, root[HC_SHA256_LEN];
+    const unsigned char *p = NULL;
+    unsigned long long count = 0, leaves = 0;
+    unsigned long i;
+    int res = -4;
+
+    HCAssert(cellfd > -1 && infoBlock && outTree, return -1);
+    *outTree = NULL;
+    if(!infoBlock->tree)
+        return 1;
+    if(infoBlock->treeLen < HC_TREE_HEADER_LEN || infoBlock->treeLen > infoBlock->fsSize) {
+        pushdeb("in %s: bad digest tree, the cell may broken\n", __func__);
+        return -4;
+    }
+
+    HCCalloc(buf, 1, infoBlock->treeLen, return -2);
+    if(pread(cellfd, buf, infoBlock->treeLen, offset + infoBlock->tree) != (ssize_t)infoBlock->treeLen) {
+        pushdeb("in %s: failed to read digest tree, I/O error\n", __func__);
+        free(buf);
+        return -3;
+    }
+    count = HCLoadLE64(buf + 8);
+    leaves = HCLoadLE64(buf + 16);
+    /* Sections may only grow at their tail */
+    if(HCLoadLE32(buf) != HC_TREE_MAGIC || count > infoBlock->blocks ||
+        count > (infoBlock->treeLen - HC_TREE_HEADER_LEN) / HC_TREE_ROW_LEN ||
+        leaves > (infoBlock->treeLen - HC_TREE_HEADER_LEN - count * HC_TREE_ROW_LEN) / HC_SHA256_LEN)
+        goto __HCTL_FAILED;
+
+    res = -2;
+    HCCalloc(tree, 1, sizeof(HCTree), goto __HCTL_FAILED);
+    tree->count = count;
+    tree->leaves = leaves;
+    HCCalloc(tree->offset, count + 1, sizeof(unsigned long long), goto __HCTL_FAILED);
+    HCCalloc(tree->first, count + 1, sizeof(unsigned long long), goto __HCTL_FAILED);
+    HCCalloc(tree->node, count + 1, HC_SHA256_LEN, goto __HCTL_FAILED);
+    HCCalloc(tree->leaf, leaves + 1, HC_SHA256_LEN, goto __HCTL_FAILED);
+
+    res = -4;
+    p = buf + HC_TREE_HEADER_LEN;
+    for(i = 0; i < count; i++, p += 8) {
+        tree->offset[i] = HCLoadLE64(p);
+        if(i && tree->offset[i] <= tree->offset[i - 1])
+            goto __HCTL_FAILED;
+    }
+    for(i = 0; i < count; i++, p += 8) {
+        tree->first[i] = HCLoadLE64(p);
+        if(tree->first[i] > leaves || (i && tree->first[i] < tree->first[i - 1]))
+            goto __HCTL_FAILED;
+    }
+    tree->first[count] = leaves;
+    memcpy(tree->node, p, count * HC_SHA256_LEN);
+    p += count * HC_SHA256_LEN;
+    memcpy(tree->leaf, p, leaves * HC_SHA256_LEN);
+
+    /* Leaves are only trusted through the nodes, which are trusted from here on */
+    HCTreeRoot(tree->node, count, root);
+    if(memcmp(root, infoBlock->root, HC_SHA256_LEN)) {
+        pushdeb("in %s: digest tree does not match its root\n", __func__);
+        res = -5;
+        goto __HCTL_FAILED;
+    }
+    free(buf);
+    *outTree = tree;
+
+    return 0;
+
+__HCTL_FAILED:
+    if(res == -4)
+        pushdeb("in %s: bad digest tree, the cell may broken\n", __func__);
+    HCTreeFree(&tree);
+    free(buf);
+    return res;
+}
+
+/**
+ * @brief binary search the rows by offset
+ * @param tree as returned by HCTreeLoad()
+ * @param offset BID_BEGIN of a regular file, from the InfoBlock
+ * @return the row, -1 if none
+ */
+long HCTreeFind(const HCTree *tree, unsigned long long offset)
+{
+    unsigned long lo = 0, hi = tree->count, mid;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(tree->offset[mid] == offset)
+            return (long)mid;
+        if(tree->offset[mid] < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return -1;
+}
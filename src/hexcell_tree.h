@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#ifndef _HEXCELL_TREE_H_
+#define _HEXCELL_TREE_H_
+
+#include <sys/types.h>
+
+#include <hexcell_data.h>
+#include <hexcell_block.h>
+#include <hexcell_sha256.h>
+
+/* Digests, callable from any thread */
+extern void HCTreeLeaf(const unsigned char *data, unsigned long len, unsigned char *out);
+extern void HCTreeRoot(const unsigned char *hashes, unsigned long count, unsigned char *out);
+extern void HCTreeFileNode(const char *path, unsigned long long size, const unsigned char *leaves,
+    unsigned long frames, unsigned char *out);
+
+/* Writer side, rows are added in cell order */
+extern int  HCTreeAdd(HCTree *tree, unsigned long long offset, const char *path,
+    unsigned long long size, const unsigned char *leaves, unsigned long frames);
+extern int  HCTreeSerialize(HCCellBuffer *cb, const HCTree *tree, unsigned char *outRoot);
+
+/* Reader side */
+extern int  HCTreeLoad(int cellfd, unsigned long offset, const HCDataInfoBlock *infoBlock,
+    HCTree **outTree);
+extern void HCTreeFree(HCTree **tree);
+extern long HCTreeFind(const HCTree *tree, unsigned long long offset);
+#define HCTreeFrames(tree, i) ((tree)->first[(i) + 1] - (tree)->first[i])
+
+#endif /* _HEXCELL_TREE_H_ */
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#ifdef HAVE_IO_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <hexcell_utils.h>
+#include <hexcell_message.h>
+#include <hexcell_uring.h>
+
+struct _HCUring {
+    int                  fd;
+    /* Submission queue */
+    unsigned int        *sqHead;
+    unsigned int        *sqTail;
+    unsigned int        *sqMask;
+    unsigned int        *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned int         sqLocalTail;   // Queued, not yet published
+    unsigned int         sqSubmitted;   // Published, not yet taken by io_uring_enter()
+    /* Completion queue */
+    unsigned int        *cqHead;
+    unsigned int        *cqTail;
+    unsigned int        *cqMask;
+    struct io_uring_cqe *cqes;
+    /* Mappings */
+    void                *sqRing;
+    size_t               sqRingSize;
+    void                *cqRing;
+    size_t               cqRingSize;
+    size_t               sqesSize;
+    unsigned int         entries;
+};
+
+/**
+ * @brief set up a ring
+ * @param entries submission queue size
+ * @param files slots for direct descriptors, 0 for none
+ * @return the ring, NULL if io_uring is not usable here
+ */
+HCUring *HCUringNew(unsigned int entries, unsigned int files)
+{
+    struct io_uring_params params;
+    HCUring *ring = NULL;
+    int *slots = NULL;
+    unsigned int i;
+
+    HCCalloc(ring, 1, sizeof(HCUring), return NULL);
+    memset(&params, 0, sizeof(params));
+    if((ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params)) < 0) {
+        pushdeb("in %s: io_uring not available, %s\n", __func__, strerror(errno));
+        free(ring);
+        return NULL;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    /* Both rings live in one mapping on kernels that say so */
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    if((ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+        goto __HCUN_FAILED;
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqRing = ring->sqRing;
+    else if((ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        goto __HCUN_FAILED;
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    if((ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto __HCUN_FAILED;
+    }
+
+    ring->sqHead = (unsigned int *)((char *)ring->sqRing + params.sq_off.head);
+    ring->sqTail = (unsigned int *)((char *)ring->sqRing + params.sq_off.tail);
+    ring->sqMask = (unsigned int *)((char *)ring->sqRing + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned int *)((char *)ring->sqRing + params.sq_off.array);
+    ring->cqHead = (unsigned int *)((char *)ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned int *)((char *)ring->cqRing + params.cq_off.tail);
+    ring->cqMask = (unsigned int *)((char *)ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cqRing + params.cq_off.cqes);
+    ring->sqLocalTail = ring->sqSubmitted = *ring->sqTail;
+
+    if(files) {
+        /* Empty slots, filled by openat with a file_index */
+        HCCalloc(slots, files, sizeof(int), goto __HCUN_FAILED);
+        for(i = 0; i < files; i++)
+            slots[i] = -1;
+        if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, slots, files) < 0) {
+            pushdeb("in %s: failed to register files, %s\n", __func__, strerror(errno));
+            free(slots);
+            goto __HCUN_FAILED;
+        }
+        free(slots);
+    }
+
+    return ring;
+
+__HCUN_FAILED:
+    ring->sqRing = ring->sqRing == MAP_FAILED ? NULL : ring->sqRing;
+    ring->cqRing = ring->cqRing == MAP_FAILED ? NULL : ring->cqRing;
+    HCUringDestroy(&ring);
+    return NULL;
+}
+
+void HCUringDestroy(HCUring **ring)
+{
+    HCUring *p = *ring;
+
+    if(*ring) {
+        if(p->sqes) munmap(p->sqes, p->sqesSize);
+        if(p->cqRing && p->cqRing != p->sqRing) munmap(p->cqRing, p->cqRingSize);
+        if(p->sqRing) munmap(p->sqRing, p->sqRingSize);
+        close(p->fd);
+        free(*ring);
+        *ring = NULL;
+    }
+}
+
+struct io_uring_sqe *HCUringGetSqe(HCUring *ring)
+{
+    struct io_uring_sqe *sqe = NULL;
+    unsigned int head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+
+    if(ring->sqLocalTail - head >= ring->entries)
+        return NULL;
+    sqe = &ring->sqes[ring->sqLocalTail & *ring->sqMask];
+    ring->sqArray[ring->sqLocalTail & *ring->sqMask] = ring->sqLocalTail & *ring->sqMask;
+    ring->sqLocalTail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    return sqe;
+}
+
+int HCUringSubmitAndWait(HCUring *ring, unsigned int waitNr)
+{
+    unsigned int toSubmit;
+    int res;
+
+    /* The kernel sees the SQEs once the tail moves past them */
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    toSubmit = ring->sqLocalTail - ring->sqSubmitted;
+    while(1) {
+        res = (int)syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitNr,
+            waitNr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(res < 0) {
+            if(errno == EINTR)
+                continue;
+            return -errno;
+        }
+        ring->sqSubmitted += res;
+        toSubmit -= res;
+        /* Taken in part, the CQ was full or memory was short */
+        if(!toSubmit)
+            break;
+        waitNr = 0;
+    }
+
+    return 0;
+}
+
+int HCUringPopCqe(HCUring *ring, struct io_uring_cqe *cqe)
+{
+    unsigned int head = *ring->cqHead;
+
+    if(head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return 0;
+    memcpy(cqe, &ring->cqes[head & *ring->cqMask], sizeof(struct io_uring_cqe));
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016 Devoleda Organisation. All rights reserved.
+ * Copyright (c) Ethan Levy <eitanlevy97@yandex.com>
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DEVOLEDA ORGANISATION ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * @DEVOLEDA_OSES_BSD_LICENCE_END@
+ *
+ */
+
+#ifndef _HEXCELL_URING_H_
+#define _HEXCELL_URING_H_
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+
+/* Minimal io_uring on the raw system calls, one per thread. Only what the
+   extractor needs: queue SQEs, submit them and collect every completion.
+   Only with HAVE_IO_URING, needs the kernel headers and Linux 5.15 or newer
+   at run time for direct descriptors, no library */
+typedef struct _HCUring HCUring;
+
+/* NULL when the kernel has no io_uring or refuses it, callers then go
+   synchronous. 'files' slots are set up for direct descriptors */
+extern HCUring *HCUringNew(unsigned int entries, unsigned int files);
+extern void     HCUringDestroy(HCUring **ring);
+
+/* A cleared SQE, NULL while the submission queue is full */
+extern struct io_uring_sqe *HCUringGetSqe(HCUring *ring);
+
+/* Submits everything queued and waits until 'waitNr' completions are
+   there. 0 or a negative errno */
+extern int      HCUringSubmitAndWait(HCUring *ring, unsigned int waitNr);
+
+/* Takes the oldest completion, 0 if there is none */
+extern int      HCUringPopCqe(HCUring *ring, struct io_uring_cqe *cqe);
+
+#endif /* HAVE_IO_URING */
+
+#endif /* _HEXCELL_URING_H_ */
@@ -64,6 +64,27 @@ int HCReadFileX(int fd, void *buffer, size_t size)
     return (read(fd, buffer, size) == size) ? 0 : 1;
 }
 
+/* Short writes and interrupted calls are resumed where they stopped */
+int HCPWriteFileX(int fd, void *buffer, size_t size, off_t offset)
+{
+    size_t done = 0;
+    ssize_t n = 0;
+
+    while(done < size) {
+        if((n = pwrite(fd, (char *)buffer + done, size - done, offset + (off_t)done)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return 1;
+        }
+        /* Nothing written and no error, retrying would spin */
+        if(!n)
+            return 1;
+        done += (size_t)n;
+    }
+
+    return 0;
+}
+
 /**
  * @brief check whether a file is exist
  * @param filename the name of file to be checked
@@ -137,14 +158,14 @@ void *HCMemdup(const void *p, size_t plen)
 
 int HCCreateFile(const char *path, size_t size, mode_t mode)
 {
-    const char endmark = 0x0F;
     int fd = -1;
 
     if((fd = creat(path, mode)) == -1)
         return 1;
-    if(size > 1) {
-        lseek(fd, size - sizeof(char), SEEK_END);
-        write(fd, (void *)&endmark, sizeof(char));
+    /* Sized without writing, what is not written later stays a hole */
+    if(ftruncate(fd, size)) {
+        close(fd);
+        return 1;
     }
 
     close(fd);
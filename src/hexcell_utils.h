@@ -32,13 +32,19 @@
 #ifndef _HEXCELL_UTILS_H_
 #define _HEXCELL_UTILS_H_
 
-#if defined(LITTLE_ENDIAN) && !defined(BIG_ENDIAN)
-#define HCSwapBytes(a) \
-    ((unsigned int)a >> 24) | ((unsigned int)a >> 8) & 0x0000ff00 | (a << 8) & \
-    0x00ff0000 | (a << 24)
-#else
-#define HCSwapBytes(a) a
-#endif
+/* Little-endian loads and stores of explicit width, the on-disk layouts do
+   not depend on the host. 'p' is an unsigned char pointer */
+#define HCLoadLE16(p) ((unsigned short)((p)[0] | (p)[1] << 8))
+#define HCLoadLE32(p) ((unsigned int)(p)[0] | (unsigned int)(p)[1] << 8 | \
+    (unsigned int)(p)[2] << 16 | (unsigned int)(p)[3] << 24)
+#define HCLoadLE64(p) ((unsigned long long)HCLoadLE32(p) | \
+    (unsigned long long)HCLoadLE32((p) + 4) << 32)
+#define HCStoreLE16(p, v) do { unsigned short _v = (v); \
+    (p)[0] = _v; (p)[1] = _v >> 8; } while(0)
+#define HCStoreLE32(p, v) do { unsigned int _v = (v); \
+    (p)[0] = _v; (p)[1] = _v >> 8; (p)[2] = _v >> 16; (p)[3] = _v >> 24; } while(0)
+#define HCStoreLE64(p, v) do { unsigned long long _w = (v); \
+    HCStoreLE32(p, (unsigned int)_w); HCStoreLE32((p) + 4, (unsigned int)(_w >> 32)); } while(0)
 #define HCCharSwap(ch) (                        \
     ((ch & 1) << 7)                |            \
     ((ch & (0b10)) << 5)           |            \
@@ -54,6 +60,7 @@
 
 extern int HCWriteFileX(int fd, void *buffer, size_t size);
 extern int HCReadFileX(int fd, void *buffer, size_t size);
+extern int HCPWriteFileX(int fd, void *buffer, size_t size, off_t offset);
 extern int isFileExists(const char *filename);
 extern int mkpath(const char *s, mode_t mode);
 extern void *HCMemdup(const void *p, size_t plen);